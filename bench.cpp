@@ -0,0 +1,180 @@
+#include "expression.h"
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <vector>
+using namespace std;
+
+// Mede, sobre um corpus de fórmulas representativas, cada etapa do caminho de uma expressão:
+// ExprParser::parse, a compilação em toExpr, o cálculo direto na árvore (ExprNode::calc) e o
+// cálculo do bytecode (Expr::calc) linha a linha, em lote (em double e em float) e pela função
+// gerada por ExprJit.
+// Os resultados saem em JSON, em stdout ou no arquivo passado como argumento, para comparar
+// execuções; um resumo legível sai em stderr.
+// Compilação: g++ -std=c++11 -O2 -pthread bench.cpp -o bench
+// Uso: bench [saída.json]
+
+struct Formula {
+	string name;
+	string category;
+	string src;
+};
+
+static vector<Formula> corpus() {
+	vector<Formula> list = {
+		{"affine",     "short",  "x*y+z"},
+		{"degrees",    "short",  "2*PI*r/360"},
+		{"ratio",      "short",  "(a+b)*(a-b)/(a*a+b*b+1)"},
+		{"mixed",      "short",  "|x-y|/(1+|x|+|y|)-((x+1)*(y+2)-(z+3))/4"},
+		{"chain",      "nested", "((((x+1)*2-3)/4+5)*6-7)/8+((((y+1)*2-3)/4+5)*6-7)/8"},
+		{"cosines",    "calls",  "x^2+y^2-2*x*y*cos(t)"},
+		{"gauss",      "calls",  "exp(-(x-m)^2/(2*s^2))/(s*2.5066282746310002)"},
+		{"identity",   "calls",  "sin(x*y)^2+cos(x*y)^2+x*y"},
+		{"trig",       "calls",  "atan(tan(x)+sin(y))*acos(cos(x)/2)+ln(1+exp(-y))+log(1+|x|)"},
+		{"cubic",      "pow",    "a*x^3+b*x^2+c*x+d"},
+		{"powers",     "pow",    "x^0.5+y^1.5+(x*y)^-2+(x+y)^z"},
+		{"caps",       "cond",   "clamp(x*y,-1,1)+max(z-x,0)+(x>y ? x-y : min(y,2))"},
+	};
+	// Aninhamento profundo: 64 níveis de parênteses
+	string deep = "x";
+	for (int i=0; i<64; ++i) deep = "(" + deep + (i % 2 ? "*y" : "+0.5") + ")";
+	list.push_back({"deep64", "nested", deep});
+	// Muitas variáveis: 64 argumentos distintos
+	string wide;
+	char name[8];
+	for (int i=0; i<64; ++i) {
+		snprintf(name, sizeof(name), "v%02d", i);
+		wide += (i ? (i % 3 ? "+" : "*") : "") + string(name);
+	}
+	list.push_back({"wide64", "vars", wide});
+	return list;
+}
+
+static volatile double sink;
+
+// Tempo por chamada de fn(), em ns: repete até somar pelo menos 20 ms e fica com a melhor de três
+// medições
+template <typename F>
+static double measure(F fn) {
+	double best = 1e300;
+	for (int round=0; round<3; ++round) {
+		for (long reps=1;; reps*=2) {
+			auto start = chrono::steady_clock::now();
+			for (long r=0; r<reps; ++r) fn();
+			double secs = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+			if (secs >= 0.02) {
+				best = min(best, secs * 1e9 / reps);
+				break;
+			}
+		}
+	}
+	return best;
+}
+
+int main(int argc, char* argv[]) {
+	const int rows = 1024;
+	FILE* out = argc > 1 ? fopen(argv[1], "w") : stdout;
+	if (!out) {
+		fprintf(stderr, "Nao foi possivel criar %s\n", argv[1]);
+		return 1;
+	}
+	fprintf(out, "{\n  \"rows\": %d,\n  \"results\": [\n", rows);
+	vector<Formula> list = corpus();
+	for (size_t f=0; f<list.size(); ++f) {
+		const Formula &formula = list[f];
+		ExprParser parser;
+		double parseNs = measure([&]() { sink = parser.parse(formula.src); });
+
+		// Compilação: só toExpr, sobre a árvore já lida e com as funções padrão definidas. toExpr
+		// simplifica uma cópia da árvore, que assim é a mesma em todas as repetições
+		parser.parse(formula.src);
+		parser.std();
+		double compileNs = measure([&]() {
+			Expr expr = parser.toExpr();
+			sink = expr.valid();
+		});
+		// toExpr numerou as variáveis livres; a árvore é lida de novo para a medição seguinte
+		parser.parse(formula.src);
+		parser.std();
+
+		// Dados: linha i, argumento j; as variáveis da árvore apontam para a linha corrente
+		vector<string> vars = parser.nullVars();
+		int nArgs = vars.size();
+		vector<double> args(rows * (nArgs ? nArgs : 1));
+		for (size_t i=0; i<args.size(); ++i) args[i] = 0.5 + (i % 97) * 0.01;
+		vector<double> row(nArgs ? nArgs : 1);
+		for (int j=0; j<nArgs; ++j) parser.setVar(vars[j], &row[j]);
+		double treeNs = measure([&]() {
+			double sum = 0;
+			for (int i=0; i<rows; ++i) {
+				for (int j=0; j<nArgs; ++j) row[j] = args[i * nArgs + j];
+				sum += parser.calc();
+			}
+			sink = sum;
+		}) / rows;
+
+		parser.parse(formula.src);
+		parser.std();
+		Expr expr = parser.toExpr();
+		double evalNs = measure([&]() {
+			double sum = 0;
+			for (int i=0; i<rows; ++i) sum += expr.calc(&args[i * nArgs]);
+			sink = sum;
+		}) / rows;
+
+		vector<vector<double> > cols(nArgs, vector<double>(rows));
+		vector<const double*> colPtrs(nArgs ? nArgs : 1);
+		for (int j=0; j<nArgs; ++j) {
+			for (int i=0; i<rows; ++i) cols[j][i] = args[i * nArgs + j];
+			colPtrs[j] = cols[j].data();
+		}
+		vector<double> res(rows);
+		double batchNs = measure([&]() {
+			expr.calc(colPtrs.data(), res.data(), rows);
+			sink = res[rows - 1];
+		}) / rows;
+
+		// Lote em float, com os valores intermediários em float
+		vector<vector<float> > floatCols(nArgs, vector<float>(rows));
+		vector<const float*> floatPtrs(nArgs ? nArgs : 1);
+		for (int j=0; j<nArgs; ++j) {
+			for (int i=0; i<rows; ++i) floatCols[j][i] = cols[j][i];
+			floatPtrs[j] = floatCols[j].data();
+		}
+		vector<float> floatRes(rows);
+		double floatNs = measure([&]() {
+			expr.calc(floatPtrs.data(), floatRes.data(), rows);
+			sink = floatRes[rows - 1];
+		}) / rows;
+
+		ExprJit jit(expr);
+		double jitNs = -1;
+		if (jit.valid()) {
+			ExprJit::TFunction fn = jit.function();
+			jitNs = measure([&]() {
+				double sum = 0;
+				for (int i=0; i<rows; ++i) sum += fn(&args[i * nArgs]);
+				sink = sum;
+			}) / rows;
+		}
+
+		fprintf(out, "    {\"name\": \"%s\", \"category\": \"%s\", \"length\": %zu, \"args\": %d, "
+			"\"bytecode_bytes\": %zu,\n", formula.name.c_str(), formula.category.c_str(),
+			formula.src.size(), nArgs, expr.getBytecode().size());
+		fprintf(out, "     \"parse_ns\": %.1f, \"parse_mb_s\": %.1f, \"compile_ns\": %.1f, "
+			"\"tree_ns\": %.2f,\n", parseNs, formula.src.size() * 1e3 / parseNs, compileNs, treeNs);
+		fprintf(out, "     \"eval_ns\": %.2f, \"batch_ns\": %.2f, \"batch_mrows_s\": %.1f, "
+			"\"batch_f32_ns\": %.2f, ", evalNs, batchNs, 1e3 / batchNs, floatNs);
+		if (jitNs >= 0) {
+			fprintf(out, "\"jit_ns\": %.2f}", jitNs);
+		} else {
+			fprintf(out, "\"jit_ns\": null}");
+		}
+		fprintf(out, "%s\n", f + 1 < list.size() ? "," : "");
+		fprintf(stderr, "%-9s %-7s parse %8.1f ns  compile %8.1f ns  tree %7.2f  eval %7.2f  "
+			"batch %6.2f  f32 %6.2f  jit %6.2f ns/row\n", formula.name.c_str(),
+			formula.category.c_str(), parseNs, compileNs, treeNs, evalNs, batchNs, floatNs, jitNs);
+	}
+	fprintf(out, "  ]\n}\n");
+	if (out != stdout) fclose(out);
+}
@@ -0,0 +1,132 @@
+#include "expression.h"
+#include <cmath>
+#include <cstdio>
+#include <string>
+#include <vector>
+using namespace std;
+
+// Confere, sobre um corpus fixo de fórmulas e de valores (zeros com sinal, infinitos, NaN), que
+// os caminhos de cálculo de uma expressão dão o mesmo resultado: a árvore (ExprNode::calc), o
+// bytecode linha a linha (Expr::calc), com perfil (ExprProfile) e especializado, o lote em double
+// e em float e a função gerada por ExprJit, para cada conjunto de kernels disponível. Confere
+// também que o intervalo calculado a partir dos argumentos contém o valor do bytecode.
+// As funções padrão dos kernels SIMD não são corretamente arredondadas; por isso os valores são
+// comparados com uma tolerância relativa, mas o sinal de um zero precisa ser o mesmo.
+// Compilação: g++ -std=c++11 -O2 -pthread check.cpp -o check
+// Uso: check (a saída é diferente de 0 se houver divergências)
+
+static vector<string> corpus() {
+	vector<string> list = {
+		"x*y+z", "(x+1)*(y+2)+(z-1)*(x+3)", "x/2-y/3", "1/x", "3-x", "y/x", "x*y+x*y",
+		"x+0", "0-x", "x*0", "|x|", "-x", "|x-y|/(1+|x|+|y|)",
+		"x^2", "x^3", "x^-1", "x^-2", "x^0.5", "x^1.5", "x^16", "x^-16", "x^17", "(x+y)^z",
+		"sin(x)*cos(y)", "tan(x)+atan(y)", "asin(x)+acos(y)", "exp(x)-ln(y)+log(z)",
+		"x<y", "x<=y", "x>y", "x>=y", "x==y", "x!=y", "x<y ? x : y", "x ? y : z ? x : y",
+		"min(x,y)", "max(x,y)+min(y,z)", "clamp(x,y,z)", "clamp(x,-1,1)*y", "if(x-1,y,z)",
+		"(x>=1)*2+(y!=z)", "x>0 ? x^2 : -x",
+	};
+	// Aninhamento: a expressão em um contexto que gera temporários e instruções combinadas
+	string deep = "min(x,z)+(x<y ? y : z)";
+	for (int i=0; i<9; ++i) deep = "x*(y+(" + deep + "))";
+	list.push_back(deep);
+	return list;
+}
+
+static const double values[] = {0, -0.0, 1.5, -2.25, 3, 1e300, -INFINITY, INFINITY, NAN, 0.1, -7};
+static const int nValues = sizeof(values) / sizeof(values[0]);
+
+static bool same(double a, double b, double tolerance) {
+	if (a != a || b != b) return a != a && b != b;
+	if (a == b) return a != 0 || signbit(a) == signbit(b);
+	return fabs(a - b) <= tolerance * (fabs(a) + fabs(b));
+}
+
+// Confere as linhas de uma fórmula com os kernels atuais; devolve a quantidade de divergências
+static int check(const string &src, const char* kernels) {
+	ExprParser parser;
+	if (!parser.parse(src)) {
+		printf("%s: erro de sintaxe\n", src.c_str());
+		return 1;
+	}
+	parser.std();
+	// As variáveis da árvore apontam para a linha corrente; toExpr as numera na mesma ordem
+	vector<string> vars = parser.nullVars();
+	int nArgs = vars.size();
+	vector<double> row(nArgs ? nArgs : 1);
+	for (int j=0; j<nArgs; ++j) parser.setVar(vars[j], &row[j]);
+	ExprParser compiled;
+	compiled.parse(src);
+	compiled.std();
+	Expr expr = compiled.toExpr();
+	Expr specialized = expr.specialize();
+	ExprJit jit(expr);
+
+	// Todas as combinações de valores das três primeiras variáveis
+	long rows = 1;
+	for (int j=0; j<nArgs && j<3; ++j) rows *= nValues;
+	vector<vector<double> > cols(nArgs, vector<double>(rows));
+	vector<vector<float> > floatCols(nArgs, vector<float>(rows));
+	vector<const double*> colPtrs(nArgs ? nArgs : 1);
+	vector<const float*> floatPtrs(nArgs ? nArgs : 1);
+	for (int j=0; j<nArgs; ++j) {
+		long step = 1;
+		for (int k=0; k<j && k<3; ++k) step *= nValues;
+		for (long i=0; i<rows; ++i) {
+			cols[j][i] = values[(j < 3 ? i / step : i + j) % nValues];
+			floatCols[j][i] = cols[j][i];
+		}
+		colPtrs[j] = cols[j].data();
+		floatPtrs[j] = floatCols[j].data();
+	}
+	vector<double> batch(rows), jitBatch(rows);
+	vector<float> floatBatch(rows);
+	expr.calc(colPtrs.data(), batch.data(), rows);
+	expr.calc(floatPtrs.data(), floatBatch.data(), rows);
+	if (jit.valid()) jit.calc(colPtrs.data(), jitBatch.data(), rows);
+
+	int fails = 0;
+	vector<double> args(nArgs ? nArgs : 1), floatArgs(nArgs ? nArgs : 1);
+	vector<ExprInterval> intervals(nArgs ? nArgs : 1);
+	for (long i=0; i<rows; ++i) {
+		for (int j=0; j<nArgs; ++j) {
+			row[j] = args[j] = cols[j][i];
+			floatArgs[j] = floatCols[j][i];
+			intervals[j] = ExprInterval(args[j]);
+		}
+		double value = expr.calc(args.data());
+		ExprProfile profile;
+		ExprInterval bounds = expr.calc(intervals.data());
+		const char* failed = nullptr;
+		if (!same(value, parser.calc(), 1e-12)) failed = "arvore";
+		else if (!same(value, expr.calc(args.data(), profile), 0)) failed = "perfil";
+		else if (!same(value, specialized.calc(args.data()), 1e-12)) failed = "especializado";
+		else if (!same(value, batch[i], 1e-12)) failed = "lote";
+		else if (!same(expr.calc(floatArgs.data()), floatBatch[i], 1e-4)) failed = "lote float";
+		else if (jit.valid() && !same(value, jit.calc(args.data()), 1e-12)) failed = "jit";
+		else if (jit.valid() && !same(value, jitBatch[i], 1e-12)) failed = "jit em lote";
+		else if (value == value && !bounds.contains(value)) failed = "intervalo";
+		if (failed && fails++ < 3) {
+			printf("%s [%s]: %s diverge na linha", src.c_str(), kernels, failed);
+			for (int j=0; j<nArgs; ++j) printf(" %s=%g", vars[j].c_str(), args[j]);
+			printf(" (bytecode %g, intervalo [%g, %g])\n", value, bounds.lo, bounds.hi);
+		}
+	}
+	return fails;
+}
+
+int main() {
+	vector<const ExprKernels*> kernels = {&ExprKernels::scalar(), ExprKernels::avx2(),
+		ExprKernels::avx512()};
+	vector<const ExprFloatKernels*> floatKernels = {&ExprFloatKernels::scalar(),
+		ExprFloatKernels::avx2(), ExprFloatKernels::avx512()};
+	vector<string> list = corpus();
+	int fails = 0;
+	for (size_t k=0; k<kernels.size(); ++k) {
+		if (!kernels[k] || !floatKernels[k]) continue;
+		ExprKernels::set(*kernels[k]);
+		ExprFloatKernels::set(*floatKernels[k]);
+		for (const string &src : list) fails += check(src, kernels[k]->name);
+	}
+	printf("%d divergencias\n", fails);
+	return fails != 0;
+}
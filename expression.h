@@ -2,108 +2,3721 @@
 #define EXPRESSION_H
 
 #include <map>
+#include <algorithm>
 #include <cmath>
+#include <cfloat>
+#include <cstring>
 #include <vector>
 #include <string>
+#include <unordered_map>
+#include <new>
+#include <utility>
+#include <list>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <type_traits>
+#if __cplusplus >= 201703L
+#include <string_view>
+#endif
+
+typedef double (*TExprFunction) (const double[]);
+// Função em lote: args[i] aponta para os n valores do i-ésimo argumento e o resultado da linha k
+// vai para res[k]. Chamada uma vez por bloco na avaliação em lote e com n = 1 nas demais
+typedef void (*TExprBatchFunction) (const double* const args[], double res[], int n);
+
+// Propriedades de uma função registrada com setCall
+#define EXPR_CALL_PURE 0x01 // Sem efeitos colaterais: pode ser avaliada em tempo de compilação
+// Quantidade de argumentos aceita (sem ela, qualquer uma). Uma chamada com outra quantidade é
+// tratada como função não definida
+#define EXPR_CALL_ARITY(n) (((n) + 1) << 8)
+// Argumentos de uma chamada sobre uma linha sem alocação (ExprCalls::callBatch, ExprNodeCall)
+#define EXPR_CALL_LOCAL 16
+
+// ---------------------------------------------------------------------------------------------- //
+// Funções padrão registradas por ExprParser::std()                                               //
+// ---------------------------------------------------------------------------------------------- //
+class ExprCalls {
+public:
+	static double call_ln(const double args[]) {
+		return log(args[0]);
+	}
+	static double call_log(const double args[]) {
+		return log10(args[0]);
+	}
+	static double call_exp(const double args[]) {
+		return exp(args[0]);
+	}
+	static double call_sin(const double args[]) {
+		return sin(args[0]);
+	}
+	static double call_cos(const double args[]) {
+		return cos(args[0]);
+	}
+	static double call_tan(const double args[]) {
+		return tan(args[0]);
+	}
+	static double call_asin(const double args[]) {
+		return asin(args[0]);
+	}
+	static double call_acos(const double args[]) {
+		return acos(args[0]);
+	}
+	static double call_atan(const double args[]) {
+		return atan(args[0]);
+	}
+	// Com NaN, min e max resultam no segundo argumento (como minsd e maxsd). Estas quatro viram
+	// instruções próprias do bytecode (ExprDag::addCall)
+	static double call_min(const double args[]) {
+		return args[0] < args[1] ? args[0] : args[1];
+	}
+	static double call_max(const double args[]) {
+		return args[0] > args[1] ? args[0] : args[1];
+	}
+	// clamp(x, lo, hi) = min(max(x, lo), hi)
+	static double call_clamp(const double args[]) {
+		double x = args[0] > args[1] ? args[0] : args[1];
+		return x < args[2] ? x : args[2];
+	}
+	// if(c, a, b): a se c for diferente de 0 (NaN inclusive), senão b. Os dois ramos são calculados
+	static double call_if(const double args[]) {
+		return args[0] != 0 ? args[1] : args[2];
+	}
+	// Nome usado por ExprParser::std para a função, ou nullptr se ela não for padrão
+	static const char* name(TExprFunction ref) {
+		if (ref == call_ln) return "ln";
+		if (ref == call_log) return "log";
+		if (ref == call_exp) return "exp";
+		if (ref == call_sin) return "sin";
+		if (ref == call_cos) return "cos";
+		if (ref == call_tan) return "tan";
+		if (ref == call_asin) return "asin";
+		if (ref == call_acos) return "acos";
+		if (ref == call_atan) return "atan";
+		if (ref == call_min) return "min";
+		if (ref == call_max) return "max";
+		if (ref == call_clamp) return "clamp";
+		if (ref == call_if) return "if";
+		return nullptr;
+	}
+	// Função padrão com o nome dado, ou nullptr
+	static TExprFunction find(const std::string &name) {
+		static const TExprFunction calls[] = {call_ln, call_log, call_exp, call_sin, call_cos,
+			call_tan, call_asin, call_acos, call_atan, call_min, call_max, call_clamp, call_if};
+		for (TExprFunction ref : calls) {
+			if (name == ExprCalls::name(ref)) return ref;
+		}
+		return nullptr;
+	}
+	// Chama a função em lote ref sobre uma única linha, com os n argumentos contíguos em args. Os
+	// ponteiros ficam em um vetor local; só chamadas com muitos argumentos usam o heap
+	static double callBatch(TExprBatchFunction ref, const double args[], int n) {
+		const double* local[EXPR_CALL_LOCAL];
+		std::vector <const double*> heap;
+		const double** ptrs = local;
+		if (n > EXPR_CALL_LOCAL) {
+			heap.resize(n);
+			ptrs = heap.data();
+		}
+		for (int i=0; i<n; ++i) ptrs[i] = args + i;
+		double res = 0;
+		ref(ptrs, &res, 1);
+		return res;
+	}
+};
+
+// ---------------------------------------------------------------------------------------------- //
+// Kernels que aplicam uma operação sobre um bloco de linhas da avaliação em lote                 //
+// ---------------------------------------------------------------------------------------------- //
+typedef void (*TExprKernel1) (double[], int); // dst[i] = f(dst[i])
+typedef void (*TExprKernel2) (double[], const double[], int); // dst[i] = dst[i] op src[i]
+// dst[i] = dst[i] != 0 ? a[i] : b[i]
+typedef void (*TExprKernel3) (double[], const double[], const double[], int);
+
+// Os kernels vetoriais dependem da semântica IEEE (NaN, arredondamento); com -ffast-math apenas o
+// conjunto escalar é usado
+#if defined(__GNUC__) && defined(__x86_64__) && !defined(__FAST_MATH__)
+#define EXPR_SIMD
+#endif
+
+struct ExprKernels {
+	const char* name;
+	TExprKernel2 add, sub, mul, div, pow;
+	TExprKernel1 abs, neg;
+	TExprKernel1 ln, log, exp, sin, cos, tan, asin, acos, atan;
+	TExprKernel2 min, max;
+	TExprKernel2 cmp[6]; // <, <=, >, >=, ==, !=: 1 ou 0
+	TExprKernel3 select;
+	// Kernel equivalente a uma das funções padrão, ou nullptr
+	TExprKernel1 find(TExprFunction ref) const {
+		if (ref == ExprCalls::call_ln)   return ln;
+		if (ref == ExprCalls::call_log)  return log;
+		if (ref == ExprCalls::call_exp)  return exp;
+		if (ref == ExprCalls::call_sin)  return sin;
+		if (ref == ExprCalls::call_cos)  return cos;
+		if (ref == ExprCalls::call_tan)  return tan;
+		if (ref == ExprCalls::call_asin) return asin;
+		if (ref == ExprCalls::call_acos) return acos;
+		if (ref == ExprCalls::call_atan) return atan;
+		return nullptr;
+	}
+	static const ExprKernels& scalar();
+	static const ExprKernels* avx2(); // nullptr se a CPU não suportar
+	static const ExprKernels* avx512(); // nullptr se a CPU não suportar
+	// Conjunto usado pela avaliação em lote; por padrão o melhor suportado pela CPU
+	static const ExprKernels*& current() {
+		static const ExprKernels* kernels = best();
+		return kernels;
+	}
+	static const ExprKernels& get() {
+		return *current();
+	}
+	static void set(const ExprKernels& kernels) {
+		current() = &kernels;
+	}
+	static const ExprKernels* best() {
+		if (avx512()) return avx512();
+		if (avx2()) return avx2();
+		return &scalar();
+	}
+};
+
+class ExprScalarKernels {
+public:
+	static void add(double d[], const double s[], int n) {
+		for (int i=0; i<n; ++i) d[i] += s[i];
+	}
+	static void sub(double d[], const double s[], int n) {
+		for (int i=0; i<n; ++i) d[i] -= s[i];
+	}
+	static void mul(double d[], const double s[], int n) {
+		for (int i=0; i<n; ++i) d[i] *= s[i];
+	}
+	static void div(double d[], const double s[], int n) {
+		for (int i=0; i<n; ++i) d[i] /= s[i];
+	}
+	static void pow(double d[], const double s[], int n) {
+		for (int i=0; i<n; ++i) d[i] = ::pow(d[i], s[i]);
+	}
+	static void abs(double d[], int n) {
+		for (int i=0; i<n; ++i) d[i] = d[i] >= 0 ? d[i] : - d[i];
+	}
+	static void neg(double d[], int n) {
+		for (int i=0; i<n; ++i) d[i] = - d[i];
+	}
+	// Mínimo, máximo, comparações e seleção, em double e em float. Os laços não têm desvios: o
+	// compilador os transforma em comparações vetoriais com máscara
+	template <class T> static void min(T d[], const T s[], int n) {
+		for (int i=0; i<n; ++i) d[i] = d[i] < s[i] ? d[i] : s[i];
+	}
+	template <class T> static void max(T d[], const T s[], int n) {
+		for (int i=0; i<n; ++i) d[i] = d[i] > s[i] ? d[i] : s[i];
+	}
+	template <class T> static void lt(T d[], const T s[], int n) {
+		for (int i=0; i<n; ++i) d[i] = d[i] < s[i];
+	}
+	template <class T> static void le(T d[], const T s[], int n) {
+		for (int i=0; i<n; ++i) d[i] = d[i] <= s[i];
+	}
+	template <class T> static void gt(T d[], const T s[], int n) {
+		for (int i=0; i<n; ++i) d[i] = d[i] > s[i];
+	}
+	template <class T> static void ge(T d[], const T s[], int n) {
+		for (int i=0; i<n; ++i) d[i] = d[i] >= s[i];
+	}
+	template <class T> static void eq(T d[], const T s[], int n) {
+		for (int i=0; i<n; ++i) d[i] = d[i] == s[i];
+	}
+	template <class T> static void ne(T d[], const T s[], int n) {
+		for (int i=0; i<n; ++i) d[i] = d[i] != s[i];
+	}
+	template <class T> static void select(T d[], const T a[], const T b[], int n) {
+		for (int i=0; i<n; ++i) d[i] = d[i] != 0 ? a[i] : b[i];
+	}
+	// Operações básicas em float (ExprFloatKernels)
+	static void add(float d[], const float s[], int n) {
+		for (int i=0; i<n; ++i) d[i] += s[i];
+	}
+	static void sub(float d[], const float s[], int n) {
+		for (int i=0; i<n; ++i) d[i] -= s[i];
+	}
+	static void mul(float d[], const float s[], int n) {
+		for (int i=0; i<n; ++i) d[i] *= s[i];
+	}
+	static void div(float d[], const float s[], int n) {
+		for (int i=0; i<n; ++i) d[i] /= s[i];
+	}
+	static void abs(float d[], int n) {
+		for (int i=0; i<n; ++i) d[i] = d[i] >= 0 ? d[i] : - d[i];
+	}
+	static void neg(float d[], int n) {
+		for (int i=0; i<n; ++i) d[i] = - d[i];
+	}
+	static void widen(double d[], const float s[], int n) {
+		for (int i=0; i<n; ++i) d[i] = s[i];
+	}
+	static void narrow(float d[], const double s[], int n) {
+		for (int i=0; i<n; ++i) d[i] = s[i];
+	}
+	static void ln(double d[], int n) {
+		for (int i=0; i<n; ++i) d[i] = ::log(d[i]);
+	}
+	static void log(double d[], int n) {
+		for (int i=0; i<n; ++i) d[i] = ::log10(d[i]);
+	}
+	static void exp(double d[], int n) {
+		for (int i=0; i<n; ++i) d[i] = ::exp(d[i]);
+	}
+	static void sin(double d[], int n) {
+		for (int i=0; i<n; ++i) d[i] = ::sin(d[i]);
+	}
+	static void cos(double d[], int n) {
+		for (int i=0; i<n; ++i) d[i] = ::cos(d[i]);
+	}
+	static void tan(double d[], int n) {
+		for (int i=0; i<n; ++i) d[i] = ::tan(d[i]);
+	}
+	static void asin(double d[], int n) {
+		for (int i=0; i<n; ++i) d[i] = ::asin(d[i]);
+	}
+	static void acos(double d[], int n) {
+		for (int i=0; i<n; ++i) d[i] = ::acos(d[i]);
+	}
+	static void atan(double d[], int n) {
+		for (int i=0; i<n; ++i) d[i] = ::atan(d[i]);
+	}
+	// x^n (n != 0) por quadrados sucessivos: a sequência de multiplicações da instrução POWI,
+	// seguida pela VM, pela avaliação em lote e pelo JIT
+	static double powi(double x, int n) {
+		unsigned int m = n < 0 ? - n : n;
+		double b = x;
+		while (!(m & 1)) {
+			b *= b;
+			m >>= 1;
+		}
+		double r = b;
+		while (m >>= 1) {
+			b *= b;
+			if (m & 1) r *= b;
+		}
+		return n < 0 ? 1 / r : r;
+	}
+	// x^0.5 com os casos especiais de pow, que diferem de sqrt em -0 (+0) e -inf (+inf)
+	static double sqrt(double x) {
+		return x == - HUGE_VAL ? HUGE_VAL : ::sqrt(x) + 0.0;
+	}
+	static float sqrt(float x) {
+		return x == - HUGE_VALF ? HUGE_VALF : ::sqrtf(x) + 0.0f;
+	}
+	template <class T> static void sqrt(T d[], int n) {
+		for (int i=0; i<n; ++i) d[i] = sqrt(d[i]);
+	}
+};
+
+inline const ExprKernels& ExprKernels::scalar() {
+	typedef ExprScalarKernels K;
+	static const ExprKernels kernels = {
+		"scalar", K::add, K::sub, K::mul, K::div, K::pow, K::abs, K::neg,
+		K::ln, K::log, K::exp, K::sin, K::cos, K::tan, K::asin, K::acos, K::atan,
+		K::min, K::max, {K::lt, K::le, K::gt, K::ge, K::eq, K::ne}, K::select
+	};
+	return kernels;
+}
+
+#ifdef EXPR_SIMD
+// Implementação genérica sobre os tipos vetoriais do GCC: V guarda W doubles e I os W inteiros de
+// 64 bits de mesmo tamanho. As funções recebem os vetores por referência e são sempre expandidas
+// dentro dos kernels compilados para cada conjunto de instruções (AVX2, AVX-512). As funções
+// transcendentais seguem as aproximações da Cephes; entradas fora da faixa tratada pelos
+// polinômios são recalculadas pela libm.
+#define EXPR_SIMD_INLINE __attribute__((always_inline)) inline
+template <class V, class I>
+class ExprSimd {
+public:
+	static const int W = sizeof(V)/sizeof(double);
+	// Inteiros sem sinal de 64 bits, para a aritmética sobre os bits que não pode estourar
+	typedef unsigned long long U __attribute__((vector_size(sizeof(V))));
+	static constexpr double MAGIC = 6755399441055744.0; // 2^52 + 2^51
+	static const long long MAGIC_BITS = 0x4338000000000000LL;
+	template <class A, class B> EXPR_SIMD_INLINE static void cast(A& dst, const B& src) {
+		__builtin_memcpy(&dst, &src, sizeof(A));
+	}
+	EXPR_SIMD_INLINE static bool any(const I& mask) {
+		long long m[W];
+		__builtin_memcpy(m, &mask, sizeof(m));
+		long long res = 0;
+		for (int i=0; i<W; ++i) res |= m[i];
+		return res != 0;
+	}
+	// Arredonda para o inteiro mais próximo (|x| < 2^51) e devolve também o valor inteiro
+	EXPR_SIMD_INLINE static void round(V& x, I& n) {
+		V t = x + MAGIC;
+		cast(n, t);
+		n -= MAGIC_BITS;
+		x = t - MAGIC;
+	}
+	EXPR_SIMD_INLINE static void toDouble(V& dst, const I& n) {
+		I t = n + MAGIC_BITS;
+		cast(dst, t);
+		dst -= MAGIC;
+	}
+	EXPR_SIMD_INLINE static void fabs(V& x) {
+		I bits;
+		cast(bits, x);
+		bits &= 0x7fffffffffffffffLL;
+		cast(x, bits);
+	}
+	// Inverte x onde o bit de sinal de s está ligado, inclusive em s = -0, para que as funções
+	// ímpares preservem o sinal do zero
+	EXPR_SIMD_INLINE static void flipSign(V& x, const V& s) {
+		I bits, sign;
+		cast(bits, x);
+		cast(sign, s);
+		bits ^= sign & (long long) 0x8000000000000000ULL;
+		cast(x, bits);
+	}
+	// Separa x em duas partes com no máximo 26 e 27 bits de mantissa, sem multiplicações (o
+	// resultado não é afetado por contração em FMA)
+	EXPR_SIMD_INLINE static void split(const V& x, V& hi, V& lo) {
+		I bits;
+		cast(bits, x);
+		bits &= (long long) 0xfffffffff8000000ULL;
+		cast(hi, bits);
+		lo = x - hi;
+	}
+	// Raiz quadrada de x >= 0 por iterações de Newton sobre a estimativa de 1/sqrt(x)
+	EXPR_SIMD_INLINE static void sqrt(V& x) {
+		U bits;
+		cast(bits, x);
+		bits = 0x5fe6eb50c7b537a9ULL - (bits >> 1);
+		V r, h = 0.5 * x;
+		cast(r, bits);
+		r = r * (1.5 - h * r * r);
+		r = r * (1.5 - h * r * r);
+		r = r * (1.5 - h * r * r);
+		r = r * (1.5 - h * r * r);
+		V s = x * r;
+		x = s + (x - s * s) * (0.5 * r);
+	}
+	// Recalcula pela libm as posições marcadas em mask
+	EXPR_SIMD_INLINE static void fix(V& x, const V& in, const I& mask, double (*f)(double)) {
+		if (!any(mask)) return;
+		double vx[W], vi[W];
+		long long m[W];
+		__builtin_memcpy(vx, &x, sizeof(vx));
+		__builtin_memcpy(vi, &in, sizeof(vi));
+		__builtin_memcpy(m, &mask, sizeof(m));
+		for (int i=0; i<W; ++i) if (m[i]) vx[i] = f(vi[i]);
+		__builtin_memcpy(&x, vx, sizeof(vx));
+	}
+	EXPR_SIMD_INLINE static void exp(V& x) {
+		V v = x;
+		I over = v > 709.782712893384;
+		I under = v < -745.1332191019412;
+		v = under ? V() - 745.2 : v;
+		v = over ? V() + 709.8 : v;
+		V fx = v * 1.4426950408889634073599;
+		I n;
+		round(fx, n);
+		V r = v - fx * 6.93145751953125E-1;
+		r = r - fx * 1.42860682030941723212E-6;
+		V rr = r * r;
+		V px = r * ((1.26177193074810590878E-4 * rr + 3.02994407707441961300E-2) * rr
+			+ 9.99999999999999999910E-1);
+		V qx = ((3.00198505138664455042E-6 * rr + 2.52448340349684104192E-3) * rr
+			+ 2.27265548208155028766E-1) * rr + 2.00000000000000000009E0;
+		V e = 1.0 + 2.0 * (px / (qx - px));
+		// 2^n aplicado em duas metades para alcançar também os resultados subnormais
+		I n1 = n >> 1;
+		I n2 = n - n1;
+		V s1, s2;
+		n1 = (n1 + 1023) << 52;
+		n2 = (n2 + 1023) << 52;
+		cast(s1, n1);
+		cast(s2, n2);
+		e = e * s1 * s2;
+		e = over ? V() + HUGE_VAL : e;
+		x = under ? V() : e;
+	}
+	// Logaritmo natural; se lo não for nulo o resultado é devolvido como x + *lo, com precisão
+	// estendida (usado por pow)
+	EXPR_SIMD_INLINE static void lnx(V& x, V* lo) {
+		V v = x;
+		I sub = v < 2.2250738585072014e-308;
+		v = sub ? v * 18014398509481984.0 : v;
+		I bits;
+		cast(bits, v);
+		I ie = ((bits >> 52) & 0x7ff) - 1022;
+		ie = sub ? ie - 54 : ie;
+		bits = (bits & 0x000fffffffffffffLL) | 0x3fe0000000000000LL;
+		V m, fe;
+		cast(m, bits);
+		toDouble(fe, ie);
+		I small = m < 7.07106781186547524401E-1;
+		fe = small ? fe - 1.0 : fe;
+		m = small ? m + m - 1.0 : m - 1.0;
+		V z = m * m;
+		V p = ((((1.01875663804580931796E-4 * m + 4.97494994976747001425E-1) * m
+			+ 4.70579119878881725854E0) * m + 1.44989225341610930846E1) * m
+			+ 1.79368678507819816313E1) * m + 7.70838733755885391666E0;
+		V q = ((((m + 1.12873587189167450590E1) * m + 4.52279145837532221105E1) * m
+			+ 8.29875266912776603211E1) * m + 7.11544750618563894466E1) * m
+			+ 2.31251620126765340583E1;
+		V y = m * (z * p / q) - fe * 2.121944400546905827679e-4;
+		V r;
+		if (lo) {
+			// z = m*m exato em duas partes, e soma exata de fe*C1 + m
+			V mh, ml;
+			split(m, mh, ml);
+			V zl = ((mh * mh - z) + 2.0 * mh * ml) + ml * ml;
+			V a = fe * 0.693359375;
+			r = a + m;
+			V bv = r - a;
+			V err = (a - (r - bv)) + (m - bv);
+			V l = err + (y - 0.5 * z) - 0.5 * zl;
+			V h = r + l;
+			*lo = (r - h) + l;
+			r = h;
+		} else {
+			y = y - 0.5 * z;
+			r = (m + y) + fe * 0.693359375;
+		}
+		I neg = x < 0.0;
+		I zero = x == 0.0;
+		I inf = x == HUGE_VAL;
+		I nan = x != x;
+		r = neg ? V() + NAN : r;
+		r = zero ? V() - HUGE_VAL : r;
+		r = inf ? V() + HUGE_VAL : r;
+		x = nan ? x : r;
+		if (lo) *lo = (neg | zero | inf | nan) ? V() : *lo;
+	}
+	EXPR_SIMD_INLINE static void log10(V& x) {
+		lnx(x, nullptr);
+		x *= 4.3429448190325182765E-1;
+	}
+	EXPR_SIMD_INLINE static void pow(V& x, const V& y) {
+		V in = x;
+		V ay = y;
+		fabs(ay);
+		// Base não positiva ou não finita e expoentes muito grandes ficam com a libm
+		I slow = !((x > 0.0) & (x < HUGE_VAL) & (ay < 1e300));
+		V lo;
+		lnx(x, &lo);
+		V hi = x;
+		V p = y * hi;
+		V yh, yl, hh, hl;
+		split(y, yh, yl);
+		split(hi, hh, hl);
+		V pl = (((yh * hh - p) + yh * hl + yl * hh) + yl * hl) + y * lo;
+		x = p;
+		exp(x);
+		x = x + x * pl;
+		x = (p > 709.782712893384) ? V() + HUGE_VAL : x;
+		if (any(slow)) {
+			double vx[W], vi[W], vy[W];
+			long long m[W];
+			__builtin_memcpy(vx, &x, sizeof(vx));
+			__builtin_memcpy(vi, &in, sizeof(vi));
+			__builtin_memcpy(vy, &y, sizeof(vy));
+			__builtin_memcpy(m, &slow, sizeof(m));
+			for (int i=0; i<W; ++i) if (m[i]) vx[i] = ::pow(vi[i], vy[i]);
+			__builtin_memcpy(&x, vx, sizeof(vx));
+		}
+	}
+	// Redução de |x| ao octante de pi/4; devolve o índice (par) do octante e z em [-pi/4, pi/4]
+	EXPR_SIMD_INLINE static void reduce(const V& a, V& z, I& j, double dp1, double dp2, double dp3) {
+		V t = a * 1.27323954473516268615; // 4/pi
+		V y = t;
+		round(y, j);
+		I over = y > t;
+		y = over ? y - 1.0 : y;
+		j = over ? j - 1 : j;
+		I odd = (j & 1) != 0;
+		y = odd ? y + 1.0 : y;
+		j = j + (j & 1);
+		z = ((a - y * dp1) - y * dp2) - y * dp3;
+	}
+	EXPR_SIMD_INLINE static void sincos(V& x, bool cos) {
+		V in = x;
+		V a = x;
+		fabs(a);
+		I slow = !(a <= 1.0e6);
+		a = slow ? V() : a;
+		V z;
+		I j;
+		reduce(a, z, j, 7.85398125648498535156E-1, 3.77489470793079817668E-8,
+			2.69515142907905952645E-15);
+		j &= 7;
+		I sign;
+		if (cos) {
+			sign = (j > 3) ^ (((j > 3) ? j - 4 : j) > 1);
+		} else {
+			sign = j > 3;
+		}
+		j &= 3;
+		V zz = z * z;
+		V s = z + z * zz * (((((1.58962301576546568060E-10 * zz - 2.50507477628578072866E-8) * zz
+			+ 2.75573136213857245213E-6) * zz - 1.98412698295895385996E-4) * zz
+			+ 8.33333333332211858878E-3) * zz - 1.66666666666666307295E-1);
+		V c = 1.0 - 0.5 * zz + zz * zz * (((((-1.13585365213876817300E-11 * zz
+			+ 2.08757008419747316778E-9) * zz - 2.75573141792967388112E-7) * zz
+			+ 2.48015872888517045348E-5) * zz - 1.38888888888730564116E-3) * zz
+			+ 4.16666666666665929218E-2);
+		I swap = j == 2;
+		V r = (cos ? ~swap : swap) ? c : s;
+		x = sign ? -r : r;
+		if (cos) {
+			fix(x, in, slow, ::cos);
+		} else {
+			flipSign(x, in);
+			fix(x, in, slow, ::sin);
+		}
+	}
+	EXPR_SIMD_INLINE static void tan(V& x) {
+		V in = x;
+		V a = x;
+		fabs(a);
+		I slow = !(a <= 1.0e6);
+		a = slow ? V() : a;
+		V z;
+		I j;
+		reduce(a, z, j, 7.853981554508209228515625E-1, 7.94662735614792836714E-9,
+			3.06161699786838294307E-17);
+		V zz = z * z;
+		V p = (-1.30936939181383777646E4 * zz + 1.15351664838587416140E6) * zz
+			- 1.79565251976484877988E7;
+		V q = (((zz + 1.36812963470692954678E4) * zz - 1.32089234440210967447E6) * zz
+			+ 2.50083801823357915839E7) * zz - 5.38695755929454629881E7;
+		V y = zz > 1.0e-14 ? z + z * (zz * p / q) : z;
+		y = (j & 2) != 0 ? -1.0 / y : y;
+		x = y;
+		flipSign(x, in);
+		fix(x, in, slow, ::tan);
+	}
+	EXPR_SIMD_INLINE static void asin(V& x) {
+		V a = x;
+		fabs(a);
+		I big = a > 0.625;
+		// a > 0.625
+		V zz = 1.0 - a;
+		V p = zz * ((((2.967721961301243206100E-3 * zz - 5.634242780008963776856E-1) * zz
+			+ 6.968710824104713396794E0) * zz - 2.556901049652824852289E1) * zz
+			+ 2.853665548261061424989E1);
+		p = p / ((((zz - 2.194779531642920639778E1) * zz + 1.470656354026814941758E2) * zz
+			- 3.838770957603691357202E2) * zz + 3.424398657913078477438E2);
+		zz = zz + zz;
+		zz = big ? zz : V();
+		sqrt(zz);
+		V r1 = 7.85398163397448309616E-1 - zz;
+		r1 = r1 - (zz * p - 6.123233995736765886130E-17);
+		r1 = r1 + 7.85398163397448309616E-1;
+		// a <= 0.625
+		V z2 = a * a;
+		V q = z2 * (((((4.253011369004428248960E-3 * z2 - 6.019598008014123785661E-1) * z2
+			+ 5.444622390564711410273E0) * z2 - 1.626247967210700244449E1) * z2
+			+ 1.956261983317594739197E1) * z2 - 8.198089802484824371615E0);
+		q = q / (((((z2 - 1.474091372988853791896E1) * z2 + 7.049610280856842141659E1) * z2
+			- 1.471791292232726029859E2) * z2 + 1.395105614657485689735E2) * z2
+			- 4.918853881490881290097E1);
+		V r2 = a * q + a;
+		V r = big ? r1 : r2;
+		r = a > 1.0 ? V() + NAN : r;
+		flipSign(r, x);
+		x = x != x ? x : r;
+	}
+	EXPR_SIMD_INLINE static void acos(V& x) {
+		V in = x;
+		V a = in;
+		fabs(a);
+		I big = a > 0.5;
+		V t = 0.5 - 0.5 * a;
+		t = big ? t : V();
+		sqrt(t);
+		x = big ? t : in;
+		asin(x);
+		V r = 7.85398163397448309616E-1 - x;
+		r = (r + 6.123233995736765886130E-17) + 7.85398163397448309616E-1;
+		r = in > 0.5 ? x + x : r;
+		r = in < -0.5 ? 3.14159265358979323846 - (x + x) : r;
+		r = a > 1.0 ? V() + NAN : r;
+		x = in != in ? in : r;
+	}
+	EXPR_SIMD_INLINE static void atan(V& x) {
+		V in = x;
+		V a = x;
+		fabs(a);
+		I big = a > 2.41421356237309504880;
+		I mid = (a > 0.66) & ~big;
+		V y = big ? V() + 1.57079632679489661923 : V();
+		y = mid ? V() + 7.85398163397448309616E-1 : y;
+		V f = big ? V() + 6.123233995736765886130E-17 : V();
+		f = mid ? V() + 0.5 * 6.123233995736765886130E-17 : f;
+		V t = big ? -1.0 / a : a;
+		t = mid ? (a - 1.0) / (a + 1.0) : t;
+		V z = t * t;
+		V p = (((-8.750608600031904122785E-1 * z - 1.615753718733365076637E1) * z
+			- 7.500855792314704667340E1) * z - 1.228866684490136173410E2) * z
+			- 6.485021904942025371773E1;
+		V q = ((((z + 2.485846490142306297962E1) * z + 1.650270098316988542046E2) * z
+			+ 4.328810604912902668951E2) * z + 4.853903996359136964868E2) * z
+			+ 1.945506571482613964425E2;
+		z = z * p / q;
+		z = t * z + t;
+		z = z + f;
+		y = y + z;
+		x = y;
+		flipSign(x, in);
+		x = in != in ? in : x;
+	}
+	EXPR_SIMD_INLINE static void add(V& a, const V& b) {
+		a += b;
+	}
+	EXPR_SIMD_INLINE static void sub(V& a, const V& b) {
+		a -= b;
+	}
+	EXPR_SIMD_INLINE static void mul(V& a, const V& b) {
+		a *= b;
+	}
+	EXPR_SIMD_INLINE static void div(V& a, const V& b) {
+		a /= b;
+	}
+	EXPR_SIMD_INLINE static void abs(V& a) {
+		a = a >= 0.0 ? a : -a;
+	}
+	EXPR_SIMD_INLINE static void neg(V& a) {
+		a = -a;
+	}
+	EXPR_SIMD_INLINE static void min(V& a, const V& b) {
+		a = a < b ? a : b;
+	}
+	EXPR_SIMD_INLINE static void max(V& a, const V& b) {
+		a = a > b ? a : b;
+	}
+	// Comparações: a máscara da comparação seleciona 1 ou 0
+	EXPR_SIMD_INLINE static void lt(V& a, const V& b) {
+		a = a < b ? V() + 1 : V();
+	}
+	EXPR_SIMD_INLINE static void le(V& a, const V& b) {
+		a = a <= b ? V() + 1 : V();
+	}
+	EXPR_SIMD_INLINE static void gt(V& a, const V& b) {
+		a = a > b ? V() + 1 : V();
+	}
+	EXPR_SIMD_INLINE static void ge(V& a, const V& b) {
+		a = a >= b ? V() + 1 : V();
+	}
+	EXPR_SIMD_INLINE static void eq(V& a, const V& b) {
+		a = a == b ? V() + 1 : V();
+	}
+	EXPR_SIMD_INLINE static void ne(V& a, const V& b) {
+		a = a != b ? V() + 1 : V();
+	}
+	EXPR_SIMD_INLINE static void select(V& c, const V& a, const V& b) {
+		c = c != 0 ? a : b;
+	}
+	EXPR_SIMD_INLINE static void ln(V& a) {
+		lnx(a, nullptr);
+	}
+	EXPR_SIMD_INLINE static void sin(V& a) {
+		sincos(a, false);
+	}
+	EXPR_SIMD_INLINE static void cos(V& a) {
+		sincos(a, true);
+	}
+	// Laços dos kernels: blocos completos de W linhas e a sobra completada com 1.0
+	template <void (*F)(V&)> EXPR_SIMD_INLINE static void map(double d[], int n) {
+		int i = 0;
+		for (; i + W <= n; i += W) {
+			V v;
+			__builtin_memcpy(&v, d + i, sizeof(v));
+			F(v);
+			__builtin_memcpy(d + i, &v, sizeof(v));
+		}
+		if (i < n) {
+			double t[W];
+			for (int k=0; k<W; ++k) t[k] = i + k < n ? d[i + k] : 1.0;
+			V v;
+			__builtin_memcpy(&v, t, sizeof(v));
+			F(v);
+			__builtin_memcpy(t, &v, sizeof(v));
+			for (int k=0; i + k < n; ++k) d[i + k] = t[k];
+		}
+	}
+	template <void (*F)(V&, const V&)> EXPR_SIMD_INLINE static void map(double d[],
+		const double s[], int n) {
+		int i = 0;
+		for (; i + W <= n; i += W) {
+			V a, b;
+			__builtin_memcpy(&a, d + i, sizeof(a));
+			__builtin_memcpy(&b, s + i, sizeof(b));
+			F(a, b);
+			__builtin_memcpy(d + i, &a, sizeof(a));
+		}
+		if (i < n) {
+			double ta[W], tb[W];
+			for (int k=0; k<W; ++k) {
+				ta[k] = i + k < n ? d[i + k] : 1.0;
+				tb[k] = i + k < n ? s[i + k] : 1.0;
+			}
+			V a, b;
+			__builtin_memcpy(&a, ta, sizeof(a));
+			__builtin_memcpy(&b, tb, sizeof(b));
+			F(a, b);
+			__builtin_memcpy(ta, &a, sizeof(a));
+			for (int k=0; i + k < n; ++k) d[i + k] = ta[k];
+		}
+	}
+	template <void (*F)(V&, const V&, const V&)> EXPR_SIMD_INLINE static void map(double d[],
+		const double s[], const double t[], int n) {
+		int i = 0;
+		for (; i + W <= n; i += W) {
+			V a, b, c;
+			__builtin_memcpy(&a, d + i, sizeof(a));
+			__builtin_memcpy(&b, s + i, sizeof(b));
+			__builtin_memcpy(&c, t + i, sizeof(c));
+			F(a, b, c);
+			__builtin_memcpy(d + i, &a, sizeof(a));
+		}
+		if (i < n) {
+			double ta[W], tb[W], tc[W];
+			for (int k=0; k<W; ++k) {
+				ta[k] = i + k < n ? d[i + k] : 1.0;
+				tb[k] = i + k < n ? s[i + k] : 1.0;
+				tc[k] = i + k < n ? t[i + k] : 1.0;
+			}
+			V a, b, c;
+			__builtin_memcpy(&a, ta, sizeof(a));
+			__builtin_memcpy(&b, tb, sizeof(b));
+			__builtin_memcpy(&c, tc, sizeof(c));
+			F(a, b, c);
+			__builtin_memcpy(ta, &a, sizeof(a));
+			for (int k=0; i + k < n; ++k) d[i + k] = ta[k];
+		}
+	}
+};
+
+// Instancia os kernels de ExprSimd com o atributo target de um conjunto de instruções
+#define EXPR_SIMD_KERNEL2(TARGET, OP) \
+	__attribute__((target(TARGET))) static void OP(double d[], const double s[], int n) { \
+		S::template map<S::OP>(d, s, n); \
+	}
+#define EXPR_SIMD_KERNEL1(TARGET, OP, F) \
+	__attribute__((target(TARGET))) static void OP(double d[], int n) { \
+		S::template map<S::F>(d, n); \
+	}
+#define EXPR_SIMD_KERNEL3(TARGET, OP) \
+	__attribute__((target(TARGET))) static void OP(double d[], const double a[], \
+		const double b[], int n) { \
+		S::template map<S::OP>(d, a, b, n); \
+	}
+#define EXPR_SIMD_KERNELS(NAME, TARGET, V, I) \
+class NAME { \
+	typedef ExprSimd<V, I> S; \
+public: \
+	EXPR_SIMD_KERNEL2(TARGET, add) \
+	EXPR_SIMD_KERNEL2(TARGET, sub) \
+	EXPR_SIMD_KERNEL2(TARGET, mul) \
+	EXPR_SIMD_KERNEL2(TARGET, div) \
+	EXPR_SIMD_KERNEL2(TARGET, pow) \
+	EXPR_SIMD_KERNEL1(TARGET, abs, abs) \
+	EXPR_SIMD_KERNEL1(TARGET, neg, neg) \
+	EXPR_SIMD_KERNEL1(TARGET, ln, ln) \
+	EXPR_SIMD_KERNEL1(TARGET, log, log10) \
+	EXPR_SIMD_KERNEL1(TARGET, exp, exp) \
+	EXPR_SIMD_KERNEL1(TARGET, sin, sin) \
+	EXPR_SIMD_KERNEL1(TARGET, cos, cos) \
+	EXPR_SIMD_KERNEL1(TARGET, tan, tan) \
+	EXPR_SIMD_KERNEL1(TARGET, asin, asin) \
+	EXPR_SIMD_KERNEL1(TARGET, acos, acos) \
+	EXPR_SIMD_KERNEL1(TARGET, atan, atan) \
+	EXPR_SIMD_KERNEL2(TARGET, min) \
+	EXPR_SIMD_KERNEL2(TARGET, max) \
+	EXPR_SIMD_KERNEL2(TARGET, lt) \
+	EXPR_SIMD_KERNEL2(TARGET, le) \
+	EXPR_SIMD_KERNEL2(TARGET, gt) \
+	EXPR_SIMD_KERNEL2(TARGET, ge) \
+	EXPR_SIMD_KERNEL2(TARGET, eq) \
+	EXPR_SIMD_KERNEL2(TARGET, ne) \
+	EXPR_SIMD_KERNEL3(TARGET, select) \
+};
+
+typedef double ExprSimdV4 __attribute__((vector_size(32)));
+typedef long long ExprSimdI4 __attribute__((vector_size(32)));
+typedef double ExprSimdV8 __attribute__((vector_size(64)));
+typedef long long ExprSimdI8 __attribute__((vector_size(64)));
+EXPR_SIMD_KERNELS(ExprAvx2Kernels, "avx2,fma", ExprSimdV4, ExprSimdI4)
+EXPR_SIMD_KERNELS(ExprAvx512Kernels, "avx512f,avx2,fma", ExprSimdV8, ExprSimdI8)
+#endif
+
+inline const ExprKernels* ExprKernels::avx2() {
+#ifdef EXPR_SIMD
+	typedef ExprAvx2Kernels K;
+	static const ExprKernels kernels = {
+		"avx2", K::add, K::sub, K::mul, K::div, K::pow, K::abs, K::neg,
+		K::ln, K::log, K::exp, K::sin, K::cos, K::tan, K::asin, K::acos, K::atan,
+		K::min, K::max, {K::lt, K::le, K::gt, K::ge, K::eq, K::ne}, K::select
+	};
+	if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) return &kernels;
+#endif
+	return nullptr;
+}
+
+inline const ExprKernels* ExprKernels::avx512() {
+#ifdef EXPR_SIMD
+	typedef ExprAvx512Kernels K;
+	static const ExprKernels kernels = {
+		"avx512", K::add, K::sub, K::mul, K::div, K::pow, K::abs, K::neg,
+		K::ln, K::log, K::exp, K::sin, K::cos, K::tan, K::asin, K::acos, K::atan,
+		K::min, K::max, {K::lt, K::le, K::gt, K::ge, K::eq, K::ne}, K::select
+	};
+	// O código é compilado também com AVX2 (EXPR_SIMD_KERNELS)
+	if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx2") &&
+		__builtin_cpu_supports("fma")) {
+		return &kernels;
+	}
+#endif
+	return nullptr;
+}
+
+// Kernels das operações básicas em float, para a avaliação em lote em precisão simples: cada
+// vetor guarda o dobro de linhas que em double. pow e as funções padrão não têm versão em float;
+// são calculadas em double (ExprBatchOps)
+typedef void (*TExprFloatKernel1) (float[], int);
+typedef void (*TExprFloatKernel2) (float[], const float[], int);
+typedef void (*TExprFloatKernel3) (float[], const float[], const float[], int);
+typedef void (*TExprWidenKernel) (double[], const float[], int); // dst[i] = src[i]
+typedef void (*TExprNarrowKernel) (float[], const double[], int); // dst[i] = src[i]
+
+struct ExprFloatKernels {
+	const char* name;
+	TExprFloatKernel2 add, sub, mul, div;
+	TExprFloatKernel1 abs, neg;
+	TExprWidenKernel widen;
+	TExprNarrowKernel narrow;
+	TExprFloatKernel2 min, max;
+	TExprFloatKernel2 cmp[6];
+	TExprFloatKernel3 select;
+	static const ExprFloatKernels& scalar();
+	static const ExprFloatKernels* avx2();
+	static const ExprFloatKernels* avx512();
+	static const ExprFloatKernels*& current() {
+		static const ExprFloatKernels* kernels = best();
+		return kernels;
+	}
+	static const ExprFloatKernels& get() {
+		return *current();
+	}
+	static void set(const ExprFloatKernels& kernels) {
+		current() = &kernels;
+	}
+	static const ExprFloatKernels* best() {
+		if (avx512()) return avx512();
+		if (avx2()) return avx2();
+		return &scalar();
+	}
+};
+
+inline const ExprFloatKernels& ExprFloatKernels::scalar() {
+	typedef ExprScalarKernels K;
+	static const ExprFloatKernels kernels = {
+		"scalar", K::add, K::sub, K::mul, K::div, K::abs, K::neg, K::widen, K::narrow,
+		K::min, K::max, {K::lt, K::le, K::gt, K::ge, K::eq, K::ne}, K::select
+	};
+	return kernels;
+}
+
+#ifdef EXPR_SIMD
+// Operações básicas sobre os tipos vetoriais do GCC, com V guardando W floats e D os W doubles
+// correspondentes
+template <class V, class D>
+class ExprSimdFloat {
+public:
+	static const int W = sizeof(V)/sizeof(float);
+	EXPR_SIMD_INLINE static void add(V& a, const V& b) {
+		a += b;
+	}
+	EXPR_SIMD_INLINE static void sub(V& a, const V& b) {
+		a -= b;
+	}
+	EXPR_SIMD_INLINE static void mul(V& a, const V& b) {
+		a *= b;
+	}
+	EXPR_SIMD_INLINE static void div(V& a, const V& b) {
+		a /= b;
+	}
+	EXPR_SIMD_INLINE static void abs(V& a) {
+		a = a >= 0.0f ? a : -a;
+	}
+	EXPR_SIMD_INLINE static void neg(V& a) {
+		a = -a;
+	}
+	EXPR_SIMD_INLINE static void min(V& a, const V& b) {
+		a = a < b ? a : b;
+	}
+	EXPR_SIMD_INLINE static void max(V& a, const V& b) {
+		a = a > b ? a : b;
+	}
+	// Comparações: a máscara da comparação seleciona 1 ou 0
+	EXPR_SIMD_INLINE static void lt(V& a, const V& b) {
+		a = a < b ? V() + 1 : V();
+	}
+	EXPR_SIMD_INLINE static void le(V& a, const V& b) {
+		a = a <= b ? V() + 1 : V();
+	}
+	EXPR_SIMD_INLINE static void gt(V& a, const V& b) {
+		a = a > b ? V() + 1 : V();
+	}
+	EXPR_SIMD_INLINE static void ge(V& a, const V& b) {
+		a = a >= b ? V() + 1 : V();
+	}
+	EXPR_SIMD_INLINE static void eq(V& a, const V& b) {
+		a = a == b ? V() + 1 : V();
+	}
+	EXPR_SIMD_INLINE static void ne(V& a, const V& b) {
+		a = a != b ? V() + 1 : V();
+	}
+	EXPR_SIMD_INLINE static void select(V& c, const V& a, const V& b) {
+		c = c != 0 ? a : b;
+	}
+	// Blocos completos de W linhas; a sobra é calculada linha a linha com a mesma operação
+	template <void (*F)(V&)> EXPR_SIMD_INLINE static void map(float d[], int n) {
+		int i = 0;
+		for (; i + W <= n; i += W) {
+			V v;
+			__builtin_memcpy(&v, d + i, sizeof(v));
+			F(v);
+			__builtin_memcpy(d + i, &v, sizeof(v));
+		}
+		for (; i < n; ++i) {
+			V v = {d[i]};
+			F(v);
+			d[i] = v[0];
+		}
+	}
+	template <void (*F)(V&, const V&)> EXPR_SIMD_INLINE static void map(float d[],
+		const float s[], int n) {
+		int i = 0;
+		for (; i + W <= n; i += W) {
+			V a, b;
+			__builtin_memcpy(&a, d + i, sizeof(a));
+			__builtin_memcpy(&b, s + i, sizeof(b));
+			F(a, b);
+			__builtin_memcpy(d + i, &a, sizeof(a));
+		}
+		for (; i < n; ++i) {
+			V a = {d[i]}, b = {s[i]};
+			F(a, b);
+			d[i] = a[0];
+		}
+	}
+	template <void (*F)(V&, const V&, const V&)> EXPR_SIMD_INLINE static void map(float d[],
+		const float s[], const float t[], int n) {
+		int i = 0;
+		for (; i + W <= n; i += W) {
+			V a, b, c;
+			__builtin_memcpy(&a, d + i, sizeof(a));
+			__builtin_memcpy(&b, s + i, sizeof(b));
+			__builtin_memcpy(&c, t + i, sizeof(c));
+			F(a, b, c);
+			__builtin_memcpy(d + i, &a, sizeof(a));
+		}
+		for (; i < n; ++i) {
+			V a = {d[i]}, b = {s[i]}, c = {t[i]};
+			F(a, b, c);
+			d[i] = a[0];
+		}
+	}
+	EXPR_SIMD_INLINE static void widen(double d[], const float s[], int n) {
+		int i = 0;
+		for (; i + W <= n; i += W) {
+			V v;
+			__builtin_memcpy(&v, s + i, sizeof(v));
+			D w = __builtin_convertvector(v, D);
+			__builtin_memcpy(d + i, &w, sizeof(w));
+		}
+		for (; i < n; ++i) d[i] = s[i];
+	}
+	EXPR_SIMD_INLINE static void narrow(float d[], const double s[], int n) {
+		int i = 0;
+		for (; i + W <= n; i += W) {
+			D w;
+			__builtin_memcpy(&w, s + i, sizeof(w));
+			V v = __builtin_convertvector(w, V);
+			__builtin_memcpy(d + i, &v, sizeof(v));
+		}
+		for (; i < n; ++i) d[i] = s[i];
+	}
+};
+
+#define EXPR_SIMD_FLOAT_KERNEL2(TARGET, OP) \
+	__attribute__((target(TARGET))) static void OP(float d[], const float s[], int n) { \
+		S::template map<S::OP>(d, s, n); \
+	}
+#define EXPR_SIMD_FLOAT_KERNEL1(TARGET, OP) \
+	__attribute__((target(TARGET))) static void OP(float d[], int n) { \
+		S::template map<S::OP>(d, n); \
+	}
+#define EXPR_SIMD_FLOAT_KERNEL3(TARGET, OP) \
+	__attribute__((target(TARGET))) static void OP(float d[], const float a[], const float b[], \
+		int n) { \
+		S::template map<S::OP>(d, a, b, n); \
+	}
+#define EXPR_SIMD_FLOAT_KERNELS(NAME, TARGET, V, D) \
+class NAME { \
+	typedef ExprSimdFloat<V, D> S; \
+public: \
+	EXPR_SIMD_FLOAT_KERNEL2(TARGET, add) \
+	EXPR_SIMD_FLOAT_KERNEL2(TARGET, sub) \
+	EXPR_SIMD_FLOAT_KERNEL2(TARGET, mul) \
+	EXPR_SIMD_FLOAT_KERNEL2(TARGET, div) \
+	EXPR_SIMD_FLOAT_KERNEL1(TARGET, abs) \
+	EXPR_SIMD_FLOAT_KERNEL1(TARGET, neg) \
+	EXPR_SIMD_FLOAT_KERNEL2(TARGET, min) \
+	EXPR_SIMD_FLOAT_KERNEL2(TARGET, max) \
+	EXPR_SIMD_FLOAT_KERNEL2(TARGET, lt) \
+	EXPR_SIMD_FLOAT_KERNEL2(TARGET, le) \
+	EXPR_SIMD_FLOAT_KERNEL2(TARGET, gt) \
+	EXPR_SIMD_FLOAT_KERNEL2(TARGET, ge) \
+	EXPR_SIMD_FLOAT_KERNEL2(TARGET, eq) \
+	EXPR_SIMD_FLOAT_KERNEL2(TARGET, ne) \
+	EXPR_SIMD_FLOAT_KERNEL3(TARGET, select) \
+	__attribute__((target(TARGET))) static void widen(double d[], const float s[], int n) { \
+		S::widen(d, s, n); \
+	} \
+	__attribute__((target(TARGET))) static void narrow(float d[], const double s[], int n) { \
+		S::narrow(d, s, n); \
+	} \
+};
+
+typedef float ExprSimdF8 __attribute__((vector_size(32)));
+typedef double ExprSimdD8 __attribute__((vector_size(64)));
+typedef float ExprSimdF16 __attribute__((vector_size(64)));
+typedef double ExprSimdD16 __attribute__((vector_size(128)));
+EXPR_SIMD_FLOAT_KERNELS(ExprAvx2FloatKernels, "avx2,fma", ExprSimdF8, ExprSimdD8)
+EXPR_SIMD_FLOAT_KERNELS(ExprAvx512FloatKernels, "avx512f,avx2,fma", ExprSimdF16, ExprSimdD16)
+#endif
+
+inline const ExprFloatKernels* ExprFloatKernels::avx2() {
+#ifdef EXPR_SIMD
+	typedef ExprAvx2FloatKernels K;
+	static const ExprFloatKernels kernels = {
+		"avx2", K::add, K::sub, K::mul, K::div, K::abs, K::neg, K::widen, K::narrow,
+		K::min, K::max, {K::lt, K::le, K::gt, K::ge, K::eq, K::ne}, K::select
+	};
+	if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) return &kernels;
+#endif
+	return nullptr;
+}
+
+inline const ExprFloatKernels* ExprFloatKernels::avx512() {
+#ifdef EXPR_SIMD
+	typedef ExprAvx512FloatKernels K;
+	static const ExprFloatKernels kernels = {
+		"avx512", K::add, K::sub, K::mul, K::div, K::abs, K::neg, K::widen, K::narrow,
+		K::min, K::max, {K::lt, K::le, K::gt, K::ge, K::eq, K::ne}, K::select
+	};
+	// O código é compilado também com AVX2 (EXPR_SIMD_KERNELS)
+	if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx2") &&
+		__builtin_cpu_supports("fma")) {
+		return &kernels;
+	}
+#endif
+	return nullptr;
+}
+
+// ---------------------------------------------------------------------------------------------- //
+// Aritmética intervalar: cada valor é um intervalo [lo, hi] que contém todos os resultados       //
+// possíveis. Os extremos são arredondados para fora (nextafter) depois de cada operação, o que   //
+// cobre o erro de arredondamento das operações básicas e das funções da libm                     //
+// ---------------------------------------------------------------------------------------------- //
+struct ExprInterval {
+	double lo;
+	double hi;
+	ExprInterval() {
+		lo = 0;
+		hi = 0;
+	}
+	ExprInterval(double value) {
+		lo = value;
+		hi = value;
+	}
+	ExprInterval(double lo, double hi) {
+		this->lo = lo;
+		this->hi = hi;
+	}
+	bool contains(double value) const {
+		return lo <= value && value <= hi;
+	}
+};
+
+// Extensões intervalares das operações e das funções padrão. Valores fora do domínio de uma
+// função são ignorados; um intervalo totalmente fora do domínio resulta em [NaN, NaN]
+class ExprIntervalCalls {
+private:
+	static double down(double value, int ulps) {
+		for (int i=0; i<ulps; ++i) value = nextafter(value, - INFINITY);
+		return value;
+	}
+	static double up(double value, int ulps) {
+		for (int i=0; i<ulps; ++i) value = nextafter(value, INFINITY);
+		return value;
+	}
+	static ExprInterval nan() {
+		return ExprInterval(NAN, NAN);
+	}
+	static ExprInterval whole() {
+		return ExprInterval(- INFINITY, INFINITY);
+	}
+	// 0 * inf = 0: o produto é usado como limite e não como valor de um ponto
+	static double mul(double a, double b) {
+		return a == 0 || b == 0 ? 0 : a * b;
+	}
+	// Soma de dois limites. Infinitos opostos somam NaN, que não limita nada (o NaN só ocorre nos
+	// pontos inf - inf): o lado fica ilimitado, em inf
+	static double sum(double a, double b, double inf) {
+		double s = a + b;
+		return s != s && a == a && b == b ? inf : s;
+	}
+	// Verdadeiro se algum c + k*period está em a (com margem, na dúvida considera que sim)
+	static bool hits(const ExprInterval &a, double c, double period) {
+		double eps = 1e-9 * (1 + fabs(a.lo) + fabs(a.hi));
+		double k = ceil((a.lo - eps - c) / period);
+		return c + k * period <= a.hi + eps;
+	}
+	// sin e cos: extremos nas bordas ou nos pontos de máximo e mínimo contidos no intervalo
+	static ExprInterval periodic(const ExprInterval &a, double (*fn)(double), double maxAt,
+		double minAt) {
+		if (!(a.hi - a.lo < 2 * M_PI)) return ExprInterval(-1, 1);
+		double fa = fn(a.lo), fb = fn(a.hi);
+		ExprInterval res(down(std::min(fa, fb), 2), up(std::max(fa, fb), 2));
+		if (hits(a, maxAt, 2 * M_PI)) res.hi = 1;
+		if (hits(a, minAt, 2 * M_PI)) res.lo = -1;
+		res.lo = std::max(res.lo, -1.0);
+		res.hi = std::min(res.hi, 1.0);
+		return res;
+	}
+	// Potência de expoente inteiro n >= 0
+	static ExprInterval powi(const ExprInterval &a, double n) {
+		double pa = ::pow(a.lo, n), pb = ::pow(a.hi, n);
+		if (fmod(n, 2) != 0 || a.lo >= 0) {
+			return ExprInterval(down(std::min(pa, pb), 2), up(std::max(pa, pb), 2));
+		}
+		if (a.hi <= 0) return ExprInterval(down(pb, 2), up(pa, 2));
+		return ExprInterval(0, up(std::max(pa, pb), 2));
+	}
+public:
+	static ExprInterval abs(const ExprInterval &a) {
+		if (a.lo >= 0) return a;
+		if (a.hi <= 0) return ExprInterval(- a.hi, - a.lo);
+		return ExprInterval(0, std::max(- a.lo, a.hi));
+	}
+	static ExprInterval neg(const ExprInterval &a) {
+		return ExprInterval(- a.hi, - a.lo);
+	}
+	static ExprInterval add(const ExprInterval &a, const ExprInterval &b) {
+		return ExprInterval(down(sum(a.lo, b.lo, - INFINITY), 1), up(sum(a.hi, b.hi, INFINITY), 1));
+	}
+	static ExprInterval sub(const ExprInterval &a, const ExprInterval &b) {
+		return ExprInterval(down(sum(a.lo, - b.hi, - INFINITY), 1),
+			up(sum(a.hi, - b.lo, INFINITY), 1));
+	}
+	static ExprInterval mul(const ExprInterval &a, const ExprInterval &b) {
+		double p[4] = {mul(a.lo, b.lo), mul(a.lo, b.hi), mul(a.hi, b.lo), mul(a.hi, b.hi)};
+		return ExprInterval(down(*std::min_element(p, p + 4), 1),
+			up(*std::max_element(p, p + 4), 1));
+	}
+	static ExprInterval div(const ExprInterval &a, const ExprInterval &b) {
+		// x/0 é infinito com o sinal de x (ou NaN com x = 0)
+		if (b.lo == 0 && b.hi == 0) return whole();
+		if (b.lo > 0 || b.hi < 0) {
+			double q[4] = {a.lo / b.lo, a.lo / b.hi, a.hi / b.lo, a.hi / b.hi};
+			return ExprInterval(down(*std::min_element(q, q + 4), 1),
+				up(*std::max_element(q, q + 4), 1));
+		}
+		// Divisor com zero em um dos extremos: o resultado é ilimitado de um lado só
+		if (b.lo == 0 && a.lo >= 0) return ExprInterval(down(a.lo / b.hi, 1), INFINITY);
+		if (b.lo == 0 && a.hi <= 0) return ExprInterval(- INFINITY, up(a.hi / b.hi, 1));
+		if (b.hi == 0 && a.lo >= 0) return ExprInterval(- INFINITY, up(a.lo / b.lo, 1));
+		if (b.hi == 0 && a.hi <= 0) return ExprInterval(down(a.hi / b.lo, 1), INFINITY);
+		return whole();
+	}
+	static ExprInterval pow(const ExprInterval &a, const ExprInterval &b) {
+		if (b.lo == b.hi && b.lo == floor(b.lo) && fabs(b.lo) < 9007199254740992.0) {
+			if (b.lo >= 0) return powi(a, b.lo);
+			return div(ExprInterval(1), powi(a, - b.lo));
+		}
+		// Base negativa só está definida com expoente inteiro, e então |a^n| = |a|^n: o intervalo
+		// simétrico do maior |a|^n contém tanto esses pontos quanto os de base não negativa
+		if (a.lo < 0 && floor(b.hi) >= b.lo) {
+			ExprInterval base = abs(a);
+			double p[4] = {::pow(base.lo, b.lo), ::pow(base.lo, b.hi), ::pow(base.hi, b.lo),
+				::pow(base.hi, b.hi)};
+			double hi = up(*std::max_element(p, p + 4), 2);
+			return ExprInterval(- hi, hi);
+		}
+		// Sem expoente inteiro, a base negativa não está definida, exceto -inf: pow(-inf, y) é
+		// pow(inf, y), e o ponto entra na base como inf
+		if (a.hi < 0 && a.lo > - INFINITY) return nan();
+		ExprInterval base(a.hi < 0 ? INFINITY : std::max(a.lo, 0.0),
+			a.lo == - INFINITY ? INFINITY : a.hi);
+		// Com base não negativa, pow é monótona em cada argumento: extremos nos cantos
+		double p[4] = {::pow(base.lo, b.lo), ::pow(base.lo, b.hi), ::pow(base.hi, b.lo),
+			::pow(base.hi, b.hi)};
+		return ExprInterval(std::max(0.0, down(*std::min_element(p, p + 4), 2)),
+			up(*std::max_element(p, p + 4), 2));
+	}
+	// Potência calculada pela instrução POWI. O produto arredondado é monótono em |x|, então os
+	// extremos vêm dos valores que a própria instrução calcula nas bordas
+	static ExprInterval pown(const ExprInterval &a, int n) {
+		int m = n < 0 ? - n : n;
+		double pa = ExprScalarKernels::powi(a.lo, m), pb = ExprScalarKernels::powi(a.hi, m);
+		ExprInterval res;
+		if (m % 2 != 0 || a.lo >= 0) {
+			res = ExprInterval(down(std::min(pa, pb), 1), up(std::max(pa, pb), 1));
+		} else if (a.hi <= 0) {
+			res = ExprInterval(down(pb, 1), up(pa, 1));
+		} else {
+			res = ExprInterval(0, up(std::max(pa, pb), 1));
+		}
+		return n < 0 ? div(ExprInterval(1), res) : res;
+	}
+	// Comparação k (a partir de EXPR_BYTECODE_LT: <, <=, >, >=, ==, !=): [1, 1] ou [0, 0] quando
+	// o resultado é o mesmo para todos os pontos, senão [0, 1]
+	static ExprInterval cmp(int k, const ExprInterval &a, const ExprInterval &b) {
+		bool yes = false, no = false;
+		switch (k) {
+			case 0: yes = a.hi < b.lo; no = a.lo >= b.hi; break;
+			case 1: yes = a.hi <= b.lo; no = a.lo > b.hi; break;
+			case 2: return cmp(0, b, a);
+			case 3: return cmp(1, b, a);
+			case 4:
+			case 5:
+				yes = a.lo == a.hi && b.lo == b.hi && a.lo == b.lo;
+				no = a.hi < b.lo || b.hi < a.lo;
+				if (k == 5) std::swap(yes, no);
+			break;
+		}
+		return yes ? ExprInterval(1) : no ? ExprInterval(0) : ExprInterval(0, 1);
+	}
+	// Como nas instruções, um operando NaN resulta em b. Como a pode ser NaN em pontos que o
+	// intervalo ignora (ln de um intervalo que cruza 0, por exemplo), o resultado sempre inclui o
+	// lado de b que min (ou max) manteria
+	static ExprInterval min(const ExprInterval &a, const ExprInterval &b) {
+		if (a.lo != a.lo || b.lo != b.lo) return b;
+		return ExprInterval(std::min(a.lo, b.lo), b.hi);
+	}
+	static ExprInterval max(const ExprInterval &a, const ExprInterval &b) {
+		if (a.lo != a.lo || b.lo != b.lo) return b;
+		return ExprInterval(b.lo, std::max(a.hi, b.hi));
+	}
+	// Um dos ramos, se o sinal da condição for conhecido, ou a união dos dois. Um ramo [NaN, NaN]
+	// só tem pontos NaN, que ficam fora da união
+	static ExprInterval select(const ExprInterval &c, const ExprInterval &a, const ExprInterval &b) {
+		if (c.lo > 0 || c.hi < 0) return a;
+		if (c.lo == 0 && c.hi == 0) return b;
+		if (a.lo != a.lo) return b;
+		if (b.lo != b.lo) return a;
+		return ExprInterval(std::min(a.lo, b.lo), std::max(a.hi, b.hi));
+	}
+	static ExprInterval ln(const ExprInterval &a) {
+		if (a.hi < 0) return nan();
+		return ExprInterval(a.lo <= 0 ? - INFINITY : down(::log(a.lo), 2), up(::log(a.hi), 2));
+	}
+	static ExprInterval log(const ExprInterval &a) {
+		if (a.hi < 0) return nan();
+		return ExprInterval(a.lo <= 0 ? - INFINITY : down(log10(a.lo), 2), up(log10(a.hi), 2));
+	}
+	static ExprInterval exp(const ExprInterval &a) {
+		return ExprInterval(std::max(0.0, down(::exp(a.lo), 2)), up(::exp(a.hi), 2));
+	}
+	static ExprInterval sin(const ExprInterval &a) {
+		return periodic(a, ::sin, M_PI / 2, - M_PI / 2);
+	}
+	static ExprInterval cos(const ExprInterval &a) {
+		return periodic(a, ::cos, 0, M_PI);
+	}
+	static ExprInterval tan(const ExprInterval &a) {
+		if (!(a.hi - a.lo < M_PI) || hits(a, M_PI / 2, M_PI)) return whole();
+		return ExprInterval(down(::tan(a.lo), 2), up(::tan(a.hi), 2));
+	}
+	static ExprInterval asin(const ExprInterval &a) {
+		if (a.hi < -1 || a.lo > 1) return nan();
+		double lo = std::max(a.lo, -1.0), hi = std::min(a.hi, 1.0);
+		return ExprInterval(down(::asin(lo), 2), up(::asin(hi), 2));
+	}
+	static ExprInterval acos(const ExprInterval &a) {
+		if (a.hi < -1 || a.lo > 1) return nan();
+		double lo = std::max(a.lo, -1.0), hi = std::min(a.hi, 1.0);
+		return ExprInterval(std::max(0.0, down(::acos(hi), 2)), up(::acos(lo), 2));
+	}
+	static ExprInterval atan(const ExprInterval &a) {
+		return ExprInterval(down(::atan(a.lo), 2), up(::atan(a.hi), 2));
+	}
+	// Extensão de uma chamada; funções sem extensão conhecida podem resultar em qualquer valor
+	static ExprInterval call(TExprFunction ref, const ExprInterval args[], int n) {
+		if (n == 1) {
+			if (ref == ExprCalls::call_ln) return ln(args[0]);
+			if (ref == ExprCalls::call_log) return log(args[0]);
+			if (ref == ExprCalls::call_exp) return exp(args[0]);
+			if (ref == ExprCalls::call_sin) return sin(args[0]);
+			if (ref == ExprCalls::call_cos) return cos(args[0]);
+			if (ref == ExprCalls::call_tan) return tan(args[0]);
+			if (ref == ExprCalls::call_asin) return asin(args[0]);
+			if (ref == ExprCalls::call_acos) return acos(args[0]);
+			if (ref == ExprCalls::call_atan) return atan(args[0]);
+		}
+		return whole();
+	}
+};
+
+// ---------------------------------------------------------------------------------------------- //
+// Estrutura que armazenará um bytecode para a execução da expressão. As instruções ficam em      //
+// notação pós-fixa: os operandos são empilhados antes do operador, que os consome da pilha       //
+// ---------------------------------------------------------------------------------------------- //
+// Os operandos inteiros (índice de argumento, quantidade de argumentos de uma chamada e índice de
+// temporário) têm tamanho variável: 7 bits por byte, com o bit mais alto indicando continuação
+#define EXPR_BYTECODE_END   0x00
+#define EXPR_BYTECODE_CONST 0x01
+#define EXPR_BYTECODE_ARG   0x02
+#define EXPR_BYTECODE_REF   0x03
+#define EXPR_BYTECODE_ABS   0x04
+#define EXPR_BYTECODE_NEG   0x05
+#define EXPR_BYTECODE_ADD   0x06
+#define EXPR_BYTECODE_SUB   0x07
+#define EXPR_BYTECODE_MUL   0x08
+#define EXPR_BYTECODE_DIV   0x09
+#define EXPR_BYTECODE_POW   0x0a
+#define EXPR_BYTECODE_CALL  0x0b
+#define EXPR_BYTECODE_STORE 0x0c // Copia o topo da pilha para um temporário, sem desempilhar
+#define EXPR_BYTECODE_LOAD  0x0d // Empilha o valor de um temporário
+#define EXPR_BYTECODE_OUT   0x0e // Desempilha o topo para uma das saídas de um programa (ExprMulti)
+#define EXPR_BYTECODE_PARAM 0x0f // Empilha o valor atual de um parâmetro (setParam)
+// Instruções combinadas, geradas pela seleção de instruções de ExprDag
+#define EXPR_BYTECODE_MULADD 0x10 // a*b + c sobre os três valores do topo (produto arredondado)
+#define EXPR_BYTECODE_POWI   0x11 // x^n com n inteiro (com sinal, em zigzag), por multiplicações
+#define EXPR_BYTECODE_SQRT   0x12 // x^0.5
+#define EXPR_BYTECODE_ADDC   0x13 // Operação entre o topo e uma constante (double em seguida)
+#define EXPR_BYTECODE_SUBC   0x14
+#define EXPR_BYTECODE_MULC   0x15
+#define EXPR_BYTECODE_DIVC   0x16
+#define EXPR_BYTECODE_ADDA   0x17 // Operação entre o topo e um argumento (índice em seguida)
+#define EXPR_BYTECODE_SUBA   0x18
+#define EXPR_BYTECODE_MULA   0x19
+#define EXPR_BYTECODE_DIVA   0x1a
+// Comparações (1 ou 0), mínimo, máximo e seleção, sem desvios na avaliação em lote e no JIT
+#define EXPR_BYTECODE_LT     0x1b // a < b
+#define EXPR_BYTECODE_LE     0x1c
+#define EXPR_BYTECODE_GT     0x1d
+#define EXPR_BYTECODE_GE     0x1e
+#define EXPR_BYTECODE_EQ     0x1f
+#define EXPR_BYTECODE_NE     0x20
+#define EXPR_BYTECODE_MIN    0x21 // a < b ? a : b (com NaN, b)
+#define EXPR_BYTECODE_MAX    0x22 // a > b ? a : b
+#define EXPR_BYTECODE_SELECT 0x23 // c != 0 ? a : b sobre os três valores do topo
+// Chamada de uma função em lote (TExprBatchFunction): endereço, quantidade de argumentos e
+// propriedades (EXPR_CALL_PURE), para que a reconstrução do grafo saiba se ela é pura
+#define EXPR_BYTECODE_BCALL  0x24
+
+// Maior |n| de x^n compilado como POWI; acima disso as multiplicações acumulam erro demais. Só
+// x^2 e x^-1 saem corretamente arredondados como pow: os demais expoentes (até 11 ulps em x^16 e
+// 14 ulps em x^-16) só viram POWI com EXPR_OPT_FAST_MATH
+#define EXPR_POWI_MAX 16
+
+// Quantidade de linhas processadas por bloco na avaliação em lote
+#define EXPR_BATCH_SIZE 64
+
+// Operações sobre um bloco da avaliação em lote, conforme o tipo dos valores da pilha (T). ROWS
+// é a quantidade de linhas por bloco: a mesma memória de EXPR_BATCH_SIZE doubles
+template <class T> struct ExprBatchOps;
+template <> struct ExprBatchOps <double> {
+	static const int ROWS = EXPR_BATCH_SIZE;
+	const ExprKernels& kernels;
+	// Espaço para os ponteiros dos argumentos das funções em lote e para os argumentos de uma
+	// linha das demais chamadas, alocado por quem avalia (ExprBytecode::callSlots posições)
+	const double** ptrs;
+	double* line;
+	ExprBatchOps(): kernels(ExprKernels::get()), ptrs(nullptr), line(nullptr) {}
+	void scratch(const double** ptrs, double* line, double*) {
+		this->ptrs = ptrs;
+		this->line = line;
+	}
+	void add(double d[], const double s[], int n) const {
+		kernels.add(d, s, n);
+	}
+	void sub(double d[], const double s[], int n) const {
+		kernels.sub(d, s, n);
+	}
+	void mul(double d[], const double s[], int n) const {
+		kernels.mul(d, s, n);
+	}
+	void div(double d[], const double s[], int n) const {
+		kernels.div(d, s, n);
+	}
+	void pow(double d[], const double s[], int n) const {
+		kernels.pow(d, s, n);
+	}
+	void abs(double d[], int n) const {
+		kernels.abs(d, n);
+	}
+	void neg(double d[], int n) const {
+		kernels.neg(d, n);
+	}
+	void sqrt(double d[], int n) const {
+		ExprScalarKernels::sqrt(d, n);
+	}
+	void min(double d[], const double s[], int n) const {
+		kernels.min(d, s, n);
+	}
+	void max(double d[], const double s[], int n) const {
+		kernels.max(d, s, n);
+	}
+	// Comparação k (a partir de EXPR_BYTECODE_LT)
+	void cmp(int k, double d[], const double s[], int n) const {
+		kernels.cmp[k](d, s, n);
+	}
+	void select(double d[], const double a[], const double b[], int n) const {
+		kernels.select(d, a, b, n);
+	}
+	// Aplica o kernel da função padrão ref; falso se ela não tiver kernel
+	bool call(TExprFunction ref, double d[], int n) const {
+		TExprKernel1 kernel = kernels.find(ref);
+		if (kernel) kernel(d, n);
+		return kernel != nullptr;
+	}
+	// Função em lote sobre os blocos args[0..m-1], com o resultado em args[0]. O bloco args[m]
+	// é livre e recebe a saída, que assim não se sobrepõe a nenhum argumento
+	void call(TExprBatchFunction ref, double (*args)[ROWS], int m, int n) const {
+		for (int j=0; j<m; ++j) ptrs[j] = args[j];
+		ref(ptrs, args[m], n);
+		memcpy(args[0], args[m], n * sizeof(double));
+	}
+};
+// Em float, pow e as funções padrão passam por um bloco em double
+template <> struct ExprBatchOps <float> {
+	static const int ROWS = EXPR_BATCH_SIZE * 2;
+	const ExprKernels& kernels;
+	const ExprFloatKernels& floatKernels;
+	// Como em double, mais os blocos em double dos argumentos e da saída das funções em lote
+	// (ExprBytecode::callSlots blocos de ROWS valores)
+	const double** ptrs;
+	double* line;
+	double* wide;
+	ExprBatchOps(): kernels(ExprKernels::get()), floatKernels(ExprFloatKernels::get()),
+		ptrs(nullptr), line(nullptr), wide(nullptr) {}
+	void scratch(const double** ptrs, double* line, double* wide) {
+		this->ptrs = ptrs;
+		this->line = line;
+		this->wide = wide;
+	}
+	void add(float d[], const float s[], int n) const {
+		floatKernels.add(d, s, n);
+	}
+	void sub(float d[], const float s[], int n) const {
+		floatKernels.sub(d, s, n);
+	}
+	void mul(float d[], const float s[], int n) const {
+		floatKernels.mul(d, s, n);
+	}
+	void div(float d[], const float s[], int n) const {
+		floatKernels.div(d, s, n);
+	}
+	void pow(float d[], const float s[], int n) const {
+		double a[2 * ROWS] = {};
+		floatKernels.widen(a, d, n);
+		floatKernels.widen(a + ROWS, s, n);
+		kernels.pow(a, a + ROWS, n);
+		floatKernels.narrow(d, a, n);
+	}
+	void abs(float d[], int n) const {
+		floatKernels.abs(d, n);
+	}
+	void neg(float d[], int n) const {
+		floatKernels.neg(d, n);
+	}
+	void sqrt(float d[], int n) const {
+		ExprScalarKernels::sqrt(d, n);
+	}
+	void min(float d[], const float s[], int n) const {
+		floatKernels.min(d, s, n);
+	}
+	void max(float d[], const float s[], int n) const {
+		floatKernels.max(d, s, n);
+	}
+	void cmp(int k, float d[], const float s[], int n) const {
+		floatKernels.cmp[k](d, s, n);
+	}
+	void select(float d[], const float a[], const float b[], int n) const {
+		floatKernels.select(d, a, b, n);
+	}
+	bool call(TExprFunction ref, float d[], int n) const {
+		TExprKernel1 kernel = kernels.find(ref);
+		if (!kernel) return false;
+		double a[ROWS];
+		floatKernels.widen(a, d, n);
+		kernel(a, n);
+		floatKernels.narrow(d, a, n);
+		return true;
+	}
+	void call(TExprBatchFunction ref, float (*args)[ROWS], int m, int n) const {
+		for (int j=0; j<m; ++j) {
+			floatKernels.widen(wide + j * ROWS, args[j], n);
+			ptrs[j] = wide + j * ROWS;
+		}
+		ref(ptrs, wide + m * ROWS, n);
+		floatKernels.narrow(args[0], wide + m * ROWS, n);
+	}
+};
+
+// Precisão dos valores intermediários na avaliação em lote sobre colunas float
+#define EXPR_ACCUM_FLOAT  0
+#define EXPR_ACCUM_DOUBLE 1
+
+// Profundidade da pilha de valores alocada localmente; expressões mais profundas usam o heap
+#define EXPR_STACK_SIZE 64
+
+// Despacho por "computed goto" (extensão do GCC/Clang), com switch como alternativa
+#if defined(__GNUC__)
+#define EXPR_VM_THREADED
+#endif
+
+class ExprBytecode {
+private:
+	std::vector <unsigned char> blob;
+	int nArgs;
+	int depth;
+	int maxDepth;
+	int nTemps;
+	int nOuts;
+	// Maior quantidade de argumentos de uma chamada (CALL), ou de argumentos mais a saída de uma
+	// chamada em lote (BCALL); 0 se não houver nenhuma
+	int callSlots;
+	// Nome com que cada função chamada foi registrada, para diagnóstico (ExprProfile)
+	std::map <const void*, std::string> callNames;
+	// Nome de cada variável lida por referência, usado na serialização (save)
+	std::map <const void*, std::string> refNames;
+	// Parâmetros: valores que podem ser trocados depois da compilação, lidos pela instrução PARAM
+	std::vector <double> params;
+	std::vector <std::string> paramNames;
+	void addByte(unsigned char byte) {
+		blob.push_back(byte);
+	}
+	static void writeInt(std::vector <unsigned char> &out, unsigned int value) {
+		while (value >= 0x80) {
+			out.push_back((value & 0x7f) | 0x80);
+			value >>= 7;
+		}
+		out.push_back(value);
+	}
+	static void writeStr(std::vector <unsigned char> &out, const std::string &str) {
+		out.insert(out.end(), str.begin(), str.end());
+		out.push_back(0);
+	}
+	void addInt(unsigned int value) {
+		writeInt(blob, value);
+	}
+	void addVal(double value) {
+		const unsigned char* ptr = (const unsigned char*) &value;
+		blob.insert(blob.end(), ptr, ptr + sizeof(double));
+	}
+	void addPtr(const void* ref) {
+		const unsigned char* ptr = (const unsigned char*) &ref;
+		blob.insert(blob.end(), ptr, ptr + sizeof(void*));
+	}
+	void push(int n) {
+		depth += n;
+		if (depth > maxDepth) maxDepth = depth;
+	}
+	static int readInt(const unsigned char* &pc) {
+		unsigned int value = *pc++;
+		if (value < 0x80) return value;
+		value &= 0x7f;
+		for (int shift=7; ; shift+=7) {
+			unsigned int byte = *pc++;
+			value |= (byte & 0x7f) << shift;
+			if (byte < 0x80) return value;
+		}
+	}
+	static double readVal(const unsigned char* ptr) {
+		double value;
+		memcpy(&value, ptr, sizeof(double));
+		return value;
+	}
+	// Lê a constante em pc e avança
+	static double nextVal(const unsigned char* &pc) {
+		double value = readVal(pc);
+		pc += sizeof(double);
+		return value;
+	}
+	// Inteiro com sinal em zigzag (0, -1, 1, -2, ... viram 0, 1, 2, 3, ...)
+	static void writeSigned(std::vector <unsigned char> &out, int value) {
+		writeInt(out, value < 0 ? ((unsigned int) - value << 1) - 1 : (unsigned int) value << 1);
+	}
+	static int toSigned(unsigned int value) {
+		return value & 1 ? - (int) ((value + 1) >> 1) : (int) (value >> 1);
+	}
+	static int readSigned(const unsigned char* &pc) {
+		return toSigned(readInt(pc));
+	}
+	static void* readRef(const unsigned char* ptr) {
+		void* ref;
+		memcpy(&ref, ptr, sizeof(void*));
+		return ref;
+	}
+	// Os temporários ficam logo após a pilha, em sp[maxDepth]. As instruções OUT escrevem em out
+	double run(const double* vArgs, double* sp, double* out) const {
+		const unsigned char* pc = blob.data();
+		double* base = sp;
+		double* tmp = sp + maxDepth;
+#ifdef EXPR_VM_THREADED
+		static void* const labels[] = {
+			&&op_END, &&op_CONST, &&op_ARG, &&op_REF, &&op_ABS, &&op_NEG,
+			&&op_ADD, &&op_SUB, &&op_MUL, &&op_DIV, &&op_POW, &&op_CALL,
+			&&op_STORE, &&op_LOAD, &&op_OUT, &&op_PARAM, &&op_MULADD, &&op_POWI, &&op_SQRT,
+			&&op_ADDC, &&op_SUBC, &&op_MULC, &&op_DIVC, &&op_ADDA, &&op_SUBA, &&op_MULA, &&op_DIVA,
+			&&op_LT, &&op_LE, &&op_GT, &&op_GE, &&op_EQ, &&op_NE, &&op_MIN, &&op_MAX, &&op_SELECT,
+			&&op_BCALL
+		};
+#define EXPR_VM_CASE(OP) op_##OP:
+#define EXPR_VM_NEXT goto *labels[*pc++]
+		EXPR_VM_NEXT;
+#else
+#define EXPR_VM_CASE(OP) case EXPR_BYTECODE_##OP:
+#define EXPR_VM_NEXT continue
+		for (;;) switch (*pc++) {
+#endif
+			EXPR_VM_CASE(END) {
+				return sp > base ? sp[-1] : 0;
+			}
+			EXPR_VM_CASE(CONST) {
+				*sp++ = readVal(pc);
+				pc += sizeof(double);
+				EXPR_VM_NEXT;
+			}
+			EXPR_VM_CASE(ARG) {
+				*sp++ = vArgs[readInt(pc)];
+				EXPR_VM_NEXT;
+			}
+			EXPR_VM_CASE(REF) {
+				*sp++ = *(const double*)readRef(pc);
+				pc += sizeof(void*);
+				EXPR_VM_NEXT;
+			}
+			EXPR_VM_CASE(ABS) {
+				double value = sp[-1];
+				sp[-1] = value >= 0 ? value : - value;
+				EXPR_VM_NEXT;
+			}
+			EXPR_VM_CASE(NEG) {
+				sp[-1] = - sp[-1];
+				EXPR_VM_NEXT;
+			}
+			EXPR_VM_CASE(ADD) {
+				--sp;
+				sp[-1] += sp[0];
+				EXPR_VM_NEXT;
+			}
+			EXPR_VM_CASE(SUB) {
+				--sp;
+				sp[-1] -= sp[0];
+				EXPR_VM_NEXT;
+			}
+			EXPR_VM_CASE(MUL) {
+				--sp;
+				sp[-1] *= sp[0];
+				EXPR_VM_NEXT;
+			}
+			EXPR_VM_CASE(DIV) {
+				--sp;
+				sp[-1] /= sp[0];
+				EXPR_VM_NEXT;
+			}
+			EXPR_VM_CASE(POW) {
+				--sp;
+				sp[-1] = pow(sp[-1], sp[0]);
+				EXPR_VM_NEXT;
+			}
+			EXPR_VM_CASE(CALL) {
+				// Os argumentos já estão contíguos no topo da pilha
+				TExprFunction ref = (TExprFunction) readRef(pc);
+				pc += sizeof(void*);
+				sp -= readInt(pc);
+				*sp = ref(sp);
+				++sp;
+				EXPR_VM_NEXT;
+			}
+			EXPR_VM_CASE(STORE) {
+				tmp[readInt(pc)] = sp[-1];
+				EXPR_VM_NEXT;
+			}
+			EXPR_VM_CASE(LOAD) {
+				*sp++ = tmp[readInt(pc)];
+				EXPR_VM_NEXT;
+			}
+			EXPR_VM_CASE(OUT) {
+				out[readInt(pc)] = *--sp;
+				EXPR_VM_NEXT;
+			}
+			EXPR_VM_CASE(PARAM) {
+				*sp++ = params[readInt(pc)];
+				EXPR_VM_NEXT;
+			}
+			EXPR_VM_CASE(MULADD) {
+				sp -= 2;
+				double product = sp[-1] * sp[0];
+				sp[-1] = product + sp[1];
+				EXPR_VM_NEXT;
+			}
+			EXPR_VM_CASE(POWI) {
+				sp[-1] = ExprScalarKernels::powi(sp[-1], readSigned(pc));
+				EXPR_VM_NEXT;
+			}
+			EXPR_VM_CASE(SQRT) {
+				sp[-1] = ExprScalarKernels::sqrt(sp[-1]);
+				EXPR_VM_NEXT;
+			}
+			EXPR_VM_CASE(ADDC) {
+				sp[-1] += nextVal(pc);
+				EXPR_VM_NEXT;
+			}
+			EXPR_VM_CASE(SUBC) {
+				sp[-1] -= nextVal(pc);
+				EXPR_VM_NEXT;
+			}
+			EXPR_VM_CASE(MULC) {
+				sp[-1] *= nextVal(pc);
+				EXPR_VM_NEXT;
+			}
+			EXPR_VM_CASE(DIVC) {
+				sp[-1] /= nextVal(pc);
+				EXPR_VM_NEXT;
+			}
+			EXPR_VM_CASE(ADDA) {
+				sp[-1] += vArgs[readInt(pc)];
+				EXPR_VM_NEXT;
+			}
+			EXPR_VM_CASE(SUBA) {
+				sp[-1] -= vArgs[readInt(pc)];
+				EXPR_VM_NEXT;
+			}
+			EXPR_VM_CASE(MULA) {
+				sp[-1] *= vArgs[readInt(pc)];
+				EXPR_VM_NEXT;
+			}
+			EXPR_VM_CASE(DIVA) {
+				sp[-1] /= vArgs[readInt(pc)];
+				EXPR_VM_NEXT;
+			}
+			EXPR_VM_CASE(LT) {
+				--sp;
+				sp[-1] = sp[-1] < sp[0];
+				EXPR_VM_NEXT;
+			}
+			EXPR_VM_CASE(LE) {
+				--sp;
+				sp[-1] = sp[-1] <= sp[0];
+				EXPR_VM_NEXT;
+			}
+			EXPR_VM_CASE(GT) {
+				--sp;
+				sp[-1] = sp[-1] > sp[0];
+				EXPR_VM_NEXT;
+			}
+			EXPR_VM_CASE(GE) {
+				--sp;
+				sp[-1] = sp[-1] >= sp[0];
+				EXPR_VM_NEXT;
+			}
+			EXPR_VM_CASE(EQ) {
+				--sp;
+				sp[-1] = sp[-1] == sp[0];
+				EXPR_VM_NEXT;
+			}
+			EXPR_VM_CASE(NE) {
+				--sp;
+				sp[-1] = sp[-1] != sp[0];
+				EXPR_VM_NEXT;
+			}
+			EXPR_VM_CASE(MIN) {
+				--sp;
+				sp[-1] = sp[-1] < sp[0] ? sp[-1] : sp[0];
+				EXPR_VM_NEXT;
+			}
+			EXPR_VM_CASE(MAX) {
+				--sp;
+				sp[-1] = sp[-1] > sp[0] ? sp[-1] : sp[0];
+				EXPR_VM_NEXT;
+			}
+			EXPR_VM_CASE(SELECT) {
+				sp -= 2;
+				sp[-1] = sp[-1] != 0 ? sp[0] : sp[1];
+				EXPR_VM_NEXT;
+			}
+			EXPR_VM_CASE(BCALL) {
+				TExprBatchFunction ref = (TExprBatchFunction) readRef(pc);
+				pc += sizeof(void*);
+				int m = readInt(pc);
+				readInt(pc); // Propriedades
+				sp -= m;
+				*sp = ExprCalls::callBatch(ref, sp, m);
+				++sp;
+				EXPR_VM_NEXT;
+			}
+#ifndef EXPR_VM_THREADED
+			default: return 0;
+		}
+#endif
+#undef EXPR_VM_CASE
+#undef EXPR_VM_NEXT
+	}
+	// Leitura do formato serializado, com verificação de limites: qualquer leitura além do fim
+	// torna ok falso
+	struct Input {
+		const unsigned char* ptr;
+		const unsigned char* end;
+		bool ok;
+		unsigned int readInt() {
+			unsigned int value = 0;
+			for (int shift=0; shift<35; shift+=7) {
+				if (ptr == end) break;
+				unsigned int byte = *ptr++;
+				value |= (byte & 0x7f) << shift;
+				if (byte < 0x80) return value;
+			}
+			ok = false;
+			return 0;
+		}
+		double readVal() {
+			double value = 0;
+			if (end - ptr < (long) sizeof(double)) {
+				ok = false;
+			} else {
+				memcpy(&value, ptr, sizeof(double));
+				ptr += sizeof(double);
+			}
+			return value;
+		}
+		std::string readStr() {
+			const unsigned char* last = (const unsigned char*) memchr(ptr, 0, end - ptr);
+			if (!last) {
+				ok = false;
+				return "";
+			}
+			std::string str((const char*) ptr, (const char*) last);
+			ptr = last + 1;
+			return str;
+		}
+	};
+	// Operando de uma instrução com constante, preenchido no bloco todo da posição livre da pilha
+	// (a quantidade fixa de linhas permite ao compilador vetorizar o laço)
+	template <class T> static void fill(T d[], T value) {
+		for (int i=0; i<ExprBatchOps <T>::ROWS; ++i) d[i] = value;
+	}
+	// Operando de uma instrução com argumento: a própria coluna, se for do tipo da pilha, ou uma
+	// cópia convertida em tmp
+	template <class T> static const T* column(const T s[], T*, int) {
+		return s;
+	}
+	template <class C, class T> static const T* column(const C s[], T tmp[], int n) {
+		for (int i=0; i<n; ++i) tmp[i] = s[i];
+		return tmp;
+	}
+	// Avalia as n linhas a partir de row; cada posição da pilha guarda um bloco de linhas
+	// O resultado vai para res[row..] ou, com instruções OUT, para outs[k][row..]. As colunas e
+	// saídas são do tipo C e a pilha do tipo T, que pode ter mais precisão que elas
+	template <class C, class T>
+	void runBatch(const C* const cols[], long row, C* res, C* const outs[], int n,
+		T (*sp)[ExprBatchOps <T>::ROWS], const ExprBatchOps <T>& ops) const {
+		const unsigned char* pc = blob.data();
+		T (*tmp)[ExprBatchOps <T>::ROWS] = sp + maxDepth;
+		for (;;) switch (*pc++) {
+			case EXPR_BYTECODE_END: {
+				if (res) {
+					for (int i=0; i<n; ++i) res[row + i] = sp[-1][i];
+				}
+				return;
+			}
+			case EXPR_BYTECODE_CONST: {
+				T value = readVal(pc);
+				pc += sizeof(double);
+				for (int i=0; i<n; ++i) sp[0][i] = value;
+				++sp;
+				break;
+			}
+			case EXPR_BYTECODE_ARG: {
+				const C* col = cols[readInt(pc)] + row;
+				for (int i=0; i<n; ++i) sp[0][i] = col[i];
+				++sp;
+				break;
+			}
+			case EXPR_BYTECODE_REF: {
+				T value = *(const double*)readRef(pc);
+				pc += sizeof(void*);
+				for (int i=0; i<n; ++i) sp[0][i] = value;
+				++sp;
+				break;
+			}
+			case EXPR_BYTECODE_ABS: ops.abs(sp[-1], n); break;
+			case EXPR_BYTECODE_NEG: ops.neg(sp[-1], n); break;
+			case EXPR_BYTECODE_ADD: --sp; ops.add(sp[-1], sp[0], n); break;
+			case EXPR_BYTECODE_SUB: --sp; ops.sub(sp[-1], sp[0], n); break;
+			case EXPR_BYTECODE_MUL: --sp; ops.mul(sp[-1], sp[0], n); break;
+			case EXPR_BYTECODE_DIV: --sp; ops.div(sp[-1], sp[0], n); break;
+			case EXPR_BYTECODE_POW: --sp; ops.pow(sp[-1], sp[0], n); break;
+			case EXPR_BYTECODE_CALL: {
+				TExprFunction ref = (TExprFunction) readRef(pc);
+				pc += sizeof(void*);
+				int m = readInt(pc);
+				if (m == 1 && ops.call(ref, sp[-1], n)) break;
+				sp -= m;
+				for (int i=0; i<n; ++i) {
+					for (int j=0; j<m; ++j) ops.line[j] = sp[j][i];
+					sp[0][i] = ref(ops.line);
+				}
+				++sp;
+				break;
+			}
+			case EXPR_BYTECODE_STORE: {
+				memcpy(tmp[readInt(pc)], sp[-1], n * sizeof(T));
+				break;
+			}
+			case EXPR_BYTECODE_LOAD: {
+				memcpy(sp[0], tmp[readInt(pc)], n * sizeof(T));
+				++sp;
+				break;
+			}
+			case EXPR_BYTECODE_OUT: {
+				--sp;
+				C* out = outs[readInt(pc)] + row;
+				for (int i=0; i<n; ++i) out[i] = sp[0][i];
+				break;
+			}
+			case EXPR_BYTECODE_PARAM: {
+				T value = params[readInt(pc)];
+				for (int i=0; i<n; ++i) sp[0][i] = value;
+				++sp;
+				break;
+			}
+			case EXPR_BYTECODE_MULADD: {
+				sp -= 2;
+				ops.mul(sp[-1], sp[0], n);
+				ops.add(sp[-1], sp[1], n);
+				break;
+			}
+			case EXPR_BYTECODE_POWI: {
+				// Mesma sequência de ExprScalarKernels::powi, com a base em sp[0]
+				int k = readSigned(pc);
+				unsigned int m = k < 0 ? - k : k;
+				while (!(m & 1)) {
+					ops.mul(sp[-1], sp[-1], n);
+					m >>= 1;
+				}
+				if (m > 1) memcpy(sp[0], sp[-1], n * sizeof(T));
+				while (m >>= 1) {
+					ops.mul(sp[0], sp[0], n);
+					if (m & 1) ops.mul(sp[-1], sp[0], n);
+				}
+				if (k < 0) {
+					fill(sp[0], (T) 1);
+					ops.div(sp[0], sp[-1], n);
+					memcpy(sp[-1], sp[0], n * sizeof(T));
+				}
+				break;
+			}
+			case EXPR_BYTECODE_SQRT: ops.sqrt(sp[-1], n); break;
+			case EXPR_BYTECODE_ADDC: {
+				fill(sp[0], (T) nextVal(pc));
+				ops.add(sp[-1], sp[0], n);
+				break;
+			}
+			case EXPR_BYTECODE_SUBC: {
+				fill(sp[0], (T) nextVal(pc));
+				ops.sub(sp[-1], sp[0], n);
+				break;
+			}
+			case EXPR_BYTECODE_MULC: {
+				fill(sp[0], (T) nextVal(pc));
+				ops.mul(sp[-1], sp[0], n);
+				break;
+			}
+			case EXPR_BYTECODE_DIVC: {
+				fill(sp[0], (T) nextVal(pc));
+				ops.div(sp[-1], sp[0], n);
+				break;
+			}
+			case EXPR_BYTECODE_ADDA: {
+				ops.add(sp[-1], column(cols[readInt(pc)] + row, sp[0], n), n);
+				break;
+			}
+			case EXPR_BYTECODE_SUBA: {
+				ops.sub(sp[-1], column(cols[readInt(pc)] + row, sp[0], n), n);
+				break;
+			}
+			case EXPR_BYTECODE_MULA: {
+				ops.mul(sp[-1], column(cols[readInt(pc)] + row, sp[0], n), n);
+				break;
+			}
+			case EXPR_BYTECODE_DIVA: {
+				ops.div(sp[-1], column(cols[readInt(pc)] + row, sp[0], n), n);
+				break;
+			}
+			case EXPR_BYTECODE_LT:
+			case EXPR_BYTECODE_LE:
+			case EXPR_BYTECODE_GT:
+			case EXPR_BYTECODE_GE:
+			case EXPR_BYTECODE_EQ:
+			case EXPR_BYTECODE_NE: {
+				--sp;
+				ops.cmp(pc[-1] - EXPR_BYTECODE_LT, sp[-1], sp[0], n);
+				break;
+			}
+			case EXPR_BYTECODE_MIN: --sp; ops.min(sp[-1], sp[0], n); break;
+			case EXPR_BYTECODE_MAX: --sp; ops.max(sp[-1], sp[0], n); break;
+			case EXPR_BYTECODE_SELECT: {
+				sp -= 2;
+				ops.select(sp[-1], sp[0], sp[1], n);
+				break;
+			}
+			case EXPR_BYTECODE_BCALL: {
+				// Uma única chamada para o bloco todo
+				TExprBatchFunction ref = (TExprBatchFunction) readRef(pc);
+				pc += sizeof(void*);
+				int m = readInt(pc);
+				readInt(pc);
+				sp -= m;
+				ops.call(ref, sp, m, n);
+				++sp;
+				break;
+			}
+			default: return;
+		}
+	}
+	template <class C, class T>
+	void runBatch(const C* const cols[], C res[], C* const outs[], long begin, long end) const {
+		const int rows = ExprBatchOps <T>::ROWS;
+		ExprBatchOps <T> ops;
+		std::vector <T> stack((maxDepth + nTemps) * rows);
+		T (*sp)[rows] = (T (*)[rows]) stack.data();
+		// O espaço das chamadas é alocado uma única vez para todos os blocos
+		std::vector <const double*> ptrs(callSlots);
+		std::vector <double> line(callSlots);
+		std::vector <double> wide(sizeof(T) < sizeof(double) ? callSlots * rows : 0);
+		ops.scratch(ptrs.data(), line.data(), wide.data());
+		for (long row=begin; row<end; row+=rows) {
+			int m = end - row < rows ? end - row : rows;
+			runBatch(cols, row, res, outs, m, sp, ops);
+		}
+	}
+public:
+	// Instrução decodificada, usada por quem percorre o bytecode fora da VM
+	struct Instr {
+		unsigned char op;
+		// ARG, ADDA a DIVA: índice do argumento; CALL e BCALL: quantidade de argumentos;
+		// STORE/LOAD: temporário; OUT: saída; PARAM: parâmetro; POWI: expoente
+		int index;
+		double value; // CONST, ADDC a DIVC
+		const void* ref; // REF: endereço da variável; CALL e BCALL: função chamada
+		int flags; // BCALL: propriedades da função
+	};
+	// Decodifica a instrução em pc e devolve o endereço da seguinte
+	static const unsigned char* decode(const unsigned char* pc, Instr& instr) {
+		instr.op = *pc++;
+		instr.index = 0;
+		instr.value = 0;
+		instr.ref = nullptr;
+		instr.flags = 0;
+		switch (instr.op) {
+			case EXPR_BYTECODE_CONST:
+			case EXPR_BYTECODE_ADDC:
+			case EXPR_BYTECODE_SUBC:
+			case EXPR_BYTECODE_MULC:
+			case EXPR_BYTECODE_DIVC:
+				instr.value = nextVal(pc);
+			break;
+			case EXPR_BYTECODE_ARG:
+			case EXPR_BYTECODE_STORE:
+			case EXPR_BYTECODE_LOAD:
+			case EXPR_BYTECODE_OUT:
+			case EXPR_BYTECODE_PARAM:
+			case EXPR_BYTECODE_ADDA:
+			case EXPR_BYTECODE_SUBA:
+			case EXPR_BYTECODE_MULA:
+			case EXPR_BYTECODE_DIVA:
+				instr.index = readInt(pc);
+			break;
+			case EXPR_BYTECODE_POWI:
+				instr.index = readSigned(pc);
+			break;
+			case EXPR_BYTECODE_REF:
+				instr.ref = readRef(pc);
+				pc += sizeof(void*);
+			break;
+			case EXPR_BYTECODE_CALL:
+				instr.ref = readRef(pc);
+				pc += sizeof(void*);
+				instr.index = readInt(pc);
+			break;
+			case EXPR_BYTECODE_BCALL:
+				instr.ref = readRef(pc);
+				pc += sizeof(void*);
+				instr.index = readInt(pc);
+				instr.flags = readInt(pc);
+			break;
+		}
+		return pc;
+	}
+	const unsigned char* code() const {
+		return blob.data();
+	}
+	// Tamanho do bytecode em bytes
+	size_t size() const {
+		return blob.size();
+	}
+	int stackSize() const {
+		return maxDepth;
+	}
+	int argCount() const {
+		return nArgs;
+	}
+	int tempCount() const {
+		return nTemps;
+	}
+	int outCount() const {
+		return nOuts;
+	}
+	ExprBytecode() {
+		nArgs = 0;
+		depth = 0;
+		maxDepth = 0;
+		nTemps = 0;
+		nOuts = 0;
+		callSlots = 0;
+	}
+	void addConst(double value) {
+		addByte(EXPR_BYTECODE_CONST);
+		addVal(value);
+		push(1);
+	}
+	void addArg(int index) {
+		addByte(EXPR_BYTECODE_ARG);
+		addInt(index);
+		updateNArgs(index + 1);
+		push(1);
+	}
+	void addRef(const double* ref) {
+		addByte(EXPR_BYTECODE_REF);
+		addPtr(ref);
+		push(1);
+	}
+	// Operadores unários (ABS, NEG, SQRT), binários (ADD, SUB, MUL, DIV, POW, comparações, MIN e
+	// MAX) e ternários (MULADD, SELECT)
+	void addOpr(unsigned char opr) {
+		addByte(opr);
+		if (opr == EXPR_BYTECODE_MULADD || opr == EXPR_BYTECODE_SELECT) {
+			push(-2);
+		} else if (opr != EXPR_BYTECODE_ABS && opr != EXPR_BYTECODE_NEG &&
+			opr != EXPR_BYTECODE_SQRT) {
+			push(-1);
+		}
+	}
+	// Operação opr (ADD, SUB, MUL ou DIV) entre o topo e a constante value. Esta instrução, as com
+	// argumento e POWI reservam uma posição acima do topo, usada pela avaliação em lote
+	void addOprConst(unsigned char opr, double value) {
+		addByte(EXPR_BYTECODE_ADDC + opr - EXPR_BYTECODE_ADD);
+		addVal(value);
+		push(1);
+		push(-1);
+	}
+	// Operação opr (ADD, SUB, MUL ou DIV) entre o topo e o argumento index
+	void addOprArg(unsigned char opr, int index) {
+		addByte(EXPR_BYTECODE_ADDA + opr - EXPR_BYTECODE_ADD);
+		addInt(index);
+		updateNArgs(index + 1);
+		push(1);
+		push(-1);
+	}
+	// Topo elevado ao inteiro n (n != 0)
+	void addPowi(int n) {
+		addByte(EXPR_BYTECODE_POWI);
+		writeSigned(blob, n);
+		push(1);
+		push(-1);
+	}
+	// Chamada sobre os n valores do topo da pilha
+	void addCall(TExprFunction ref, int n) {
+		addByte(EXPR_BYTECODE_CALL);
+		addPtr((const void*) ref);
+		addInt(n);
+		push(1 - n);
+		if (n > callSlots) callSlots = n;
+	}
+	// Chamada em lote sobre os n valores do topo da pilha. Reserva uma posição acima do topo para
+	// a saída da avaliação em lote
+	void addBatchCall(TExprBatchFunction ref, int n, int flags) {
+		addByte(EXPR_BYTECODE_BCALL);
+		addPtr((const void*) ref);
+		addInt(n);
+		addInt(flags & EXPR_CALL_PURE);
+		push(1);
+		push(- n);
+		if (n + 1 > callSlots) callSlots = n + 1;
+	}
+	void setCallName(TExprFunction ref, const std::string &name) {
+		callNames[(const void*) ref] = name;
+	}
+	void setCallName(TExprBatchFunction ref, const std::string &name) {
+		callNames[(const void*) ref] = name;
+	}
+	// Nome registrado para a função, o nome padrão ou, na falta dos dois, o endereço
+	std::string callName(const void* ref) const {
+		auto it = callNames.find(ref);
+		if (it != callNames.end()) return it->second;
+		const char* name = ExprCalls::name((TExprFunction) ref);
+		if (name) return name;
+		char str[32];
+		snprintf(str, sizeof(str), "%p", ref);
+		return str;
+	}
+	void setRefName(const double* ref, const std::string &name) {
+		refNames[(const void*) ref] = name;
+	}
+	// Nome registrado para a variável, ou "" se não houver
+	std::string refName(const void* ref) const {
+		auto it = refNames.find(ref);
+		return it != refNames.end() ? it->second : "";
+	}
+	// Índice do parâmetro, criado com o valor inicial value se ainda não existir
+	int paramSlot(const std::string &name, double value) {
+		int index = paramIndex(name);
+		if (index >= 0) return index;
+		params.push_back(value);
+		paramNames.push_back(name);
+		return params.size() - 1;
+	}
+	void addParam(int index) {
+		addByte(EXPR_BYTECODE_PARAM);
+		addInt(index);
+		push(1);
+	}
+	int paramCount() const {
+		return params.size();
+	}
+	// Índice do parâmetro, ou -1 se não existir
+	int paramIndex(const std::string &name) const {
+		for (size_t i=0; i<paramNames.size(); ++i) {
+			if (paramNames[i] == name) return i;
+		}
+		return -1;
+	}
+	const std::string& paramName(int index) const {
+		return paramNames[index];
+	}
+	double param(int index) const {
+		return params[index];
+	}
+	// Endereço do valor do parâmetro, estável enquanto o bytecode existir
+	const double* paramRef(int index) const {
+		return &params[index];
+	}
+	// Troca o valor lido pelas próximas avaliações; não deve ocorrer durante uma avaliação
+	void setParam(int index, double value) {
+		params[index] = value;
+	}
+	// Guarda o topo da pilha em um novo temporário e devolve seu índice
+	int addStore() {
+		addByte(EXPR_BYTECODE_STORE);
+		addInt(nTemps);
+		return nTemps++;
+	}
+	void addLoad(int temp) {
+		addByte(EXPR_BYTECODE_LOAD);
+		addInt(temp);
+		push(1);
+	}
+	// Desempilha o topo para a saída index
+	void addOut(int index) {
+		addByte(EXPR_BYTECODE_OUT);
+		addInt(index);
+		if (index + 1 > nOuts) nOuts = index + 1;
+		push(-1);
+	}
+	// Finaliza o bytecode, liberando a capacidade excedente do buffer
+	void end() {
+		addByte(EXPR_BYTECODE_END);
+		blob.shrink_to_fit();
+	}
+	void updateNArgs(int nArgs) {
+		if (nArgs > this->nArgs) this->nArgs = nArgs;
+	}
+	// Formato serializado, independente de posição: os endereços das instruções REF, CALL e BCALL
+	// viram índices em uma tabela de símbolos ('r' variável, 'c' função do usuário, 'b' função em
+	// lote, 's' função padrão), resolvida por nome na carga. Acrescenta o bytecode a out; falso se
+	// alguma variável ou função do usuário não tiver nome registrado
+	bool save(std::vector <unsigned char> &out) const {
+		if (blob.empty()) return false;
+		std::map <const void*, int> index;
+		std::vector <std::pair <char, std::string> > symbols;
+		std::vector <unsigned char> code;
+		const unsigned char* pc = blob.data();
+		Instr instr;
+		do {
+			const unsigned char* start = pc;
+			pc = decode(pc, instr);
+			if (instr.op != EXPR_BYTECODE_REF && instr.op != EXPR_BYTECODE_CALL &&
+				instr.op != EXPR_BYTECODE_BCALL) {
+				code.insert(code.end(), start, pc);
+				continue;
+			}
+			auto it = index.find(instr.ref);
+			if (it == index.end()) {
+				const char* stdName = instr.op == EXPR_BYTECODE_CALL ?
+					ExprCalls::name((TExprFunction) instr.ref) : nullptr;
+				auto name = callNames.find(instr.ref);
+				if (stdName) {
+					symbols.push_back(std::make_pair('s', std::string(stdName)));
+				} else if (instr.op == EXPR_BYTECODE_REF) {
+					symbols.push_back(std::make_pair('r', refName(instr.ref)));
+				} else {
+					symbols.push_back(std::make_pair(instr.op == EXPR_BYTECODE_CALL ? 'c' : 'b',
+						name != callNames.end() ? name->second : std::string()));
+				}
+				if (symbols.back().second.empty()) return false;
+				it = index.insert(std::make_pair(instr.ref, (int) symbols.size() - 1)).first;
+			}
+			code.push_back(instr.op);
+			writeInt(code, it->second);
+			if (instr.op != EXPR_BYTECODE_REF) writeInt(code, instr.index);
+			if (instr.op == EXPR_BYTECODE_BCALL) writeInt(code, instr.flags);
+		} while (instr.op != EXPR_BYTECODE_END);
+		writeInt(out, nArgs);
+		writeInt(out, nTemps);
+		writeInt(out, nOuts);
+		writeInt(out, params.size());
+		for (size_t i=0; i<params.size(); ++i) {
+			const unsigned char* ptr = (const unsigned char*) &params[i];
+			out.insert(out.end(), ptr, ptr + sizeof(double));
+			writeStr(out, paramNames[i]);
+		}
+		writeInt(out, symbols.size());
+		for (auto &symbol : symbols) {
+			out.push_back(symbol.first);
+			writeStr(out, symbol.second);
+		}
+		writeInt(out, code.size());
+		out.insert(out.end(), code.begin(), code.end());
+		return true;
+	}
+	// Carrega em um objeto vazio o bytecode gravado por save em data (size bytes). resolve(type,
+	// name) devolve o endereço da variável ('r') ou da função do usuário ('c' ou 'b'), ou nullptr
+	// se ela não existir; as funções padrão são resolvidas diretamente. O código é verificado
+	// instrução por instrução (índices, símbolos e profundidade da pilha), de forma que dados
+	// inválidos resultam em falso e nunca em um bytecode que acesse memória fora dos seus limites
+	bool load(const unsigned char* data, size_t size,
+		const std::function <const void* (char, const std::string&)> &resolve) {
+		Input in = {data, data + size, true};
+		int savedArgs = in.readInt();
+		int savedTemps = in.readInt();
+		int savedOuts = in.readInt();
+		if (savedArgs < 0 || savedTemps < 0 || savedOuts < 0) return false;
+		unsigned int nParams = in.readInt();
+		for (unsigned int i=0; i<nParams && in.ok; ++i) {
+			params.push_back(in.readVal());
+			paramNames.push_back(in.readStr());
+		}
+		unsigned int nSymbols = in.readInt();
+		std::vector <std::pair <char, const void*> > symbols;
+		for (unsigned int i=0; i<nSymbols && in.ok; ++i) {
+			char type = in.ptr < in.end ? *in.ptr++ : 0;
+			std::string name = in.readStr();
+			const void* ref = nullptr;
+			if (type == 's') {
+				ref = (const void*) ExprCalls::find(name);
+			} else if ((type == 'r' || type == 'c' || type == 'b') && in.ok) {
+				ref = resolve(type, name);
+			}
+			if (!ref) return false;
+			if (type == 'r') {
+				setRefName((const double*) ref, name);
+			} else if (type == 'b') {
+				setCallName((TExprBatchFunction) ref, name);
+			} else {
+				setCallName((TExprFunction) ref, name);
+			}
+			symbols.push_back(std::make_pair(type, ref));
+		}
+		unsigned int codeSize = in.readInt();
+		if (!in.ok || (size_t) (in.end - in.ptr) != codeSize) return false;
+		Input code = {in.ptr, in.end, true};
+		for (;;) {
+			if (code.ptr == code.end) return false;
+			unsigned char op = *code.ptr++;
+			switch (op) {
+				case EXPR_BYTECODE_END:
+					// Sem instruções OUT, o resultado é o único valor que resta na pilha
+					if (code.ptr != code.end || depth != (savedOuts ? 0 : 1)) return false;
+					end();
+					updateNArgs(savedArgs);
+					return nTemps == savedTemps && nOuts == savedOuts;
+				case EXPR_BYTECODE_CONST:
+					addConst(code.readVal());
+				break;
+				case EXPR_BYTECODE_ARG: {
+					int index = code.readInt();
+					if (index < 0 || index >= savedArgs) return false;
+					addArg(index);
+				break;
+				}
+				case EXPR_BYTECODE_REF: {
+					unsigned int index = code.readInt();
+					if (index >= symbols.size() || symbols[index].first != 'r') return false;
+					addRef((const double*) symbols[index].second);
+				break;
+				}
+				case EXPR_BYTECODE_ABS:
+				case EXPR_BYTECODE_NEG:
+				case EXPR_BYTECODE_SQRT:
+					if (depth < 1) return false;
+					addOpr(op);
+				break;
+				case EXPR_BYTECODE_ADD:
+				case EXPR_BYTECODE_SUB:
+				case EXPR_BYTECODE_MUL:
+				case EXPR_BYTECODE_DIV:
+				case EXPR_BYTECODE_POW:
+				case EXPR_BYTECODE_LT:
+				case EXPR_BYTECODE_LE:
+				case EXPR_BYTECODE_GT:
+				case EXPR_BYTECODE_GE:
+				case EXPR_BYTECODE_EQ:
+				case EXPR_BYTECODE_NE:
+				case EXPR_BYTECODE_MIN:
+				case EXPR_BYTECODE_MAX:
+					if (depth < 2) return false;
+					addOpr(op);
+				break;
+				case EXPR_BYTECODE_CALL: {
+					unsigned int index = code.readInt();
+					int n = code.readInt();
+					if (index >= symbols.size() || (symbols[index].first != 'c' &&
+						symbols[index].first != 's') || n < 0 || depth < n) {
+						return false;
+					}
+					addCall((TExprFunction) symbols[index].second, n);
+				break;
+				}
+				case EXPR_BYTECODE_BCALL: {
+					unsigned int index = code.readInt();
+					int n = code.readInt();
+					unsigned int flags = code.readInt();
+					if (index >= symbols.size() || symbols[index].first != 'b' || n < 0 ||
+						depth < n || (flags & ~EXPR_CALL_PURE)) {
+						return false;
+					}
+					addBatchCall((TExprBatchFunction) symbols[index].second, n, flags);
+				break;
+				}
+				case EXPR_BYTECODE_STORE:
+					if (code.readInt() != (unsigned int) nTemps || depth < 1) return false;
+					addStore();
+				break;
+				case EXPR_BYTECODE_LOAD: {
+					int index = code.readInt();
+					if (index < 0 || index >= nTemps) return false;
+					addLoad(index);
+				break;
+				}
+				case EXPR_BYTECODE_OUT: {
+					int index = code.readInt();
+					if (index < 0 || index >= savedOuts || depth < 1) return false;
+					addOut(index);
+				break;
+				}
+				case EXPR_BYTECODE_PARAM: {
+					int index = code.readInt();
+					if (index < 0 || index >= paramCount()) return false;
+					addParam(index);
+				break;
+				}
+				case EXPR_BYTECODE_MULADD:
+				case EXPR_BYTECODE_SELECT:
+					if (depth < 3) return false;
+					addOpr(op);
+				break;
+				case EXPR_BYTECODE_POWI: {
+					int n = toSigned(code.readInt());
+					if (n == 0 || n < - EXPR_POWI_MAX || n > EXPR_POWI_MAX || depth < 1) {
+						return false;
+					}
+					addPowi(n);
+				break;
+				}
+				case EXPR_BYTECODE_ADDC:
+				case EXPR_BYTECODE_SUBC:
+				case EXPR_BYTECODE_MULC:
+				case EXPR_BYTECODE_DIVC:
+					if (depth < 1) return false;
+					addOprConst(op - EXPR_BYTECODE_ADDC + EXPR_BYTECODE_ADD, code.readVal());
+				break;
+				case EXPR_BYTECODE_ADDA:
+				case EXPR_BYTECODE_SUBA:
+				case EXPR_BYTECODE_MULA:
+				case EXPR_BYTECODE_DIVA: {
+					int index = code.readInt();
+					if (index < 0 || index >= savedArgs || depth < 1) return false;
+					addOprArg(op - EXPR_BYTECODE_ADDA + EXPR_BYTECODE_ADD, index);
+				break;
+				}
+				default:
+					return false;
+			}
+			if (!code.ok) return false;
+		}
+	}
+	// A avaliação não altera o bytecode: um mesmo objeto pode ser avaliado por várias threads
+	double calc() const {
+		return calc(nullptr);
+	}
+	double calc(const double* vArgs) const {
+		return calc(vArgs, nullptr);
+	}
+	// Com instruções OUT, as saídas são escritas em out
+	double calc(const double* vArgs, double* out) const {
+		if (maxDepth + nTemps <= EXPR_STACK_SIZE) {
+			double stack[EXPR_STACK_SIZE];
+			return run(vArgs, stack, out);
+		}
+		std::vector <double> stack(maxDepth + nTemps);
+		return run(vArgs, stack.data(), out);
+	}
+	// Avaliação intervalar: devolve um intervalo que contém todos os valores da expressão para
+	// argumentos dentro de vArgs. As instruções OUT escrevem em out
+	ExprInterval calc(const ExprInterval vArgs[], ExprInterval out[]) const {
+		std::vector <ExprInterval> stack(maxDepth + nTemps);
+		ExprInterval* sp = stack.data();
+		ExprInterval* tmp = sp + maxDepth;
+		const unsigned char* pc = blob.data();
+		for (;;) switch (*pc++) {
+			case EXPR_BYTECODE_END:
+				return sp > stack.data() ? sp[-1] : ExprInterval();
+			case EXPR_BYTECODE_CONST:
+				*sp++ = ExprInterval(readVal(pc));
+				pc += sizeof(double);
+			break;
+			case EXPR_BYTECODE_ARG:
+				*sp++ = vArgs[readInt(pc)];
+			break;
+			case EXPR_BYTECODE_REF:
+				*sp++ = ExprInterval(*(const double*)readRef(pc));
+				pc += sizeof(void*);
+			break;
+			case EXPR_BYTECODE_ABS: sp[-1] = ExprIntervalCalls::abs(sp[-1]); break;
+			case EXPR_BYTECODE_NEG: sp[-1] = ExprIntervalCalls::neg(sp[-1]); break;
+			case EXPR_BYTECODE_ADD: --sp; sp[-1] = ExprIntervalCalls::add(sp[-1], sp[0]); break;
+			case EXPR_BYTECODE_SUB: --sp; sp[-1] = ExprIntervalCalls::sub(sp[-1], sp[0]); break;
+			case EXPR_BYTECODE_MUL: --sp; sp[-1] = ExprIntervalCalls::mul(sp[-1], sp[0]); break;
+			case EXPR_BYTECODE_DIV: --sp; sp[-1] = ExprIntervalCalls::div(sp[-1], sp[0]); break;
+			case EXPR_BYTECODE_POW: --sp; sp[-1] = ExprIntervalCalls::pow(sp[-1], sp[0]); break;
+			case EXPR_BYTECODE_CALL: {
+				TExprFunction ref = (TExprFunction) readRef(pc);
+				pc += sizeof(void*);
+				int m = readInt(pc);
+				sp -= m;
+				*sp = ExprIntervalCalls::call(ref, sp, m);
+				++sp;
+			break;
+			}
+			case EXPR_BYTECODE_BCALL: {
+				pc += sizeof(void*);
+				sp -= readInt(pc);
+				readInt(pc);
+				*sp++ = ExprInterval(- INFINITY, INFINITY);
+			break;
+			}
+			case EXPR_BYTECODE_STORE:
+				tmp[readInt(pc)] = sp[-1];
+			break;
+			case EXPR_BYTECODE_LOAD:
+				*sp++ = tmp[readInt(pc)];
+			break;
+			case EXPR_BYTECODE_OUT:
+				out[readInt(pc)] = *--sp;
+			break;
+			case EXPR_BYTECODE_PARAM:
+				*sp++ = ExprInterval(params[readInt(pc)]);
+			break;
+			case EXPR_BYTECODE_MULADD:
+				sp -= 2;
+				sp[-1] = ExprIntervalCalls::add(ExprIntervalCalls::mul(sp[-1], sp[0]), sp[1]);
+			break;
+			case EXPR_BYTECODE_POWI:
+				sp[-1] = ExprIntervalCalls::pown(sp[-1], readSigned(pc));
+			break;
+			case EXPR_BYTECODE_SQRT: sp[-1] = ExprIntervalCalls::pow(sp[-1], 0.5); break;
+			case EXPR_BYTECODE_ADDC: sp[-1] = ExprIntervalCalls::add(sp[-1], nextVal(pc)); break;
+			case EXPR_BYTECODE_SUBC: sp[-1] = ExprIntervalCalls::sub(sp[-1], nextVal(pc)); break;
+			case EXPR_BYTECODE_MULC: sp[-1] = ExprIntervalCalls::mul(sp[-1], nextVal(pc)); break;
+			case EXPR_BYTECODE_DIVC: sp[-1] = ExprIntervalCalls::div(sp[-1], nextVal(pc)); break;
+			case EXPR_BYTECODE_ADDA:
+				sp[-1] = ExprIntervalCalls::add(sp[-1], vArgs[readInt(pc)]);
+			break;
+			case EXPR_BYTECODE_SUBA:
+				sp[-1] = ExprIntervalCalls::sub(sp[-1], vArgs[readInt(pc)]);
+			break;
+			case EXPR_BYTECODE_MULA:
+				sp[-1] = ExprIntervalCalls::mul(sp[-1], vArgs[readInt(pc)]);
+			break;
+			case EXPR_BYTECODE_DIVA:
+				sp[-1] = ExprIntervalCalls::div(sp[-1], vArgs[readInt(pc)]);
+			break;
+			case EXPR_BYTECODE_LT:
+			case EXPR_BYTECODE_LE:
+			case EXPR_BYTECODE_GT:
+			case EXPR_BYTECODE_GE:
+			case EXPR_BYTECODE_EQ:
+			case EXPR_BYTECODE_NE:
+				--sp;
+				sp[-1] = ExprIntervalCalls::cmp(pc[-1] - EXPR_BYTECODE_LT, sp[-1], sp[0]);
+			break;
+			case EXPR_BYTECODE_MIN: --sp; sp[-1] = ExprIntervalCalls::min(sp[-1], sp[0]); break;
+			case EXPR_BYTECODE_MAX: --sp; sp[-1] = ExprIntervalCalls::max(sp[-1], sp[0]); break;
+			case EXPR_BYTECODE_SELECT:
+				sp -= 2;
+				sp[-1] = ExprIntervalCalls::select(sp[-1], sp[0], sp[1]);
+			break;
+			default:
+				return ExprInterval(- INFINITY, INFINITY);
+		}
+	}
+	// Avaliação em lote: cols[i] aponta para a coluna com os n valores do i-ésimo argumento e o
+	// resultado da linha k é escrito em res[k]
+	void calc(const double* const cols[], double res[], int n) const {
+		calc(cols, res, 0, n);
+	}
+	// Avalia somente as linhas de begin até end (exclusive)
+	void calc(const double* const cols[], double res[], long begin, long end) const {
+		calc(cols, res, nullptr, begin, end);
+	}
+	// Com instruções OUT, a saída k da linha r é escrita em outs[k][r]
+	void calc(const double* const cols[], double res[], double* const outs[], long begin,
+		long end) const {
+		runBatch <double, double> (cols, res, outs, begin, end);
+	}
+	// Avaliação em lote em float: com accum EXPR_ACCUM_FLOAT os valores intermediários também são
+	// float, com o dobro de linhas por vetor; com EXPR_ACCUM_DOUBLE são calculados em double e só
+	// as entradas e saídas são float. Constantes, parâmetros e funções do usuário continuam em
+	// double, e as funções recebem os argumentos convertidos
+	void calc(const float* const cols[], float res[], float* const outs[], long begin, long end,
+		int accum) const {
+		if (accum == EXPR_ACCUM_DOUBLE) {
+			runBatch <float, double> (cols, res, outs, begin, end);
+		} else {
+			runBatch <float, float> (cols, res, outs, begin, end);
+		}
+	}
+};
 
-typedef double (*TExprFunction) (const double[]);
+// ---------------------------------------------------------------------------------------------- //
+// Perfil de execução: um interpretador instrumentado que conta, para cada instrução e para cada  //
+// chamada (identificada pela posição no bytecode e pelo nome da função), quantas vezes ela foi   //
+// executada e o tempo gasto nela, em ciclos (rdtsc) ou, fora do x86, em nanossegundos            //
+// ---------------------------------------------------------------------------------------------- //
+class ExprProfile {
+public:
+	struct Counter {
+		std::string name;
+		unsigned long long count;
+		unsigned long long ticks;
+	};
+private:
+	std::vector <Counter> ops; // Indexado pelo código da instrução
+	std::map <size_t, Counter> sites; // Chave: posição da instrução CALL ou BCALL
+	unsigned long long runs;
+	unsigned long long ticks;
+	static unsigned long long now() {
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+		return __builtin_ia32_rdtsc();
+#else
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+	}
+	static const char* opName(unsigned char op) {
+		static const char* const names[] = {
+			"END", "CONST", "ARG", "REF", "ABS", "NEG", "ADD", "SUB", "MUL", "DIV", "POW", "CALL",
+			"STORE", "LOAD", "OUT", "PARAM", "MULADD", "POWI", "SQRT", "ADDC", "SUBC", "MULC",
+			"DIVC", "ADDA", "SUBA", "MULA", "DIVA", "LT", "LE", "GT", "GE", "EQ", "NE", "MIN", "MAX",
+			"SELECT", "BCALL"
+		};
+		return op < sizeof(names) / sizeof(names[0]) ? names[op] : "?";
+	}
+	static bool byTicks(const Counter &a, const Counter &b) {
+		return a.ticks > b.ticks;
+	}
+public:
+	ExprProfile() {
+		clear();
+	}
+	void clear() {
+		ops.assign(256, Counter());
+		for (int op=0; op<256; ++op) ops[op] = Counter{opName(op), 0, 0};
+		sites.clear();
+		runs = 0;
+		ticks = 0;
+	}
+	// Calcula o bytecode como ExprBytecode::calc, acumulando os contadores. Bem mais lento que a
+	// VM: o que interessa é a proporção entre as instruções. Um perfil não deve ser usado por
+	// várias threads ao mesmo tempo
+	double run(const ExprBytecode &bytecode, const double* vArgs, double* out) {
+		std::vector <double> stack(bytecode.stackSize() + bytecode.tempCount() + 1);
+		double* sp = stack.data();
+		double* tmp = sp + bytecode.stackSize();
+		const unsigned char* code = bytecode.code();
+		const unsigned char* pc = code;
+		ExprBytecode::Instr instr;
+		unsigned long long start = now();
+		for (;;) {
+			size_t pos = pc - code;
+			pc = ExprBytecode::decode(pc, instr);
+			if (instr.op == EXPR_BYTECODE_END) break;
+			unsigned long long t0 = now();
+			switch (instr.op) {
+				case EXPR_BYTECODE_CONST: *sp++ = instr.value; break;
+				case EXPR_BYTECODE_ARG: *sp++ = vArgs[instr.index]; break;
+				case EXPR_BYTECODE_REF: *sp++ = *(const double*) instr.ref; break;
+				case EXPR_BYTECODE_ABS: sp[-1] = sp[-1] >= 0 ? sp[-1] : - sp[-1]; break;
+				case EXPR_BYTECODE_NEG: sp[-1] = - sp[-1]; break;
+				case EXPR_BYTECODE_ADD: --sp; sp[-1] += sp[0]; break;
+				case EXPR_BYTECODE_SUB: --sp; sp[-1] -= sp[0]; break;
+				case EXPR_BYTECODE_MUL: --sp; sp[-1] *= sp[0]; break;
+				case EXPR_BYTECODE_DIV: --sp; sp[-1] /= sp[0]; break;
+				case EXPR_BYTECODE_POW: --sp; sp[-1] = pow(sp[-1], sp[0]); break;
+				case EXPR_BYTECODE_CALL:
+					sp -= instr.index;
+					*sp = ((TExprFunction) instr.ref)(sp);
+					++sp;
+				break;
+				case EXPR_BYTECODE_BCALL:
+					sp -= instr.index;
+					*sp = ExprCalls::callBatch((TExprBatchFunction) instr.ref, sp, instr.index);
+					++sp;
+				break;
+				case EXPR_BYTECODE_STORE: tmp[instr.index] = sp[-1]; break;
+				case EXPR_BYTECODE_LOAD: *sp++ = tmp[instr.index]; break;
+				case EXPR_BYTECODE_OUT: out[instr.index] = *--sp; break;
+				case EXPR_BYTECODE_PARAM: *sp++ = bytecode.param(instr.index); break;
+				case EXPR_BYTECODE_MULADD:
+					sp -= 2;
+					sp[-1] *= sp[0];
+					sp[-1] += sp[1];
+				break;
+				case EXPR_BYTECODE_POWI:
+					sp[-1] = ExprScalarKernels::powi(sp[-1], instr.index);
+				break;
+				case EXPR_BYTECODE_SQRT: sp[-1] = ExprScalarKernels::sqrt(sp[-1]); break;
+				case EXPR_BYTECODE_ADDC: sp[-1] += instr.value; break;
+				case EXPR_BYTECODE_SUBC: sp[-1] -= instr.value; break;
+				case EXPR_BYTECODE_MULC: sp[-1] *= instr.value; break;
+				case EXPR_BYTECODE_DIVC: sp[-1] /= instr.value; break;
+				case EXPR_BYTECODE_ADDA: sp[-1] += vArgs[instr.index]; break;
+				case EXPR_BYTECODE_SUBA: sp[-1] -= vArgs[instr.index]; break;
+				case EXPR_BYTECODE_MULA: sp[-1] *= vArgs[instr.index]; break;
+				case EXPR_BYTECODE_DIVA: sp[-1] /= vArgs[instr.index]; break;
+				case EXPR_BYTECODE_LT: --sp; sp[-1] = sp[-1] < sp[0]; break;
+				case EXPR_BYTECODE_LE: --sp; sp[-1] = sp[-1] <= sp[0]; break;
+				case EXPR_BYTECODE_GT: --sp; sp[-1] = sp[-1] > sp[0]; break;
+				case EXPR_BYTECODE_GE: --sp; sp[-1] = sp[-1] >= sp[0]; break;
+				case EXPR_BYTECODE_EQ: --sp; sp[-1] = sp[-1] == sp[0]; break;
+				case EXPR_BYTECODE_NE: --sp; sp[-1] = sp[-1] != sp[0]; break;
+				case EXPR_BYTECODE_MIN: --sp; sp[-1] = sp[-1] < sp[0] ? sp[-1] : sp[0]; break;
+				case EXPR_BYTECODE_MAX: --sp; sp[-1] = sp[-1] > sp[0] ? sp[-1] : sp[0]; break;
+				case EXPR_BYTECODE_SELECT:
+					sp -= 2;
+					sp[-1] = sp[-1] != 0 ? sp[0] : sp[1];
+				break;
+			}
+			unsigned long long t = now() - t0;
+			++ ops[instr.op].count;
+			ops[instr.op].ticks += t;
+			if (instr.op == EXPR_BYTECODE_CALL || instr.op == EXPR_BYTECODE_BCALL) {
+				auto it = sites.find(pos);
+				if (it == sites.end()) {
+					Counter site = {bytecode.callName(instr.ref), 0, 0};
+					it = sites.insert(std::make_pair(pos, site)).first;
+				}
+				++ it->second.count;
+				it->second.ticks += t;
+			}
+		}
+		ticks += now() - start;
+		++ runs;
+		return sp > stack.data() ? sp[-1] : 0;
+	}
+	unsigned long long runCount() const {
+		return runs;
+	}
+	// Tempo total das execuções, incluindo a decodificação e a própria medição
+	unsigned long long totalTicks() const {
+		return ticks;
+	}
+	const Counter& op(unsigned char op) const {
+		return ops[op];
+	}
+	// Instruções executadas ao menos uma vez, da mais para a menos demorada
+	std::vector <Counter> opCounters() const {
+		std::vector <Counter> list;
+		for (const Counter &counter : ops) {
+			if (counter.count) list.push_back(counter);
+		}
+		std::stable_sort(list.begin(), list.end(), byTicks);
+		return list;
+	}
+	// Uma entrada por chamada (CALL ou BCALL), da mais para a menos demorada; o nome inclui a
+	// posição
+	std::vector <Counter> callCounters() const {
+		std::vector <Counter> list;
+		for (auto it=sites.begin(), end=sites.end(); it!=end; ++it) {
+			list.push_back(it->second);
+			list.back().name += " @" + std::to_string(it->first);
+		}
+		std::stable_sort(list.begin(), list.end(), byTicks);
+		return list;
+	}
+	// Relatório em texto: por instrução, por chamada e o tempo restante (despacho e medição)
+	std::string report() const {
+		std::string str;
+		char line[128];
+		double total = ticks ? ticks : 1;
+		double n = runs ? runs : 1;
+		snprintf(line, sizeof(line), "%llu execucoes, %.1f ticks por execucao\n", runs,
+			ticks / n);
+		str += line;
+		unsigned long long used = 0;
+		str += "instrucao       vezes/exec   ticks/exec       %\n";
+		for (const Counter &counter : opCounters()) {
+			snprintf(line, sizeof(line), "%-14s %11.2f %12.1f %6.1f%%\n", counter.name.c_str(),
+				counter.count / n, counter.ticks / n, 100 * counter.ticks / total);
+			str += line;
+			used += counter.ticks;
+		}
+		unsigned long long rest = ticks > used ? ticks - used : 0;
+		snprintf(line, sizeof(line), "%-14s %11s %12.1f %6.1f%%\n", "(despacho)", "",
+			rest / n, 100 * rest / total);
+		str += line;
+		std::vector <Counter> calls = callCounters();
+		if (!calls.empty()) str += "chamada         vezes/exec   ticks/exec       %\n";
+		for (const Counter &counter : calls) {
+			snprintf(line, sizeof(line), "%-14s %11.2f %12.1f %6.1f%%\n", counter.name.c_str(),
+				counter.count / n, counter.ticks / n, 100 * counter.ticks / total);
+			str += line;
+		}
+		return str;
+	}
+};
+
+// Opções da simplificação da árvore (ExprParser::optimize)
+// Permite regras que não preservam o resultado exato: x*0 = 0 (falso para x infinito ou NaN),
+// x + 0 = x e 0 - x = -x (falsos para x = -0 e x = 0), a reassociação de constantes, como
+// (x*c1)/c2 = x*(c1/c2), e x^n por multiplicações (POWI) para n diferente de 2 e -1
+#define EXPR_OPT_FAST_MATH 0x01
 
 // ---------------------------------------------------------------------------------------------- //
-// Estrutura que armazenará um bytecode para a execução da expressão                              //
+// Grafo acíclico das operações, etapa entre a árvore e o bytecode. Sub-expressões iguais viram   //
+// um único nó (hash-consing); um nó usado mais de uma vez é calculado uma única vez e guardado   //
+// em um temporário do bytecode                                                                   //
 // ---------------------------------------------------------------------------------------------- //
-#define EXPR_BYTECODE_CONST 0x01
-#define EXPR_BYTECODE_ARG   0x02
-#define EXPR_BYTECODE_REF   0x03
-#define EXPR_BYTECODE_ABS   0x04
-#define EXPR_BYTECODE_NEG   0x05
-#define EXPR_BYTECODE_ADD   0x06
-#define EXPR_BYTECODE_SUB   0x07
-#define EXPR_BYTECODE_MUL   0x08
-#define EXPR_BYTECODE_DIV   0x09
-#define EXPR_BYTECODE_POW   0x0a
-#define EXPR_BYTECODE_CALL  0x0b
-class ExprBytecode {
+class ExprDag {
+public:
+	struct Node {
+		unsigned char op; // Instrução do bytecode (EXPR_BYTECODE_*)
+		int index; // ARG: índice do argumento; PARAM: índice em params; BCALL: propriedades
+		double value; // CONST
+		const void* ref; // REF: endereço da variável; CALL e BCALL: função chamada
+		std::vector <int> args; // Nós dos operandos, na ordem de avaliação
+		int uses; // Quantidade de nós (e raízes) que usam este, entre os que são calculados
+	};
 private:
-	unsigned char blob[2048];
-	unsigned char* blobPtr;
-	const double* vArgs;
-	int nArgs;
-	unsigned char nextByte() {
-		return *blobPtr++;
+	std::vector <Node> nodes;
+	std::unordered_map <std::string, int> table;
+	std::map <const void*, std::string> callNames;
+	std::map <const void*, std::string> refNames;
+	// Nome e valor inicial de cada parâmetro
+	std::vector <std::pair <std::string, double> > params;
+	// Opções de compilação (EXPR_OPT_*)
+	int flags;
+	// Chave com a instrução e os operandos, que identifica a sub-expressão estruturalmente
+	static std::string key(const Node& node) {
+		std::string str(1, (char) node.op);
+		str.append((const char*) &node.index, sizeof(int));
+		str.append((const char*) &node.value, sizeof(double));
+		str.append((const char*) &node.ref, sizeof(void*));
+		for (int arg : node.args) str.append((const char*) &arg, sizeof(int));
+		return str;
 	}
-	double nextVal() {
-		double value = *(double*)(blobPtr);
-		blobPtr += sizeof(double);
-		return value;
+	// Devolve o nó equivalente já existente ou cria um novo; nós únicos nunca são compartilhados
+	int add(Node& node, bool unique) {
+		std::string str;
+		if (!unique) {
+			str = key(node);
+			auto it = table.find(str);
+			if (it != table.end()) return it->second;
+		}
+		int id = nodes.size();
+		node.uses = 0;
+		nodes.push_back(node);
+		if (!unique) table[str] = id;
+		return id;
 	}
-	void* nextRef() {
-		void* ref = *(void**)(blobPtr);
-		blobPtr += sizeof(void*);
-		return ref;
+	static Node leaf(unsigned char op) {
+		Node node;
+		node.op = op;
+		node.index = 0;
+		node.value = 0;
+		node.ref = nullptr;
+		return node;
 	}
-	double run() {
-		switch (nextByte()) {
-			case EXPR_BYTECODE_CONST: return nextVal();
-			case EXPR_BYTECODE_ARG: return vArgs[nextByte()];
-			case EXPR_BYTECODE_REF: return *(double*)nextRef();
-			case EXPR_BYTECODE_ABS: {
-				double value = run();
-				return value >= 0 ? value : - value;
-			};
-			case EXPR_BYTECODE_NEG: return - run();
-			case EXPR_BYTECODE_ADD: return run() + run();
-			case EXPR_BYTECODE_SUB: {
-				double value = run();
-				return value - run();
-			}
-			case EXPR_BYTECODE_MUL: return run() * run();
-			case EXPR_BYTECODE_DIV: {
-				double value = run();
-				return value / run();
-			}
-			case EXPR_BYTECODE_POW: {
-				double value = run();
-				return pow(value, run());
+	void emit(ExprBytecode &bytecode, int id, std::vector <int> &temps) {
+		if (temps[id] >= 0) {
+			bytecode.addLoad(temps[id]);
+			return;
+		}
+		const Node& node = nodes[id];
+		switch (node.op) {
+			case EXPR_BYTECODE_CONST:
+				bytecode.addConst(node.value);
+			return;
+			case EXPR_BYTECODE_ARG:
+				bytecode.addArg(node.index);
+			return;
+			case EXPR_BYTECODE_REF: {
+				bytecode.addRef((const double*) node.ref);
+				auto it = refNames.find(node.ref);
+				if (it != refNames.end()) bytecode.setRefName((const double*) node.ref, it->second);
+			return;
 			}
-			case EXPR_BYTECODE_CALL: {
-				TExprFunction ref;
-				ref = (TExprFunction) nextRef();
-				int n = nextByte();
-				double v[n];
-				for (int i=0; i<n; ++i) {
-					v[i] = run();
+			case EXPR_BYTECODE_PARAM:
+				bytecode.addParam(bytecode.paramSlot(params[node.index].first,
+					params[node.index].second));
+			return;
+		}
+		if (!emitFused(bytecode, node, temps)) {
+			for (int arg : node.args) emit(bytecode, arg, temps);
+			if (node.op == EXPR_BYTECODE_CALL) {
+				bytecode.addCall((TExprFunction) node.ref, node.args.size());
+				auto it = callNames.find(node.ref);
+				if (it != callNames.end()) {
+					bytecode.setCallName((TExprFunction) node.ref, it->second);
 				}
-				return ref(v);
+			} else if (node.op == EXPR_BYTECODE_BCALL) {
+				bytecode.addBatchCall((TExprBatchFunction) node.ref, node.args.size(), node.index);
+				auto it = callNames.find(node.ref);
+				if (it != callNames.end()) {
+					bytecode.setCallName((TExprBatchFunction) node.ref, it->second);
+				}
+			} else {
+				bytecode.addOpr(node.op);
+			}
+		}
+		// Folhas são recarregadas diretamente; só operações compartilhadas vão para temporários
+		if (node.uses > 1) temps[id] = bytecode.addStore();
+	}
+	// Operando que pode ir dentro da instrução (ADDC, ADDA...)
+	bool isInline(int id) const {
+		return nodes[id].op == EXPR_BYTECODE_CONST || nodes[id].op == EXPR_BYTECODE_ARG;
+	}
+	// Produto usado só por quem o consulta e que não cabe em MULC ou MULA
+	bool isProduct(int id) const {
+		const Node& node = nodes[id];
+		return node.op == EXPR_BYTECODE_MUL && node.uses == 1 && !isInline(node.args[0]) &&
+			!isInline(node.args[1]);
+	}
+	// Seleção de instruções: gera o nó com uma instrução combinada, quando ele se encaixa em uma.
+	// Falso se nada foi gerado
+	bool emitFused(ExprBytecode &bytecode, const Node& node, std::vector <int> &temps) {
+		if (node.op == EXPR_BYTECODE_POW) {
+			const Node& exponent = nodes[node.args[1]];
+			double n = exponent.value;
+			if (exponent.op != EXPR_BYTECODE_CONST || !(n == 0.5 || n == 2 || n == -1 ||
+				((flags & EXPR_OPT_FAST_MATH) && n == floor(n) && n != 0 &&
+				fabs(n) <= EXPR_POWI_MAX))) {
+				return false;
+			}
+			emit(bytecode, node.args[0], temps);
+			if (n == 0.5) {
+				bytecode.addOpr(EXPR_BYTECODE_SQRT);
+			} else {
+				bytecode.addPowi((int) n);
+			}
+			return true;
+		}
+		if (node.op < EXPR_BYTECODE_ADD || node.op > EXPR_BYTECODE_DIV) return false;
+		int a = node.args[0], b = node.args[1];
+		bool commutative = node.op == EXPR_BYTECODE_ADD || node.op == EXPR_BYTECODE_MUL;
+		if (!isInline(b) && commutative && isInline(a)) std::swap(a, b);
+		if (isInline(b)) {
+			emit(bytecode, a, temps);
+			if (nodes[b].op == EXPR_BYTECODE_CONST) {
+				bytecode.addOprConst(node.op, nodes[b].value);
+			} else {
+				bytecode.addOprArg(node.op, nodes[b].index);
+			}
+			return true;
+		}
+		// a*b + c e c + a*b. A parcela só é calculada antes do produto se isso não mudar a ordem
+		// das chamadas: se for uma folha ou já estiver em um temporário
+		if (node.op != EXPR_BYTECODE_ADD) return false;
+		if (!isProduct(a)) {
+			const Node& c = nodes[a];
+			bool leaf = (c.args.empty() && c.op != EXPR_BYTECODE_CALL &&
+				c.op != EXPR_BYTECODE_BCALL) || temps[a] >= 0;
+			if (!isProduct(b) || !leaf) return false;
+			std::swap(a, b);
+		}
+		emit(bytecode, nodes[a].args[0], temps);
+		emit(bytecode, nodes[a].args[1], temps);
+		emit(bytecode, b, temps);
+		bytecode.addOpr(EXPR_BYTECODE_MULADD);
+		return true;
+	}
+public:
+	// flags: opções de compilação (EXPR_OPT_*) que valem para a seleção de instruções
+	explicit ExprDag (int flags = 0): flags(flags) {}
+	int addConst(double value) {
+		Node node = leaf(EXPR_BYTECODE_CONST);
+		node.value = value;
+		return add(node, false);
+	}
+	int addArg(int index) {
+		Node node = leaf(EXPR_BYTECODE_ARG);
+		node.index = index;
+		return add(node, false);
+	}
+	// O nome, se dado, vai para o bytecode
+	int addRef(const double* ref, const char* name = nullptr) {
+		if (name) refNames[(const void*) ref] = name;
+		Node node = leaf(EXPR_BYTECODE_REF);
+		node.ref = ref;
+		return add(node, false);
+	}
+	// Parâmetro identificado pelo nome; value é o valor inicial
+	int addParam(const std::string &name, double value) {
+		size_t index = 0;
+		while (index < params.size() && params[index].first != name) ++index;
+		if (index == params.size()) params.push_back(std::make_pair(name, value));
+		Node node = leaf(EXPR_BYTECODE_PARAM);
+		node.index = index;
+		return add(node, false);
+	}
+	int addOpr(unsigned char opr, int a) {
+		Node node = leaf(opr);
+		node.args.push_back(a);
+		return add(node, false);
+	}
+	int addOpr(unsigned char opr, int a, int b) {
+		Node node = leaf(opr);
+		node.args.push_back(a);
+		node.args.push_back(b);
+		return add(node, false);
+	}
+	int addOpr(unsigned char opr, int a, int b, int c) {
+		Node node = leaf(opr);
+		node.args.push_back(a);
+		node.args.push_back(b);
+		node.args.push_back(c);
+		return add(node, false);
+	}
+	// Chamadas sem EXPR_CALL_PURE são sempre avaliadas, uma vez por ocorrência na expressão. O
+	// nome, se dado, vai para o bytecode. min, max, clamp e if viram operações do grafo
+	int addCall(TExprFunction ref, int flags, const std::vector <int> &args,
+		const char* name = nullptr) {
+		if (args.size() == 2 && ref == ExprCalls::call_min) {
+			return fold(EXPR_BYTECODE_MIN, args[0], args[1]);
+		}
+		if (args.size() == 2 && ref == ExprCalls::call_max) {
+			return fold(EXPR_BYTECODE_MAX, args[0], args[1]);
+		}
+		if (args.size() == 3 && ref == ExprCalls::call_clamp) {
+			return fold(EXPR_BYTECODE_MIN, fold(EXPR_BYTECODE_MAX, args[0], args[1]), args[2]);
+		}
+		if (args.size() == 3 && ref == ExprCalls::call_if) {
+			return fold(EXPR_BYTECODE_SELECT, args[0], args[1], args[2]);
+		}
+		if (name) callNames[(const void*) ref] = name;
+		Node node = leaf(EXPR_BYTECODE_CALL);
+		node.ref = (const void*) ref;
+		node.args = args;
+		return add(node, !(flags & EXPR_CALL_PURE));
+	}
+	// Chamada de uma função em lote, com as mesmas regras de addCall. A pureza fica no nó e vai
+	// para o bytecode
+	int addBatchCall(TExprBatchFunction ref, int flags, const std::vector <int> &args,
+		const char* name = nullptr) {
+		if (name) callNames[(const void*) ref] = name;
+		Node node = leaf(EXPR_BYTECODE_BCALL);
+		node.index = flags & EXPR_CALL_PURE;
+		node.ref = (const void*) ref;
+		node.args = args;
+		return add(node, !(flags & EXPR_CALL_PURE));
+	}
+	const Node& node(int id) const {
+		return nodes[id];
+	}
+	int size() const {
+		return nodes.size();
+	}
+	// Conta os usos de cada nó considerando somente os nós dos quais as raízes dependem (o grafo
+	// pode ter nós que não são usados, como os criados pela diferenciação)
+	void countUses(const std::vector <int> &roots) {
+		std::vector <bool> used(nodes.size(), false);
+		for (Node &node : nodes) node.uses = 0;
+		for (int root : roots) {
+			used[root] = true;
+			++ nodes[root].uses;
+		}
+		for (int id=nodes.size()-1; id>=0; --id) {
+			if (!used[id]) continue;
+			for (int arg : nodes[id].args) {
+				used[arg] = true;
+				++ nodes[arg].uses;
 			}
 		}
+	}
+	// Todos os parâmetros ganham posição no bytecode, na ordem em que foram criados, mesmo os que
+	// a simplificação eliminou
+	void addParams(ExprBytecode &bytecode) {
+		for (auto &param : params) bytecode.paramSlot(param.first, param.second);
+	}
+	// Quantidade de valores que a instrução desempilha como operandos
+	static int arity(const ExprBytecode::Instr &instr) {
+		switch (instr.op) {
+			case EXPR_BYTECODE_ABS:
+			case EXPR_BYTECODE_NEG:
+			case EXPR_BYTECODE_POWI:
+			case EXPR_BYTECODE_SQRT:
+			case EXPR_BYTECODE_ADDC:
+			case EXPR_BYTECODE_SUBC:
+			case EXPR_BYTECODE_MULC:
+			case EXPR_BYTECODE_DIVC:
+			case EXPR_BYTECODE_ADDA:
+			case EXPR_BYTECODE_SUBA:
+			case EXPR_BYTECODE_MULA:
+			case EXPR_BYTECODE_DIVA:
+				return 1;
+			case EXPR_BYTECODE_ADD:
+			case EXPR_BYTECODE_SUB:
+			case EXPR_BYTECODE_MUL:
+			case EXPR_BYTECODE_DIV:
+			case EXPR_BYTECODE_POW:
+			case EXPR_BYTECODE_LT:
+			case EXPR_BYTECODE_LE:
+			case EXPR_BYTECODE_GT:
+			case EXPR_BYTECODE_GE:
+			case EXPR_BYTECODE_EQ:
+			case EXPR_BYTECODE_NE:
+			case EXPR_BYTECODE_MIN:
+			case EXPR_BYTECODE_MAX:
+				return 2;
+			case EXPR_BYTECODE_MULADD:
+			case EXPR_BYTECODE_SELECT:
+				return 3;
+			case EXPR_BYTECODE_CALL:
+			case EXPR_BYTECODE_BCALL:
+				return instr.index;
+		}
 		return 0;
 	}
+	// Operação primitiva op sobre o nó a e, se não forem -1, os nós b e c; sobre constantes,
+	// devolve o nó do resultado. SELECT com condição constante devolve o ramo escolhido
+	int fold(unsigned char op, int a, int b = -1, int c = -1) {
+		bool constArgs = nodes[a].op == EXPR_BYTECODE_CONST;
+		if (op == EXPR_BYTECODE_SELECT && constArgs) return nodes[a].value != 0 ? b : c;
+		if (b >= 0 && nodes[b].op != EXPR_BYTECODE_CONST) constArgs = false;
+		if (c >= 0 && nodes[c].op != EXPR_BYTECODE_CONST) constArgs = false;
+		if (!constArgs) {
+			return c >= 0 ? addOpr(op, a, b, c) : b >= 0 ? addOpr(op, a, b) : addOpr(op, a);
+		}
+		double x = nodes[a].value, y = b < 0 ? 0 : nodes[b].value;
+		switch (op) {
+			case EXPR_BYTECODE_ABS: x = x >= 0 ? x : - x; break;
+			case EXPR_BYTECODE_NEG: x = - x; break;
+			case EXPR_BYTECODE_ADD: x += y; break;
+			case EXPR_BYTECODE_SUB: x -= y; break;
+			case EXPR_BYTECODE_MUL: x *= y; break;
+			case EXPR_BYTECODE_DIV: x /= y; break;
+			case EXPR_BYTECODE_POW: x = ::pow(x, y); break;
+			case EXPR_BYTECODE_LT: x = x < y; break;
+			case EXPR_BYTECODE_LE: x = x <= y; break;
+			case EXPR_BYTECODE_GT: x = x > y; break;
+			case EXPR_BYTECODE_GE: x = x >= y; break;
+			case EXPR_BYTECODE_EQ: x = x == y; break;
+			case EXPR_BYTECODE_NE: x = x != y; break;
+			case EXPR_BYTECODE_MIN: x = x < y ? x : y; break;
+			case EXPR_BYTECODE_MAX: x = x > y ? x : y; break;
+		}
+		return addConst(x);
+	}
+	// Reconstrói o grafo de um bytecode com os parâmetros trocados pelos valores atuais, calculando
+	// as operações, as funções padrão e as funções em lote puras sobre constantes. Devolve o nó do
+	// resultado (-1 se não houver) e, em outs, o de cada saída
+	int addBytecode(const ExprBytecode &bytecode, std::vector <int> &outs) {
+		std::vector <int> stack;
+		std::vector <int> temps(bytecode.tempCount());
+		outs.assign(bytecode.outCount(), -1);
+		const unsigned char* pc = bytecode.code();
+		ExprBytecode::Instr instr;
+		// Valores dos argumentos constantes, com espaço para a maior chamada do bytecode
+		std::vector <double> v(1);
+		for (;;) {
+			pc = ExprBytecode::decode(pc, instr);
+			int n = arity(instr);
+			std::vector <int> args(stack.end() - n, stack.end());
+			stack.resize(stack.size() - n);
+			bool constArgs = true;
+			if (n > (int) v.size()) v.resize(n);
+			for (int i=0; i<n; ++i) {
+				constArgs = constArgs && nodes[args[i]].op == EXPR_BYTECODE_CONST;
+				v[i] = nodes[args[i]].value;
+			}
+			switch (instr.op) {
+				case EXPR_BYTECODE_END:
+				return stack.empty() ? -1 : stack.back();
+				case EXPR_BYTECODE_CONST: stack.push_back(addConst(instr.value)); break;
+				case EXPR_BYTECODE_ARG: stack.push_back(addArg(instr.index)); break;
+				case EXPR_BYTECODE_REF: {
+					std::string name = bytecode.refName(instr.ref);
+					stack.push_back(addRef((const double*) instr.ref, name.empty() ? nullptr :
+						name.c_str()));
+				break;
+				}
+				case EXPR_BYTECODE_PARAM:
+					stack.push_back(addConst(bytecode.param(instr.index)));
+				break;
+				case EXPR_BYTECODE_STORE: temps[instr.index] = stack.back(); break;
+				case EXPR_BYTECODE_LOAD: stack.push_back(temps[instr.index]); break;
+				case EXPR_BYTECODE_OUT:
+					outs[instr.index] = stack.back();
+					stack.pop_back();
+				break;
+				case EXPR_BYTECODE_CALL: {
+					TExprFunction ref = (TExprFunction) instr.ref;
+					// Só as funções padrão são sabidamente puras
+					bool pure = ExprCalls::name(ref) != nullptr;
+					if (pure && constArgs) {
+						stack.push_back(addConst(ref(v.data())));
+					} else {
+						stack.push_back(addCall(ref, pure ? EXPR_CALL_PURE : 0, args,
+							bytecode.callName(instr.ref).c_str()));
+					}
+				break;
+				}
+				case EXPR_BYTECODE_BCALL: {
+					TExprBatchFunction ref = (TExprBatchFunction) instr.ref;
+					if ((instr.flags & EXPR_CALL_PURE) && constArgs) {
+						stack.push_back(addConst(ExprCalls::callBatch(ref, v.data(), n)));
+					} else {
+						stack.push_back(addBatchCall(ref, instr.flags, args,
+							bytecode.callName(instr.ref).c_str()));
+					}
+				break;
+				}
+				// As instruções combinadas voltam a ser operações primitivas, recombinadas no emit
+				case EXPR_BYTECODE_MULADD: {
+					int product = fold(EXPR_BYTECODE_MUL, args[0], args[1]);
+					stack.push_back(fold(EXPR_BYTECODE_ADD, product, args[2]));
+				break;
+				}
+				case EXPR_BYTECODE_POWI:
+					// O bytecode foi compilado com EXPR_OPT_FAST_MATH se o expoente não for exato
+					if (instr.index != 2 && instr.index != -1) flags |= EXPR_OPT_FAST_MATH;
+					stack.push_back(fold(EXPR_BYTECODE_POW, args[0], addConst(instr.index)));
+				break;
+				case EXPR_BYTECODE_SQRT:
+					stack.push_back(fold(EXPR_BYTECODE_POW, args[0], addConst(0.5)));
+				break;
+				case EXPR_BYTECODE_ADDC:
+				case EXPR_BYTECODE_SUBC:
+				case EXPR_BYTECODE_MULC:
+				case EXPR_BYTECODE_DIVC:
+					stack.push_back(fold(instr.op - EXPR_BYTECODE_ADDC + EXPR_BYTECODE_ADD, args[0],
+						addConst(instr.value)));
+				break;
+				case EXPR_BYTECODE_ADDA:
+				case EXPR_BYTECODE_SUBA:
+				case EXPR_BYTECODE_MULA:
+				case EXPR_BYTECODE_DIVA:
+					stack.push_back(fold(instr.op - EXPR_BYTECODE_ADDA + EXPR_BYTECODE_ADD, args[0],
+						addArg(instr.index)));
+				break;
+				case EXPR_BYTECODE_SELECT:
+					stack.push_back(fold(instr.op, args[0], args[1], args[2]));
+				break;
+				default:
+					stack.push_back(n == 1 ? fold(instr.op, args[0]) : fold(instr.op, args[0],
+						args[1]));
+				break;
+			}
+		}
+	}
+	// Gera o bytecode que calcula o nó root, deixando o resultado no topo da pilha
+	void toBytecode(ExprBytecode &bytecode, int root) {
+		addParams(bytecode);
+		std::vector <int> temps(nodes.size(), -1);
+		countUses(std::vector <int> (1, root));
+		emit(bytecode, root, temps);
+	}
+	// Gera o bytecode que calcula cada raiz e a envia para a saída de mesmo índice; o que for
+	// comum entre as raízes é calculado uma única vez
+	void toBytecode(ExprBytecode &bytecode, const std::vector <int> &roots) {
+		addParams(bytecode);
+		std::vector <int> temps(nodes.size(), -1);
+		countUses(roots);
+		for (size_t i=0; i<roots.size(); ++i) {
+			emit(bytecode, roots[i], temps);
+			bytecode.addOut(i);
+		}
+	}
+};
+
+// ---------------------------------------------------------------------------------------------- //
+// Diferenciação automática sobre o grafo de operações. As derivadas são construídas como novos   //
+// nós do próprio ExprDag, de forma que o que elas têm em comum com a expressão (e entre si) é    //
+// calculado uma única vez no programa compilado                                                  //
+// ---------------------------------------------------------------------------------------------- //
+#define EXPR_DIFF_REVERSE 0 // Modo reverso: propaga as adjuntas a partir da raiz
+#define EXPR_DIFF_FORWARD 1 // Modo direto: uma derivada direcional por argumento
+
+// Derivadas parciais das funções do usuário; as funções padrão são derivadas simbolicamente
+class ExprDerivs {
+private:
+	struct Deriv {
+		TExprFunction ref;
+		int flags;
+	};
+	std::map <std::pair <const void*, int>, Deriv> map;
+public:
+	// deriv recebe os mesmos argumentos de ref e devolve a derivada parcial em relação ao
+	// argumento index
+	ExprDerivs& setDeriv(TExprFunction ref, int index, TExprFunction deriv,
+		int flags = EXPR_CALL_PURE) {
+		Deriv value = {deriv, flags};
+		map[std::make_pair((const void*) ref, index)] = value;
+		return *this;
+	}
+	// Derivada de uma função em lote, calculada linha a linha
+	ExprDerivs& setDeriv(TExprBatchFunction ref, int index, TExprFunction deriv,
+		int flags = EXPR_CALL_PURE) {
+		Deriv value = {deriv, flags};
+		map[std::make_pair((const void*) ref, index)] = value;
+		return *this;
+	}
+	bool find(const void* ref, int index, TExprFunction &deriv, int &flags) const {
+		auto it = map.find(std::make_pair(ref, index));
+		if (it == map.end()) return false;
+		deriv = it->second.ref;
+		flags = it->second.flags;
+		return true;
+	}
+};
+
+class ExprDiff {
+private:
+	ExprDag &dag;
+	const ExprDerivs &derivs;
+	bool ok;
+	static double call_sign(const double args[]) {
+		return args[0] > 0 ? 1 : args[0] < 0 ? -1 : 0;
+	}
+	// Nos auxiliares abaixo, -1 representa a derivada nula, que é propagada sem gerar nós
+	bool isConst(int id) {
+		return id >= 0 && dag.node(id).op == EXPR_BYTECODE_CONST;
+	}
+	bool isConst(int id, double value) {
+		return isConst(id) && dag.node(id).value == value;
+	}
+	int add(int a, int b) {
+		if (a < 0) return b;
+		if (b < 0) return a;
+		if (isConst(a) && isConst(b)) return dag.addConst(dag.node(a).value + dag.node(b).value);
+		return dag.addOpr(EXPR_BYTECODE_ADD, a, b);
+	}
+	int neg(int a) {
+		if (a < 0) return a;
+		if (isConst(a)) return dag.addConst(- dag.node(a).value);
+		return dag.addOpr(EXPR_BYTECODE_NEG, a);
+	}
+	int sub(int a, int b) {
+		if (b < 0) return a;
+		if (a < 0) return neg(b);
+		if (isConst(a) && isConst(b)) return dag.addConst(dag.node(a).value - dag.node(b).value);
+		return dag.addOpr(EXPR_BYTECODE_SUB, a, b);
+	}
+	int mul(int a, int b) {
+		if (a < 0 || b < 0 || isConst(a, 0) || isConst(b, 0)) return -1;
+		if (isConst(a, 1)) return b;
+		if (isConst(b, 1)) return a;
+		if (isConst(a, -1)) return neg(b);
+		if (isConst(b, -1)) return neg(a);
+		if (isConst(a) && isConst(b)) return dag.addConst(dag.node(a).value * dag.node(b).value);
+		return dag.addOpr(EXPR_BYTECODE_MUL, a, b);
+	}
+	int div(int a, int b) {
+		if (a < 0) return a;
+		if (isConst(b, 1)) return a;
+		if (isConst(a) && isConst(b)) return dag.addConst(dag.node(a).value / dag.node(b).value);
+		return dag.addOpr(EXPR_BYTECODE_DIV, a, b);
+	}
+	int pow(int a, int b) {
+		if (isConst(b, 0)) return dag.addConst(1);
+		if (isConst(b, 1)) return a;
+		return dag.addOpr(EXPR_BYTECODE_POW, a, b);
+	}
+	int call(TExprFunction ref, int a) {
+		if (isConst(a)) {
+			double value = dag.node(a).value;
+			return dag.addConst(ref(&value));
+		}
+		return dag.addCall(ref, EXPR_CALL_PURE, std::vector <int> (1, a));
+	}
+	// Derivadas de uma função do usuário, registradas em derivs
+	void userPartials(const ExprDag::Node &node, std::vector <int> &res) {
+		for (size_t i=0; i<node.args.size(); ++i) {
+			TExprFunction deriv;
+			int flags;
+			if (derivs.find(node.ref, i, deriv, flags)) {
+				res[i] = dag.addCall(deriv, flags, node.args);
+			} else {
+				ok = false;
+			}
+		}
+	}
+	// Derivadas do nó id em relação a cada um de seus operandos
+	void partials(int id, std::vector <int> &res) {
+		ExprDag::Node node = dag.node(id); // Cópia: novos nós podem realocar o grafo
+		res.assign(node.args.size(), -1);
+		int a = node.args.size() > 0 ? node.args[0] : -1;
+		int b = node.args.size() > 1 ? node.args[1] : -1;
+		int one = dag.addConst(1);
+		switch (node.op) {
+			case EXPR_BYTECODE_NEG:
+				res[0] = dag.addConst(-1);
+			break;
+			case EXPR_BYTECODE_ABS: // Subgradiente nulo em 0
+				res[0] = call(call_sign, a);
+			break;
+			case EXPR_BYTECODE_ADD:
+				res[0] = one;
+				res[1] = one;
+			break;
+			case EXPR_BYTECODE_SUB:
+				res[0] = one;
+				res[1] = dag.addConst(-1);
+			break;
+			case EXPR_BYTECODE_MUL:
+				res[0] = b;
+				res[1] = a;
+			break;
+			case EXPR_BYTECODE_DIV: // (a/b)' = 1/b da - (a/b)/b db
+				res[0] = div(one, b);
+				res[1] = neg(div(id, b));
+			break;
+			case EXPR_BYTECODE_POW: // (a^b)' = b a^(b-1) da + a^b ln(a) db
+				res[0] = mul(b, pow(a, sub(b, one)));
+				if (!isConst(b)) res[1] = mul(id, call(ExprCalls::call_ln, a));
+			break;
+			// As comparações são constantes por partes: derivada nula. min, max e a seleção
+			// derivam pelo operando escolhido
+			case EXPR_BYTECODE_MIN:
+			case EXPR_BYTECODE_MAX:
+				res[0] = dag.fold(node.op == EXPR_BYTECODE_MIN ? EXPR_BYTECODE_LT : EXPR_BYTECODE_GT,
+					a, b);
+				res[1] = sub(one, res[0]);
+			break;
+			case EXPR_BYTECODE_SELECT:
+				res[1] = dag.fold(EXPR_BYTECODE_NE, a, dag.addConst(0));
+				res[2] = sub(one, res[1]);
+			break;
+			case EXPR_BYTECODE_CALL: {
+				if (node.ref == (const void*) ExprCalls::call_ln) {
+					res[0] = div(one, a);
+				} else if (node.ref == (const void*) ExprCalls::call_log) {
+					res[0] = div(dag.addConst(1 / log(10.0)), a);
+				} else if (node.ref == (const void*) ExprCalls::call_exp) {
+					res[0] = id;
+				} else if (node.ref == (const void*) ExprCalls::call_sin) {
+					res[0] = call(ExprCalls::call_cos, a);
+				} else if (node.ref == (const void*) ExprCalls::call_cos) {
+					res[0] = neg(call(ExprCalls::call_sin, a));
+				} else if (node.ref == (const void*) ExprCalls::call_tan) {
+					res[0] = add(one, mul(id, id));
+				} else if (node.ref == (const void*) ExprCalls::call_asin ||
+					node.ref == (const void*) ExprCalls::call_acos) {
+					int d = pow(sub(one, mul(a, a)), dag.addConst(-0.5));
+					res[0] = node.ref == (const void*) ExprCalls::call_asin ? d : neg(d);
+				} else if (node.ref == (const void*) ExprCalls::call_atan) {
+					res[0] = div(one, add(one, mul(a, a)));
+				} else {
+					userPartials(node, res);
+				}
+			break;
+			}
+			case EXPR_BYTECODE_BCALL:
+				userPartials(node, res);
+			break;
+		}
+	}
+	// Nós dos quais root depende
+	std::vector <bool> reach(int root) {
+		std::vector <bool> res(root + 1, false);
+		res[root] = true;
+		for (int id=root; id>=0; --id) {
+			if (!res[id]) continue;
+			for (int arg : dag.node(id).args) res[arg] = true;
+		}
+		return res;
+	}
+	std::vector <int> finish(std::vector <int> &grad) {
+		for (int &id : grad) {
+			if (id < 0) id = dag.addConst(0);
+		}
+		return grad;
+	}
 public:
-	ExprBytecode() {
-		blobPtr = blob;
-		nArgs = 0;
+	ExprDiff(ExprDag &dag, const ExprDerivs &derivs): dag(dag), derivs(derivs) {
+		ok = true;
 	}
-	void addByte(unsigned char byte) {
-		*blobPtr++ = byte;
+	// Falso se alguma função não tem derivada registrada
+	bool valid() const {
+		return ok;
 	}
-	void addVal(double value) {
-		*(double*)(blobPtr) = value;
-		blobPtr += sizeof(double);
+	// Os nós do grafo são criados depois dos seus operandos, então a ordem dos índices já é uma
+	// ordenação topológica. Devolve um nó por argumento, de 0 até nArgs - 1
+	std::vector <int> reverse(int root, int nArgs) {
+		std::vector <bool> used = reach(root);
+		std::vector <int> adj(root + 1, -1);
+		std::vector <int> grad(nArgs, -1);
+		std::vector <int> local;
+		adj[root] = dag.addConst(1);
+		for (int id=root; id>=0; --id) {
+			if (!used[id] || adj[id] < 0) continue;
+			if (dag.node(id).op == EXPR_BYTECODE_ARG) {
+				int index = dag.node(id).index;
+				if (index < nArgs) grad[index] = adj[id];
+				continue;
+			}
+			partials(id, local);
+			std::vector <int> args = dag.node(id).args;
+			for (size_t k=0; k<args.size(); ++k) {
+				adj[args[k]] = add(adj[args[k]], mul(adj[id], local[k]));
+			}
+		}
+		return finish(grad);
 	}
-	void addRef(void* ref) {
-		*(void**)(blobPtr) = ref;
-		blobPtr += sizeof(void*);
+	std::vector <int> forward(int root, int nArgs) {
+		std::vector <bool> used = reach(root);
+		std::vector <int> grad(nArgs, -1);
+		std::vector <int> local;
+		// As derivadas locais não dependem da direção: são calculadas uma única vez
+		std::vector <std::vector <int> > partial(root + 1);
+		for (int id=0; id<=root; ++id) {
+			if (used[id]) partials(id, partial[id]);
+		}
+		for (int i=0; i<nArgs; ++i) {
+			std::vector <int> tangent(root + 1, -1);
+			for (int id=0; id<=root; ++id) {
+				if (!used[id]) continue;
+				const ExprDag::Node &node = dag.node(id);
+				if (node.op == EXPR_BYTECODE_ARG) {
+					if (node.index == i) tangent[id] = dag.addConst(1);
+					continue;
+				}
+				std::vector <int> args = node.args;
+				int res = -1;
+				for (size_t k=0; k<args.size(); ++k) {
+					res = add(res, mul(tangent[args[k]], partial[id][k]));
+				}
+				tangent[id] = res;
+			}
+			grad[i] = tangent[root];
+		}
+		return finish(grad);
 	}
-	void updateNArgs(int nArgs) {
-		if (nArgs > this->nArgs) this->nArgs = nArgs;
+};
+
+// ---------------------------------------------------------------------------------------------- //
+// Alocador em blocos para os nós da árvore. Os objetos não são destruídos individualmente: toda  //
+// a memória é devolvida de uma vez por clear() ou pelo destrutor, por isso só pode guardar       //
+// objetos sem recursos próprios (sem std::string, std::vector etc.)                              //
+// ---------------------------------------------------------------------------------------------- //
+class ExprArena {
+private:
+	struct Block {
+		Block* next;
+		size_t size;
+	};
+	static const size_t ALIGN = 16;
+	static const size_t BLOCK_SIZE = 4096;
+	Block* head;
+	char* ptr;
+	char* limit;
+	static size_t header() {
+		return (sizeof(Block) + ALIGN - 1) & ~(ALIGN - 1);
 	}
-	double calc() {
-		blobPtr = blob;
-		return run();
+	void grow(size_t size) {
+		size_t blockSize = head ? head->size * 2 : BLOCK_SIZE;
+		while (blockSize < size + header()) blockSize *= 2;
+		Block* block = (Block*) ::operator new(blockSize);
+		block->next = head;
+		block->size = blockSize;
+		head = block;
+		ptr = (char*) block + header();
+		limit = (char*) block + blockSize;
+	}
+public:
+	ExprArena() {
+		head = nullptr;
+		ptr = nullptr;
+		limit = nullptr;
 	}
-	double calc(const double* vArgs) {
-		this->vArgs = vArgs;
-		return calc();
+	ExprArena(const ExprArena&) = delete;
+	ExprArena& operator=(const ExprArena&) = delete;
+	void* alloc(size_t size) {
+		size = (size + ALIGN - 1) & ~(ALIGN - 1);
+		if ((size_t) (limit - ptr) < size) grow(size);
+		void* res = ptr;
+		ptr += size;
+		return res;
+	}
+	template <class T, class... Args> T* make(Args&&... args) {
+		return new (alloc(sizeof(T))) T(std::forward<Args>(args)...);
+	}
+	// Cópia terminada em '\0' de uma string
+	const char* copy(const std::string &str) {
+		char* res = (char*) alloc(str.size() + 1);
+		memcpy(res, str.c_str(), str.size() + 1);
+		return res;
+	}
+	// Descarta todos os objetos, mantendo o maior bloco para as próximas alocações
+	void clear() {
+		if (!head) return;
+		Block* block = head->next;
+		while (block) {
+			Block* next = block->next;
+			::operator delete(block);
+			block = next;
+		}
+		head->next = nullptr;
+		ptr = (char*) head + header();
+	}
+	~ExprArena() {
+		clear();
+		if (head) ::operator delete(head);
 	}
 };
 
@@ -111,21 +3724,64 @@ public:
 // Estruturas da árvore de operações, usada como estrutura auxiliar para o parsing de uma         //
 // expressão                                                                                      //
 // ---------------------------------------------------------------------------------------------- //
+// Identificador de uma expressão, compartilhado por todas as suas ocorrências: as definições
+// (setArg, setVar e setCall) são feitas uma única vez aqui e lidas pelos nós
+struct ExprSymbol {
+	const char* id;
+	bool isVar; // Ocorre como variável
+	bool isCall; // Ocorre como chamada
+	char type; // Variável: '\0' livre, 'a' argumento, 'v' valor, 'r' referência ou 'p' parâmetro
+	int index;
+	double value;
+	const double* ref;
+	TExprFunction call; // Função chamada, ou nullptr se não definida
+	TExprBatchFunction batch; // Definida por setCall com uma função em lote, no lugar de call
+	int flags;
+	int minArgs, maxArgs; // Menor e maior quantidade de argumentos entre as chamadas
+	ExprSymbol(const char* id) {
+		this->id = id;
+		isVar = false;
+		isCall = false;
+		type = '\0';
+		index = -1;
+		value = 0;
+		ref = nullptr;
+		call = nullptr;
+		batch = nullptr;
+		flags = 0;
+		minArgs = 0;
+		maxArgs = 0;
+	}
+	// Verdadeiro se há uma função definida e ela aceita n argumentos (EXPR_CALL_ARITY)
+	bool accepts(int n) const {
+		int arity = (flags >> 8) - 1;
+		return (call || batch) && (arity < 0 || arity == n);
+	}
+};
 class ExprNode {
 public:
-	virtual void setArg(std::string id, int index) {} // Define uma variável como argumento
-	virtual void setVar(std::string id, double value) {} // Define um valor para uma variável
-	virtual void setVar(std::string id, double* ref) {} // Define uma referência para uma
-	virtual void setCall(std::string id, TExprFunction ref) {}
-	virtual void addVarsToMap(std::map <std::string, bool> &map) {}
-	virtual void addCallsToMap(std::map <std::string, bool> &map) {}
-	virtual int countArgs() {return 0;}
-	virtual void addToBytecode(ExprBytecode &bytecode) = 0;
-	// variável
+	virtual bool isConst() {return false;}
+	// Simplifica a sub-árvore e devolve o nó que passa a ocupar o lugar deste; os nós novos são
+	// alocados em arena
+	virtual ExprNode* fold(ExprArena &arena, int flags) {return this;}
+	virtual ExprNode* copy(ExprArena &arena) = 0; // Cópia da sub-árvore, alocada em arena
+	virtual int addToDag(ExprDag &dag) = 0; // Adiciona a sub-árvore ao grafo e devolve seu nó
 	virtual double calc() = 0; // (temporário) Calcula a sub-árvore que tem este nó como raiz
 	virtual std::string toString() = 0; // (temporário) Formato textual da sub-árvore que tem
 	// este nó como raiz
 	virtual ~ExprNode() {};
+	static ExprNode* fold(ExprNode* tree, ExprArena &arena, int flags) {
+		if (!tree) return nullptr;
+		return tree->fold(arena, flags);
+	}
+	static ExprNode* copy(ExprNode* tree, ExprArena &arena) {
+		if (!tree) return nullptr;
+		return tree->copy(arena);
+	}
+	// Verdadeiro se a sub-árvore é a constante value
+	static bool isConst(ExprNode* tree, double value) {
+		return tree && tree->isConst() && tree->calc() == value;
+	}
 };
 class ExprNodeConst: public ExprNode {
 private:
@@ -134,9 +3790,14 @@ public:
 	ExprNodeConst(double value) {
 		this->value = value;
 	}
-	void addToBytecode(ExprBytecode &bytecode) {
-		bytecode.addByte(EXPR_BYTECODE_CONST);
-		bytecode.addVal(value);
+	bool isConst() {
+		return true;
+	}
+	ExprNode* copy(ExprArena &arena) {
+		return arena.make<ExprNodeConst>(value);
+	}
+	int addToDag(ExprDag &dag) {
+		return dag.addConst(value);
 	}
 	double calc() {
 		return value;
@@ -159,31 +3820,25 @@ public:
 	ExprNodeNeg(ExprNode* tree) {
 		this->tree = tree;
 	}
-	void setArg(std::string id, int index) {
-		if (tree) tree->setArg(id, index);
-	}
-	void setVar(std::string id, double value) {
-		if (tree) tree->setVar(id, value);
-	}
-	void setVar(std::string id, double* ref) {
-		if (tree) tree->setVar(id, ref);
+	// Devolve a sub-árvore, que deixa de pertencer a este nó
+	ExprNode* release() {
+		ExprNode* res = tree;
+		tree = nullptr;
+		return res;
 	}
-	void setCall(std::string id, TExprFunction ref) {
-		if (tree) tree->setCall(id, ref);
+	ExprNode* fold(ExprArena &arena, int flags) {
+		tree = ExprNode::fold(tree, arena, flags);
+		if (!tree) return this;
+		if (tree->isConst()) return arena.make<ExprNodeConst>(calc());
+		ExprNodeNeg* neg = dynamic_cast<ExprNodeNeg*>(tree);
+		if (neg) return neg->release(); // -(-x) = x
+		return this;
 	}
-	void addVarsToMap(std::map <std::string, bool> &map) {
-		if (tree) tree->addVarsToMap(map);
+	ExprNode* copy(ExprArena &arena) {
+		return arena.make<ExprNodeNeg>(ExprNode::copy(tree, arena));
 	}
-	void addCallsToMap(std::map <std::string, bool> &map) {
-		if (tree) tree->addCallsToMap(map);
-	}
-	int countArgs() {
-		if (tree) return tree->countArgs();
-		return 0;
-	}
-	void addToBytecode(ExprBytecode &bytecode) {
-		bytecode.addByte(EXPR_BYTECODE_NEG);
-		tree->addToBytecode(bytecode);
+	int addToDag(ExprDag &dag) {
+		return dag.addOpr(EXPR_BYTECODE_NEG, tree->addToDag(dag));
 	}
 	double calc() {
 		if (tree) return - tree->calc();
@@ -193,9 +3848,6 @@ public:
 		if (tree) return "(-" + tree->toString() + ")";
 		return "(-#)";
 	}
-	~ExprNodeNeg() {
-		if (tree) delete tree;
-	}
 };
 class ExprNodeAbs: public ExprNode {
 private:
@@ -204,31 +3856,25 @@ public:
 	ExprNodeAbs(ExprNode* tree) {
 		this->tree = tree;
 	}
-	void setArg(std::string id, int index) {
-		if (tree) tree->setArg(id, index);
-	}
-	void setVar(std::string id, double value) {
-		if (tree) tree->setVar(id, value);
-	}
-	void setVar(std::string id, double* ref) {
-		if (tree) tree->setVar(id, ref);
-	}
-	void setCall(std::string id, TExprFunction ref) {
-		if (tree) tree->setCall(id, ref);
-	}
-	void addVarsToMap(std::map <std::string, bool> &map) {
-		if (tree) tree->addVarsToMap(map);
+	ExprNode* release() {
+		ExprNode* res = tree;
+		tree = nullptr;
+		return res;
 	}
-	void addCallsToMap(std::map <std::string, bool> &map) {
-		if (tree) tree->addCallsToMap(map);
+	ExprNode* fold(ExprArena &arena, int flags) {
+		tree = ExprNode::fold(tree, arena, flags);
+		if (!tree) return this;
+		if (tree->isConst()) return arena.make<ExprNodeConst>(calc());
+		ExprNodeNeg* neg = dynamic_cast<ExprNodeNeg*>(tree);
+		if (neg) tree = neg->release(); // |-x| = |x|
+		if (dynamic_cast<ExprNodeAbs*>(tree)) return release(); // ||x|| = |x|
+		return this;
 	}
-	int countArgs() {
-		if (tree) return tree->countArgs();
-		return 0;
+	ExprNode* copy(ExprArena &arena) {
+		return arena.make<ExprNodeAbs>(ExprNode::copy(tree, arena));
 	}
-	void addToBytecode(ExprBytecode &bytecode) {
-		bytecode.addByte(EXPR_BYTECODE_ABS);
-		tree->addToBytecode(bytecode);
+	int addToDag(ExprDag &dag) {
+		return dag.addOpr(EXPR_BYTECODE_ABS, tree->addToDag(dag));
 	}
 	double calc() {
 		double value = tree ? tree->calc() : 0;
@@ -238,73 +3884,38 @@ public:
 		if (tree) return "|" + tree->toString() + "|";
 		return "|#|";
 	}
-	~ExprNodeAbs() {
-		if (tree) delete tree;
-	}
 };
 class ExprNodeVar: public ExprNode {
 private:
-	std::string id;
-	int index;
-	double value;
-	const double* ref;
-	char type;
+	const ExprSymbol* symbol;
 public:
-	ExprNodeVar(std::string id) {
-		this->id = id;
-		index = -1;
-		value = 0;
-		ref = nullptr;
-		type = '\0';
-	}
-	void setArg(std::string id, int index) {
-		if (this->id == id) {
-			this->index = index;
-			type = 'a';
-		}
-	}
-	void setVar(std::string id, double value) {
-		if (this->id == id) {
-			this->value = value;
-			type = 'v';
-		}
-	}
-	void setVar(std::string id, double* ref) {
-		if (this->id == id) {
-			this->ref = ref;
-			type = 'r';
-		}
+	ExprNodeVar(ExprSymbol* symbol) {
+		this->symbol = symbol;
+		symbol->isVar = true;
 	}
-	void addVarsToMap(std::map <std::string, bool> &map) {
-		map[id] = type != '\0';
+	ExprNode* fold(ExprArena &arena, int flags) {
+		if (symbol->type == 'v') return arena.make<ExprNodeConst>(symbol->value);
+		return this;
 	}
-	int countArgs() {
-		return type == 'a' ? index + 1 : 0;
+	ExprNode* copy(ExprArena &arena) {
+		return arena.make<ExprNodeVar>((ExprSymbol*) symbol);
 	}
-	void addToBytecode(ExprBytecode &bytecode) {
-		switch (type) {
-			case 'v':
-				bytecode.addByte(EXPR_BYTECODE_CONST);
-				bytecode.addVal(value);
-			break;
-			case 'r':
-				bytecode.addByte(EXPR_BYTECODE_REF);
-				bytecode.addRef((void*)ref);
-			break;
-			case 'a':
-				bytecode.addByte(EXPR_BYTECODE_ARG);
-				bytecode.addByte(index);
-				bytecode.updateNArgs(index + 1);
-			break;
+	int addToDag(ExprDag &dag) {
+		switch (symbol->type) {
+			case 'v': return dag.addConst(symbol->value);
+			case 'r': return dag.addRef(symbol->ref, symbol->id);
+			case 'a': return dag.addArg(symbol->index);
+			case 'p': return dag.addParam(symbol->id, symbol->value);
 		}
+		return dag.addConst(0);
 	}
 	double calc() {
-		if (type == 'v') return value;
-		if (type == 'r') return *ref;
+		if (symbol->type == 'v' || symbol->type == 'p') return symbol->value;
+		if (symbol->type == 'r') return *symbol->ref;
 		return 0;
 	}
 	std::string toString() {
-		return id;
+		return symbol->id;
 	}
 };
 class ExprNodeOpr: public ExprNode {
@@ -312,61 +3923,97 @@ private:
 	char chr;
 	ExprNode* a;
 	ExprNode* b;
-public:
-	ExprNodeOpr(char chr, ExprNode* a, ExprNode* b) {
-		this->chr = chr;
-		this->a   = a;
-		this->b   = b;
-	}
-	void setArg(std::string id, int index) {
-		if (a) a->setArg(id, index);
-		if (b) b->setArg(id, index);
-	}
-	void setVar(std::string id, double value) {
-		if (a) a->setVar(id, value);
-		if (b) b->setVar(id, value);
-	}
-	void setVar(std::string id, double* ref) {
-		if (a) a->setVar(id, ref);
-		if (b) b->setVar(id, ref);
-	}
-	void setCall(std::string id, TExprFunction ref) {
-		if (a) a->setCall(id, ref);
-		if (b) b->setCall(id, ref);
-	}
-	void addVarsToMap(std::map <std::string, bool> &map) {
-		if (a) a->addVarsToMap(map);
-		if (b) b->addVarsToMap(map);
-	}
-	void addCallsToMap(std::map <std::string, bool> &map) {
-		if (a) a->addCallsToMap(map);
-		if (b) b->addCallsToMap(map);
-	}
-	int countArgs() {
-		int nA = a ? a->countArgs() : 0;
-		int nB = b ? b->countArgs() : 0;
-		return nA > nB ? nA : nB;
+public:
+	ExprNodeOpr(char chr, ExprNode* a, ExprNode* b) {
+		this->chr = chr;
+		this->a   = a;
+		this->b   = b;
 	}
-	void addToBytecode(ExprBytecode &bytecode) {
+	ExprNode* fold(ExprArena &arena, int flags) {
+		a = ExprNode::fold(a, arena, flags);
+		b = ExprNode::fold(b, arena, flags);
+		if (!a || !b) return this;
+		if (a->isConst() && b->isConst()) return arena.make<ExprNodeConst>(calc());
+		ExprNode* res = nullptr;
 		switch (chr) {
+			// x + 0, 0 + x e 0 - x trocam o sinal de um zero (-0 + 0 = +0, 0 - 0 = +0): só com
+			// EXPR_OPT_FAST_MATH. x - 0 = x é exato
 			case '+':
-				bytecode.addByte(EXPR_BYTECODE_ADD);
+				if (!(flags & EXPR_OPT_FAST_MATH)) break;
+				if (isConst(b, 0)) res = a; // x + 0 = x
+				else if (isConst(a, 0)) res = b; // 0 + x = x
 			break;
 			case '-':
-				bytecode.addByte(EXPR_BYTECODE_SUB);
+				if (isConst(b, 0)) res = a; // x - 0 = x
+				else if ((flags & EXPR_OPT_FAST_MATH) && isConst(a, 0)) { // 0 - x = -x
+					res = arena.make<ExprNodeNeg>(b);
+					b = nullptr;
+					return ExprNode::fold(res, arena, flags);
+				}
 			break;
 			case '*':
-				bytecode.addByte(EXPR_BYTECODE_MUL);
+				if (isConst(b, 1)) res = a; // x * 1 = x
+				else if (isConst(a, 1)) res = b; // 1 * x = x
+				else if (flags & EXPR_OPT_FAST_MATH) {
+					if (isConst(a, 0)) res = a; // 0 * x = 0
+					else if (isConst(b, 0)) res = b; // x * 0 = 0
+				}
 			break;
 			case '/':
-				bytecode.addByte(EXPR_BYTECODE_DIV);
+				if (isConst(b, 1)) res = a; // x / 1 = x
+				else if ((flags & EXPR_OPT_FAST_MATH) && isConst(a, 0)) res = a; // 0 / x = 0
 			break;
 			case '^':
-				bytecode.addByte(EXPR_BYTECODE_POW);
+				if (isConst(b, 1)) res = a; // x ^ 1 = x
+				else if (isConst(b, 0) || isConst(a, 1)) return arena.make<ExprNodeConst>(1); // x^0 = 1^x = 1
 			break;
 		}
-		a->addToBytecode(bytecode);
-		b->addToBytecode(bytecode);
+		if (!res && (flags & EXPR_OPT_FAST_MATH)) return reassociate(arena, flags);
+		if (!res) return this;
+		if (res == a) a = nullptr;
+		if (res == b) b = nullptr;
+		return res;
+	}
+	// (x op1 c1) op2 c2 = x op (c1 op' c2), para operadores do mesmo grupo (+- ou */)
+	ExprNode* reassociate(ExprArena &arena, int flags) {
+		if ((chr == '+' || chr == '*') && a->isConst()) {
+			ExprNode* tmp = a;
+			a = b;
+			b = tmp;
+		}
+		ExprNodeOpr* left = dynamic_cast<ExprNodeOpr*>(a);
+		if (!b->isConst() || !left || !left->b || !left->b->isConst()) return this;
+		bool add = chr == '+' || chr == '-';
+		bool leftAdd = left->chr == '+' || left->chr == '-';
+		if (chr == '^' || left->chr == '^' || add != leftAdd) return this;
+		double c1 = left->b->calc();
+		double c2 = b->calc();
+		double c;
+		char opr;
+		switch (left->chr) {
+			case '+': opr = '+'; c = chr == '+' ? c1 + c2 : c1 - c2; break;
+			case '-': opr = chr == '+' ? '+' : '-'; c = chr == '+' ? c2 - c1 : c1 + c2; break;
+			case '*': opr = '*'; c = chr == '*' ? c1 * c2 : c1 / c2; break;
+			default:  opr = chr == '*' ? '*' : '/'; c = chr == '*' ? c2 / c1 : c1 * c2; break;
+		}
+		left->b = arena.make<ExprNodeConst>(c);
+		left->chr = opr;
+		a = nullptr;
+		return ExprNode::fold(left, arena, flags);
+	}
+	ExprNode* copy(ExprArena &arena) {
+		return arena.make<ExprNodeOpr>(chr, ExprNode::copy(a, arena), ExprNode::copy(b, arena));
+	}
+	int addToDag(ExprDag &dag) {
+		int idA = a->addToDag(dag);
+		int idB = b->addToDag(dag);
+		switch (chr) {
+			case '+': return dag.addOpr(EXPR_BYTECODE_ADD, idA, idB);
+			case '-': return dag.addOpr(EXPR_BYTECODE_SUB, idA, idB);
+			case '*': return dag.addOpr(EXPR_BYTECODE_MUL, idA, idB);
+			case '/': return dag.addOpr(EXPR_BYTECODE_DIV, idA, idB);
+		}
+		return dag.addOpr(EXPR_BYTECODE_POW, idA, idB);
 	}
 	double calc() {
 		double val_a = a ? a->calc() : 0;
@@ -387,143 +4034,314 @@ public:
 		str += b ? b->toString() : "#";
 		return str + ")";
 	}
-	~ExprNodeOpr() {
-		if (a) delete a;
-		if (b) delete b;
+};
+// Comparação entre a e b, com o código da instrução (EXPR_BYTECODE_LT a EXPR_BYTECODE_NE); vale 1
+// ou 0
+class ExprNodeCmp: public ExprNode {
+private:
+	unsigned char op;
+	ExprNode* a;
+	ExprNode* b;
+public:
+	ExprNodeCmp(unsigned char op, ExprNode* a, ExprNode* b) {
+		this->op = op;
+		this->a  = a;
+		this->b  = b;
+	}
+	ExprNode* fold(ExprArena &arena, int flags) {
+		a = ExprNode::fold(a, arena, flags);
+		b = ExprNode::fold(b, arena, flags);
+		if (a && b && a->isConst() && b->isConst()) return arena.make<ExprNodeConst>(calc());
+		return this;
+	}
+	ExprNode* copy(ExprArena &arena) {
+		return arena.make<ExprNodeCmp>(op, ExprNode::copy(a, arena), ExprNode::copy(b, arena));
+	}
+	int addToDag(ExprDag &dag) {
+		int idA = a->addToDag(dag);
+		return dag.addOpr(op, idA, b->addToDag(dag));
+	}
+	double calc() {
+		double val_a = a ? a->calc() : 0;
+		double val_b = b ? b->calc() : 0;
+		switch (op) {
+			case EXPR_BYTECODE_LT: return val_a < val_b;
+			case EXPR_BYTECODE_LE: return val_a <= val_b;
+			case EXPR_BYTECODE_GT: return val_a > val_b;
+			case EXPR_BYTECODE_GE: return val_a >= val_b;
+			case EXPR_BYTECODE_EQ: return val_a == val_b;
+		}
+		return val_a != val_b;
+	}
+	std::string toString() {
+		static const char* const names[] = {"<", "<=", ">", ">=", "==", "!="};
+		std::string str = "(";
+		str += a ? a->toString() : "#";
+		str += names[op - EXPR_BYTECODE_LT];
+		str += b ? b->toString() : "#";
+		return str + ")";
 	}
 };
-class ExprArgNode {
+// c ? a : b. Os dois ramos são calculados, o que permite avaliar sem desvios; com a condição
+// constante, só o ramo escolhido fica
+class ExprNodeSelect: public ExprNode {
+private:
+	ExprNode* c;
+	ExprNode* a;
+	ExprNode* b;
 public:
-	ExprNode* tree;
-	ExprArgNode* next;
-	ExprArgNode(ExprNode* tree) {
-		this->tree = tree;
-		next = nullptr;
+	ExprNodeSelect(ExprNode* c, ExprNode* a, ExprNode* b) {
+		this->c = c;
+		this->a = a;
+		this->b = b;
+	}
+	ExprNode* fold(ExprArena &arena, int flags) {
+		c = ExprNode::fold(c, arena, flags);
+		a = ExprNode::fold(a, arena, flags);
+		b = ExprNode::fold(b, arena, flags);
+		if (!c || !c->isConst()) return this;
+		ExprNode* res = c->calc() != 0 ? a : b; // Condição constante: só o ramo escolhido fica
+		return res ? res : this;
+	}
+	ExprNode* copy(ExprArena &arena) {
+		return arena.make<ExprNodeSelect>(ExprNode::copy(c, arena), ExprNode::copy(a, arena),
+			ExprNode::copy(b, arena));
 	}
-	~ExprArgNode() {
-		if (next) delete next;
-		if (tree) delete tree;
+	int addToDag(ExprDag &dag) {
+		int idC = c->addToDag(dag);
+		int idA = a->addToDag(dag);
+		return dag.fold(EXPR_BYTECODE_SELECT, idC, idA, b->addToDag(dag));
+	}
+	double calc() {
+		double val_c = c ? c->calc() : 0;
+		double val_a = a ? a->calc() : 0;
+		double val_b = b ? b->calc() : 0;
+		return val_c != 0 ? val_a : val_b;
+	}
+	std::string toString() {
+		std::string str = "(";
+		str += c ? c->toString() : "#";
+		str += "?";
+		str += a ? a->toString() : "#";
+		str += ":";
+		str += b ? b->toString() : "#";
+		return str + ")";
 	}
 };
+// Os argumentos de uma chamada ficam em um vetor contíguo alocado na mesma ExprArena dos nós
 class ExprNodeCall: public ExprNode {
 private:
-	std::string id;
-	struct {
-		ExprArgNode* head;
-		ExprArgNode* tail;
-		int size;
-	} list;
-	TExprFunction ref;
-public:
-	ExprNodeCall(std::string id) {
-		this->id = id;
-		list.head = nullptr;
-		list.tail = nullptr;
-		list.size = 0;
-		ref = nullptr;
+	const ExprSymbol* symbol;
+	ExprNode** args;
+	int nArgs;
+public:
+	ExprNodeCall(ExprSymbol* symbol, ExprNode** args, int nArgs) {
+		this->symbol = symbol;
+		this->args = args;
+		this->nArgs = nArgs;
+		if (!symbol->isCall || nArgs < symbol->minArgs) symbol->minArgs = nArgs;
+		if (!symbol->isCall || nArgs > symbol->maxArgs) symbol->maxArgs = nArgs;
+		symbol->isCall = true;
 	}
-	void addArg(ExprNode* tree) {
-		ExprArgNode* node = new ExprArgNode(tree);
-		if (list.tail) {
-			list.tail->next = node;
-		} else {
-			list.head = node;
-		}
-		list.tail = node;
-		++ list.size;
-	}
-	void setArg(std::string id, int index) {
-		ExprArgNode* node = list.head;
-		while (node) {
-			if (node->tree) node->tree->setArg(id, index);
-			node = node->next;
-		}
-	}
-	void setVar(std::string id, double value) {
-		ExprArgNode* node = list.head;
-		while (node) {
-			if (node->tree) node->tree->setVar(id, value);
-			node = node->next;
-		}
-	}
-	void setVar(std::string id, double* ref) {
-		ExprArgNode* node = list.head;
-		while (node) {
-			if (node->tree) node->tree->setVar(id, ref);
-			node = node->next;
-		}
-	}
-	void setCall(std::string id, TExprFunction ref) {
-		if (this->id == id) {
-			this->ref = ref;
-		}
-		ExprArgNode* node = list.head;
-		while (node) {
-			if (node->tree) node->tree->setCall(id, ref);
-			node = node->next;
-		}
-	}
-	void addVarsToMap(std::map <std::string, bool> &map) {
-		ExprArgNode* node = list.head;
-		while (node) {
-			if (node->tree) node->tree->addVarsToMap(map);
-			node = node->next;
-		}			
-	}
-	void addCallsToMap(std::map <std::string, bool> &map) {
-		map[id] = this->ref != nullptr;
-		ExprArgNode* node = list.head;
-		while (node) {
-			if (node->tree) node->tree->addCallsToMap(map);
-			node = node->next;
-		}			
-	}
-	int countArgs() {
-		int res = 0;
-		ExprArgNode* node = list.head;
-		while (node) {
-			int x = node->tree ? node->tree->countArgs() : 0;
-			if (x > res) res = x;
-			node = node->next;
-		}		
-		return res;	
-	}
-	void addToBytecode(ExprBytecode &bytecode) {
-		bytecode.addByte(EXPR_BYTECODE_CALL);
-		bytecode.addRef((void*)ref);
-		bytecode.addByte(list.size);
-		ExprArgNode* node = list.head;
-		while (node) {
-			node->tree->addToBytecode(bytecode);
-			node = node->next;
+	ExprNode* fold(ExprArena &arena, int flags) {
+		bool constArgs = true;
+		for (int i=0; i<nArgs; ++i) {
+			args[i] = ExprNode::fold(args[i], arena, flags);
+			if (!args[i]->isConst()) constArgs = false;
+		}
+		// Funções puras com argumentos constantes são avaliadas uma única vez
+		if (symbol->accepts(nArgs) && (symbol->flags & EXPR_CALL_PURE) && constArgs) {
+			return arena.make<ExprNodeConst>(calc());
 		}
+		return this;
+	}
+	ExprNode* copy(ExprArena &arena) {
+		ExprNode** list = nullptr;
+		if (nArgs) list = (ExprNode**) arena.alloc(nArgs * sizeof(ExprNode*));
+		for (int i=0; i<nArgs; ++i) list[i] = ExprNode::copy(args[i], arena);
+		return arena.make<ExprNodeCall>((ExprSymbol*) symbol, list, nArgs);
+	}
+	int addToDag(ExprDag &dag) {
+		if (!symbol->accepts(nArgs)) return dag.addConst(0);
+		std::vector <int> ids(nArgs);
+		for (int i=0; i<nArgs; ++i) ids[i] = args[i]->addToDag(dag);
+		if (symbol->batch) return dag.addBatchCall(symbol->batch, symbol->flags, ids, symbol->id);
+		return dag.addCall(symbol->call, symbol->flags, ids, symbol->id);
 	}
 	double calc() {
-		if (!ref) return 0;
-		double v[list.size], *arg = v;
-		ExprArgNode* node = list.head;
-		while (node) {
-			double val = node->tree ? node->tree->calc() : 0;
-			*arg++ = val;
-			node = node->next;
+		if (!symbol->accepts(nArgs)) return 0;
+		// Como em ExprCalls::callBatch, só chamadas com muitos argumentos usam o heap
+		double local[EXPR_CALL_LOCAL];
+		std::vector <double> heap;
+		double* v = local;
+		if (nArgs > EXPR_CALL_LOCAL) {
+			heap.resize(nArgs);
+			v = heap.data();
 		}
-		return ref(v);
+		for (int i=0; i<nArgs; ++i) v[i] = args[i]->calc();
+		if (symbol->batch) return ExprCalls::callBatch(symbol->batch, v, nArgs);
+		return symbol->call(v);
 	}
 	std::string toString() {
-		std::string str = id + "(";
-		ExprArgNode* node = list.head;
-		while (node) {
-			if (node != list.head) str += ",";
-			str += node->tree ? node->tree->toString() : "#";
-			node = node->next;
+		std::string str = std::string(symbol->id) + "(";
+		for (int i=0; i<nArgs; ++i) {
+			if (i) str += ",";
+			str += args[i]->toString();
 		}
 		return str + ")";
 	}
-	~ExprNodeCall() {
-		if (list.head) delete list.head;
+};
+
+// ---------------------------------------------------------------------------------------------- //
+// Conjunto de threads para dividir um intervalo de linhas. Cada thread tem sua própria fila de   //
+// tarefas e, quando ela se esgota, rouba tarefas das outras. Uma tarefa maior que o grain é      //
+// dividida ao meio antes de ser executada: a metade de cima volta para a fila, onde pode ser     //
+// roubada, e assim os intervalos grandes chegam às threads ociosas                               //
+// ---------------------------------------------------------------------------------------------- //
+// Quantidade padrão de linhas por tarefa na avaliação paralela
+#define EXPR_PARALLEL_GRAIN 4096
+
+class ExprThreadPool {
+private:
+	struct Job {
+		const std::function <void(long, long)>* fn;
+		long grain;
+		long remaining; // Linhas ainda não calculadas, protegida por mutex
+		std::mutex mutex;
+		std::condition_variable done;
+	};
+	struct Task {
+		Job* job;
+		long begin;
+		long end;
+	};
+	struct Queue {
+		std::mutex mutex;
+		std::deque <Task> tasks;
+	};
+	std::vector <std::thread> threads;
+	// Uma fila por thread e, na última posição, a fila compartilhada pelas threads de fora do pool
+	std::vector <Queue> queues;
+	std::mutex sleepMutex;
+	std::condition_variable wake;
+	std::atomic <long> queued;
+	bool stop;
+	void push(int q, const Task &task) {
+		{
+			std::lock_guard <std::mutex> lock(queues[q].mutex);
+			queues[q].tasks.push_back(task);
+		}
+		++ queued;
+		// Passa pelo mutex para não perder o aviso a uma thread que está prestes a dormir
+		{
+			std::lock_guard <std::mutex> lock(sleepMutex);
+		}
+		wake.notify_one();
+	}
+	// A própria fila é consumida pelo fim (tarefas mais recentes e menores) e as das outras
+	// threads pelo início (tarefas mais antigas e maiores)
+	bool next(int q, Task &task) {
+		{
+			std::lock_guard <std::mutex> lock(queues[q].mutex);
+			if (!queues[q].tasks.empty()) {
+				task = queues[q].tasks.back();
+				queues[q].tasks.pop_back();
+				-- queued;
+				return true;
+			}
+		}
+		for (size_t i=1; i<queues.size(); ++i) {
+			Queue &queue = queues[(q + i) % queues.size()];
+			std::lock_guard <std::mutex> lock(queue.mutex);
+			if (!queue.tasks.empty()) {
+				task = queue.tasks.front();
+				queue.tasks.pop_front();
+				-- queued;
+				return true;
+			}
+		}
+		return false;
+	}
+	void run(int q, Task task) {
+		while (task.end - task.begin > task.job->grain) {
+			long mid = task.begin + (task.end - task.begin) / 2;
+			Task upper = {task.job, mid, task.end};
+			push(q, upper);
+			task.end = mid;
+		}
+		(*task.job->fn)(task.begin, task.end);
+		// Depois de liberar o mutex a tarefa não acessa mais o Job, que pode ser destruído
+		std::lock_guard <std::mutex> lock(task.job->mutex);
+		task.job->remaining -= task.end - task.begin;
+		if (task.job->remaining == 0) task.job->done.notify_all();
+	}
+	void worker(int q) {
+		for (;;) {
+			Task task;
+			if (next(q, task)) {
+				run(q, task);
+				continue;
+			}
+			std::unique_lock <std::mutex> lock(sleepMutex);
+			wake.wait(lock, [this] {return stop || queued > 0;});
+			if (stop) return;
+		}
+	}
+public:
+	// nThreads: quantidade de threads do pool; 0 usa uma por núcleo. A thread que chama
+	// parallelFor também executa tarefas enquanto espera
+	ExprThreadPool(int nThreads = 0): queues((nThreads > 0 ? nThreads :
+		std::max(1, (int) std::thread::hardware_concurrency())) + 1) {
+		queued = 0;
+		stop = false;
+		for (size_t i=0; i+1<queues.size(); ++i) {
+			threads.emplace_back(&ExprThreadPool::worker, this, (int) i);
+		}
+	}
+	ExprThreadPool(const ExprThreadPool&) = delete;
+	ExprThreadPool& operator=(const ExprThreadPool&) = delete;
+	int size() const {
+		return threads.size();
+	}
+	// Chama fn(begin, end) para pedaços disjuntos de até grain linhas que cobrem [0, n) e retorna
+	// quando todos terminarem. Pode ser chamada por várias threads ao mesmo tempo
+	void parallelFor(long n, long grain, const std::function <void(long, long)> &fn) {
+		if (n <= 0) return;
+		if (grain < 1) grain = 1;
+		if (n <= grain) {
+			fn(0, n);
+			return;
+		}
+		Job job;
+		job.fn = &fn;
+		job.grain = grain;
+		job.remaining = n;
+		int q = queues.size() - 1;
+		Task task = {&job, 0, n};
+		push(q, task);
+		for (;;) {
+			{
+				std::lock_guard <std::mutex> lock(job.mutex);
+				if (job.remaining == 0) return;
+			}
+			if (next(q, task)) {
+				run(q, task);
+				continue;
+			}
+			std::unique_lock <std::mutex> lock(job.mutex);
+			job.done.wait(lock, [&job] {return job.remaining == 0;});
+			return;
+		}
+	}
+	~ExprThreadPool() {
+		{
+			std::lock_guard <std::mutex> lock(sleepMutex);
+			stop = true;
+		}
+		wake.notify_all();
+		for (std::thread &thread : threads) thread.join();
 	}
 };
-#endif
 
 // ---------------------------------------------------------------------------------------------- //
 // Objeto que carrega um bytecode para a execução de uma expressão                                //
@@ -533,30 +4351,792 @@ class Expr {
 		ExprBytecode bytecode;
 		bool validFlag;
 	public:
-		Expr (ExprNode* tree) {
+		// Expressão sobre um bytecode já compilado e finalizado (ExprBytecode::load)
+		explicit Expr (const ExprBytecode &bytecode): bytecode(bytecode) {
+			validFlag = true;
+		}
+		// flags: opções de compilação (EXPR_OPT_*)
+		Expr (ExprNode* tree, int flags = 0) {
 			validFlag = tree != nullptr;
-			if (validFlag) tree->addToBytecode(bytecode);
+			if (validFlag) {
+				// Sub-expressões repetidas são calculadas uma única vez
+				ExprDag dag(flags);
+				dag.toBytecode(bytecode, tree->addToDag(dag));
+				bytecode.end();
+			}
 		}
-		bool valid() {
+		bool valid() const {
 			return validFlag;
 		}
-		double calc() {
+		const ExprBytecode& getBytecode() const {
+			return bytecode;
+		}
+		// Parâmetros (ExprParser::setParam), na ordem em que aparecem na expressão. A troca de
+		// valor vale para as próximas avaliações e não deve ocorrer durante uma delas
+		int paramCount() const {
+			return bytecode.paramCount();
+		}
+		int paramIndex(const std::string &name) const {
+			return bytecode.paramIndex(name);
+		}
+		const std::string& paramName(int index) const {
+			return bytecode.paramName(index);
+		}
+		double getParam(int index) const {
+			return bytecode.param(index);
+		}
+		void setParam(int index, double value) {
+			bytecode.setParam(index, value);
+		}
+		// Falso se não houver parâmetro com esse nome
+		bool setParam(const std::string &name, double value) {
+			int index = bytecode.paramIndex(name);
+			if (index < 0) return false;
+			bytecode.setParam(index, value);
+			return true;
+		}
+		// values[i] é o novo valor do parâmetro i
+		void setParams(const double values[]) {
+			for (int i=0; i<bytecode.paramCount(); ++i) bytecode.setParam(i, values[i]);
+		}
+		// Nova expressão com os valores atuais dos parâmetros fixados como constantes e as
+		// operações sobre constantes já calculadas, para quando os parâmetros deixam de mudar
+		Expr specialize() const {
+			Expr res(nullptr);
+			if (!validFlag) return res;
+			ExprDag dag;
+			std::vector <int> outs;
+			int root = dag.addBytecode(bytecode, outs);
+			if (root < 0) return res;
+			dag.toBytecode(res.bytecode, root);
+			res.bytecode.updateNArgs(bytecode.argCount());
+			res.bytecode.end();
+			res.validFlag = true;
+			return res;
+		}
+		double calc() const {
 			if (!validFlag) return 0;
 			return bytecode.calc();
 		}
-		double calc(const double args[]) {
+		double calc(const double args[]) const {
 			if (!validFlag) return 0;
 			return bytecode.calc(args);
 		}
-		double calc(double first) {
+		double calc(double first) const {
 			if (!validFlag) return 0;
 			return calc(&first);
 		}
-		double calc(double x, double y) {
+		double calc(double x, double y) const {
 			if (!validFlag) return 0;
 			double args[2] = {x, y};
 			return calc(args);
 		}
+		void calc(const double* const args[], double res[], int n) const {
+			if (validFlag) {
+				bytecode.calc(args, res, n);
+			} else {
+				for (int i=0; i<n; ++i) res[i] = 0;
+			}
+		}
+		// Cálculo instrumentado, acumulando em profile o tempo de cada instrução e chamada
+		double calc(const double args[], ExprProfile &profile) const {
+			if (!validFlag) return 0;
+			return profile.run(bytecode, args, nullptr);
+		}
+		// Intervalo que contém o valor da expressão para todos os argumentos dentro de args
+		ExprInterval calc(const ExprInterval args[]) const {
+			if (!validFlag) return ExprInterval();
+			return bytecode.calc(args, nullptr);
+		}
+		// Intervalo que contém o valor da expressão em todas as linhas de begin até end (exclusive),
+		// para descartar blocos de linhas sem avaliá-las
+		ExprInterval bound(const double* const args[], long begin, long end) const {
+			std::vector <ExprInterval> vArgs(bytecode.argCount());
+			for (size_t i=0; i<vArgs.size(); ++i) {
+				const double* col = args[i];
+				vArgs[i] = ExprInterval(INFINITY, - INFINITY);
+				for (long k=begin; k<end; ++k) {
+					if (!(col[k] >= vArgs[i].lo)) vArgs[i].lo = col[k];
+					if (!(col[k] <= vArgs[i].hi)) vArgs[i].hi = col[k];
+				}
+			}
+			return calc(vArgs.data());
+		}
+		// Avaliação em lote dividida entre as threads de pool, em pedaços de até grain linhas
+		void calc(const double* const args[], double res[], long n, ExprThreadPool &pool,
+			long grain = EXPR_PARALLEL_GRAIN) const {
+			pool.parallelFor(n, grain, [&](long begin, long end) {
+				if (validFlag) {
+					bytecode.calc(args, res, begin, end);
+				} else {
+					for (long i=begin; i<end; ++i) res[i] = 0;
+				}
+			});
+		}
+		// Avaliação em lote sobre colunas float, com os valores intermediários em float ou, com
+		// accum EXPR_ACCUM_DOUBLE, em double
+		void calc(const float* const args[], float res[], long n,
+			int accum = EXPR_ACCUM_FLOAT) const {
+			calc(args, res, 0, n, accum);
+		}
+		void calc(const float* const args[], float res[], long begin, long end, int accum) const {
+			if (validFlag) {
+				bytecode.calc(args, res, nullptr, begin, end, accum);
+			} else {
+				for (long i=begin; i<end; ++i) res[i] = 0;
+			}
+		}
+		void calc(const float* const args[], float res[], long n, ExprThreadPool &pool,
+			int accum = EXPR_ACCUM_FLOAT, long grain = EXPR_PARALLEL_GRAIN) const {
+			pool.parallelFor(n, grain, [&](long begin, long end) {
+				calc(args, res, begin, end, accum);
+			});
+		}
+};
+
+// ---------------------------------------------------------------------------------------------- //
+// Programa que calcula várias expressões sobre os mesmos argumentos em uma única passada. As     //
+// sub-expressões comuns entre elas são calculadas uma única vez por linha                        //
+// ---------------------------------------------------------------------------------------------- //
+class ExprMulti {
+	private:
+		ExprBytecode bytecode;
+		bool validFlag;
+		int nOuts;
+		void compile(ExprDag &dag, const std::vector <int> &roots) {
+			dag.toBytecode(bytecode, roots);
+			bytecode.end();
+		}
+	public:
+		// Uma saída por árvore, na mesma ordem; inválido se alguma árvore for nula
+		ExprMulti (const std::vector <ExprNode*> &trees, int flags = 0) {
+			nOuts = trees.size();
+			validFlag = true;
+			for (ExprNode* tree : trees) {
+				if (!tree) validFlag = false;
+			}
+			if (validFlag) {
+				ExprDag dag(flags);
+				std::vector <int> roots;
+				for (ExprNode* tree : trees) roots.push_back(tree->addToDag(dag));
+				compile(dag, roots);
+			}
+		}
+		// Programa sobre um bytecode já compilado e finalizado (ExprBytecode::load)
+		explicit ExprMulti (const ExprBytecode &bytecode): bytecode(bytecode) {
+			nOuts = bytecode.outCount();
+			validFlag = true;
+		}
+		// Uma saída por nó de dag
+		ExprMulti (ExprDag &dag, const std::vector <int> &roots) {
+			nOuts = roots.size();
+			validFlag = true;
+			compile(dag, roots);
+		}
+		bool valid() const {
+			return validFlag;
+		}
+		int outCount() const {
+			return nOuts;
+		}
+		const ExprBytecode& getBytecode() const {
+			return bytecode;
+		}
+		// Parâmetros, como em Expr; as expressões compiladas juntas compartilham os de mesmo nome
+		int paramCount() const {
+			return bytecode.paramCount();
+		}
+		int paramIndex(const std::string &name) const {
+			return bytecode.paramIndex(name);
+		}
+		void setParam(int index, double value) {
+			bytecode.setParam(index, value);
+		}
+		bool setParam(const std::string &name, double value) {
+			int index = bytecode.paramIndex(name);
+			if (index < 0) return false;
+			bytecode.setParam(index, value);
+			return true;
+		}
+		void setParams(const double values[]) {
+			for (int i=0; i<bytecode.paramCount(); ++i) bytecode.setParam(i, values[i]);
+		}
+		ExprMulti specialize() const {
+			if (!validFlag) return *this;
+			ExprDag dag;
+			std::vector <int> outs;
+			dag.addBytecode(bytecode, outs);
+			ExprMulti res(dag, outs);
+			res.bytecode.updateNArgs(bytecode.argCount());
+			return res;
+		}
+		// Intervalos que contêm cada saída para todos os argumentos dentro de args
+		void calc(const ExprInterval args[], ExprInterval out[]) const {
+			if (validFlag) {
+				bytecode.calc(args, out);
+			} else {
+				for (int k=0; k<nOuts; ++k) out[k] = ExprInterval();
+			}
+		}
+		// Calcula todas as saídas para uma linha de argumentos
+		void calc(const double args[], double out[]) const {
+			if (validFlag) {
+				bytecode.calc(args, out);
+			} else {
+				for (int k=0; k<nOuts; ++k) out[k] = 0;
+			}
+		}
+		// Cálculo instrumentado de uma linha, acumulando os contadores em profile
+		void calc(const double args[], double out[], ExprProfile &profile) const {
+			if (validFlag) {
+				profile.run(bytecode, args, out);
+			} else {
+				for (int k=0; k<nOuts; ++k) out[k] = 0;
+			}
+		}
+		// Avaliação em lote: outs[k] recebe os n valores da k-ésima saída
+		void calc(const double* const args[], double* const outs[], long n) const {
+			calc(args, outs, 0, n);
+		}
+		void calc(const double* const args[], double* const outs[], long begin, long end) const {
+			if (validFlag) {
+				bytecode.calc(args, nullptr, outs, begin, end);
+			} else {
+				for (int k=0; k<nOuts; ++k) {
+					for (long i=begin; i<end; ++i) outs[k][i] = 0;
+				}
+			}
+		}
+		void calc(const double* const args[], double* const outs[], long n, ExprThreadPool &pool,
+			long grain = EXPR_PARALLEL_GRAIN) const {
+			pool.parallelFor(n, grain, [&](long begin, long end) {
+				calc(args, outs, begin, end);
+			});
+		}
+		// Avaliação em lote sobre colunas float, como em Expr
+		void calc(const float* const args[], float* const outs[], long n,
+			int accum = EXPR_ACCUM_FLOAT) const {
+			calc(args, outs, 0, n, accum);
+		}
+		void calc(const float* const args[], float* const outs[], long begin, long end,
+			int accum) const {
+			if (validFlag) {
+				bytecode.calc(args, nullptr, outs, begin, end, accum);
+			} else {
+				for (int k=0; k<nOuts; ++k) {
+					for (long i=begin; i<end; ++i) outs[k][i] = 0;
+				}
+			}
+		}
+};
+
+// ---------------------------------------------------------------------------------------------- //
+// Compilador do bytecode de uma Expr para código de máquina x86-64 (System V), sem dependências  //
+// externas. Cada posição da pilha de valores é mantida em um registrador xmm enquanto houver     //
+// registradores disponíveis e em memória no frame da função a partir daí                         //
+// ---------------------------------------------------------------------------------------------- //
+#if defined(__x86_64__) && (defined(__linux__) || defined(__APPLE__) || defined(__FreeBSD__))
+#define EXPR_JIT
+#include <sys/mman.h>
+#endif
+
+class ExprJit {
+public:
+	typedef double (*TFunction) (const double[]);
+	typedef void (*TBatchFunction) (const double* const[], double[], long);
+private:
+	// Registradores xmm usados pela pilha; xmm14 e xmm15 ficam livres como auxiliares
+	static const int NREGS = 14;
+	static const int RAX = 0, RBX = 3, RSP = 4, RDI = 7;
+	std::vector <unsigned char> code;
+	void* page;
+	size_t pageSize;
+	TFunction fn;
+	TBatchFunction batchFn;
+	void byte(int b) {
+		code.push_back((unsigned char) b);
+	}
+	void int32(int v) {
+		for (int i=0; i<4; ++i) byte((v >> (8*i)) & 0xff);
+	}
+	void movImm(int reg, unsigned long long imm) { // mov reg, imm64
+		byte(0x48);
+		byte(0xb8 + reg);
+		for (int i=0; i<8; ++i) byte((imm >> (8*i)) & 0xff);
+	}
+	void movImm(int reg, const void* ptr) {
+		movImm(reg, (unsigned long long) ptr);
+	}
+	void movq(int xmm, int reg) { // movq xmm, reg
+		byte(0x66);
+		byte(0x48 | ((xmm >> 3) << 2) | (reg >> 3));
+		byte(0x0f);
+		byte(0x6e);
+		byte(0xc0 | ((xmm & 7) << 3) | (reg & 7));
+	}
+	// Instrução SSE entre xmm e registrador (rm < 0 indica memória em [base + disp])
+	void sseReg(int prefix, int op, int xmm, int rm) {
+		byte(prefix);
+		if (xmm >= 8 || rm >= 8) byte(0x40 | ((xmm >> 3) << 2) | (rm >> 3));
+		byte(0x0f);
+		byte(op);
+		byte(0xc0 | ((xmm & 7) << 3) | (rm & 7));
+	}
+	void sseMem(int prefix, int op, int xmm, int base, int disp) {
+		byte(prefix);
+		if (xmm >= 8) byte(0x44);
+		byte(0x0f);
+		byte(op);
+		byte(0x80 | ((xmm & 7) << 3) | base);
+		if (base == RSP) byte(0x24);
+		int32(disp);
+	}
+	// Posição i da pilha: em registrador (i < NREGS) ou em [rsp + 8*i]
+	void load(int xmm, int slot) {
+		if (slot < NREGS) {
+			if (xmm != slot) sseReg(0xf2, 0x10, xmm, slot);
+		} else {
+			sseMem(0xf2, 0x10, xmm, RSP, 8*slot);
+		}
+	}
+	void store(int slot, int xmm) {
+		if (slot < NREGS) {
+			if (xmm != slot) sseReg(0xf2, 0x10, slot, xmm);
+		} else {
+			sseMem(0xf2, 0x11, xmm, RSP, 8*slot);
+		}
+	}
+	void spill(int from, int to) {
+		for (int i=from; i<to && i<NREGS; ++i) sseMem(0xf2, 0x11, i, RSP, 8*i);
+	}
+	void reload(int from, int to) {
+		for (int i=from; i<to && i<NREGS; ++i) sseMem(0xf2, 0x10, i, RSP, 8*i);
+	}
+	// Registrador que contém a posição (carregando-a em aux se estiver em memória)
+	int operand(int slot, int aux) {
+		if (slot < NREGS) return slot;
+		load(aux, slot);
+		return aux;
+	}
+	void callRax() {
+		byte(0xff);
+		byte(0xd0);
+	}
+	// Argumento i: args[i] (args em rbx) ou, no modo em lote, cols[i][r14] (cols em rbx)
+	void loadArg(int xmm, int index, bool batch) {
+		if (batch) {
+			byte(0x48); // mov rax, [rbx + 8*i]
+			byte(0x8b);
+			byte(0x83);
+			int32(8*index);
+			byte(0xf2); // movsd xmm, [rax + r14*8]
+			byte(0x42 | ((xmm >> 3) << 2));
+			byte(0x0f);
+			byte(0x10);
+			byte(((xmm & 7) << 3) | 0x04);
+			byte(0xf0);
+		} else {
+			sseMem(0xf2, 0x10, xmm, RBX, 8*index);
+		}
+	}
+	void movDouble(int xmm, double value) { // xmm = value, por rax
+		unsigned long long bits;
+		memcpy(&bits, &value, sizeof(bits));
+		movImm(RAX, bits);
+		movq(xmm, RAX);
+	}
+	// Gera o corpo da expressão; o resultado fica na posição 0 da pilha. No modo em lote os
+	// argumentos são lidos de cols[i][r14], com cols em rbx. Os temporários ficam no frame, após a
+	// pilha
+	bool body(const ExprBytecode& bytecode, bool batch) {
+		const unsigned char* pc = bytecode.code();
+		int sp = 0;
+		int tmp = 8*bytecode.stackSize();
+		ExprBytecode::Instr instr;
+		for (;;) {
+			pc = ExprBytecode::decode(pc, instr);
+			switch (instr.op) {
+				case EXPR_BYTECODE_END:
+					load(0, 0);
+				return true;
+				case EXPR_BYTECODE_CONST: {
+					movDouble(sp < NREGS ? sp : 15, instr.value);
+					if (sp >= NREGS) store(sp, 15);
+				break;
+				}
+				case EXPR_BYTECODE_ARG: {
+					int xmm = sp < NREGS ? sp : 15;
+					loadArg(xmm, instr.index, batch);
+					store(sp, xmm);
+				break;
+				}
+				case EXPR_BYTECODE_REF:
+				case EXPR_BYTECODE_PARAM: {
+					// Os parâmetros são lidos do bytecode da expressão compilada, a cada chamada
+					int xmm = sp < NREGS ? sp : 15;
+					movImm(RAX, instr.op == EXPR_BYTECODE_REF ? instr.ref :
+						(const void*) bytecode.paramRef(instr.index));
+					byte(0xf2); // movsd xmm, [rax]
+					if (xmm >= 8) byte(0x44);
+					byte(0x0f);
+					byte(0x10);
+					byte((xmm & 7) << 3);
+					store(sp, xmm);
+				break;
+				}
+				case EXPR_BYTECODE_ABS: {
+					// Como na VM, v >= 0 ? v : -v (|-0| = -0): o sinal é trocado onde !(0 <= v)
+					int a = operand(sp - 1, 14);
+					sseReg(0x66, 0x57, 15, 15); // xorpd
+					sseReg(0xf2, 0xc2, 15, a); // cmpnlesd
+					byte(6);
+					sseReg(0x66, 0x73, 6, 15); // psllq xmm15, 63: só o bit de sinal
+					byte(63);
+					sseReg(0x66, 0x57, a, 15); // xorpd
+					store(sp - 1, a);
+					--sp;
+				break;
+				}
+				case EXPR_BYTECODE_NEG: {
+					movImm(RAX, 0x8000000000000000ULL);
+					movq(15, RAX);
+					int a = operand(sp - 1, 14);
+					sseReg(0x66, 0x57, a, 15); // xorpd
+					store(sp - 1, a);
+					--sp;
+				break;
+				}
+				case EXPR_BYTECODE_ADD:
+				case EXPR_BYTECODE_SUB:
+				case EXPR_BYTECODE_MUL:
+				case EXPR_BYTECODE_DIV: {
+					static const unsigned char ops[] = {0x58, 0x5c, 0x59, 0x5e};
+					int a = operand(sp - 2, 14);
+					int b = operand(sp - 1, 15);
+					sseReg(0xf2, ops[instr.op - EXPR_BYTECODE_ADD], a, b);
+					store(sp - 2, a);
+					sp -= 2;
+				break;
+				}
+				case EXPR_BYTECODE_POW: {
+					double (*ref)(double, double) = ::pow;
+					int base = sp - 2;
+					spill(0, base);
+					load(0, base);
+					load(1, base + 1);
+					movImm(RAX, (const void*) ref);
+					callRax();
+					store(base, 0);
+					reload(0, base);
+					sp = base;
+				break;
+				}
+				case EXPR_BYTECODE_CALL: {
+					int base = sp - instr.index;
+					spill(0, sp);
+					byte(0x48); // lea rdi, [rsp + 8*base]
+					byte(0x8d);
+					byte(0xbc);
+					byte(0x24);
+					int32(8*base);
+					movImm(RAX, instr.ref);
+					callRax();
+					store(base, 0);
+					reload(0, base);
+					sp = base;
+				break;
+				}
+				case EXPR_BYTECODE_BCALL: {
+					// Uma linha por chamada, por ExprCalls::callBatch(ref, args, n)
+					double (*call)(TExprBatchFunction, const double[], int) = ExprCalls::callBatch;
+					int base = sp - instr.index;
+					spill(0, sp);
+					movImm(RDI, instr.ref);
+					byte(0x48); // lea rsi, [rsp + 8*base]
+					byte(0x8d);
+					byte(0xb4);
+					byte(0x24);
+					int32(8*base);
+					byte(0xba); // mov edx, n
+					int32(instr.index);
+					movImm(RAX, (const void*) call);
+					callRax();
+					store(base, 0);
+					reload(0, base);
+					sp = base;
+				break;
+				}
+				case EXPR_BYTECODE_MULADD: {
+					// O produto é arredondado antes da soma, como na VM
+					int a = operand(sp - 3, 14);
+					sseReg(0xf2, 0x59, a, operand(sp - 2, 15)); // mulsd
+					sseReg(0xf2, 0x58, a, operand(sp - 1, 15)); // addsd
+					store(sp - 3, a);
+					sp -= 3;
+				break;
+				}
+				case EXPR_BYTECODE_POWI: {
+					// Mesma sequência de ExprScalarKernels::powi, com a base em xmm15
+					int a = operand(sp - 1, 14);
+					unsigned int m = instr.index < 0 ? - instr.index : instr.index;
+					while (!(m & 1)) {
+						sseReg(0xf2, 0x59, a, a);
+						m >>= 1;
+					}
+					if (m > 1) sseReg(0xf2, 0x10, 15, a);
+					while (m >>= 1) {
+						sseReg(0xf2, 0x59, 15, 15);
+						if (m & 1) sseReg(0xf2, 0x59, a, 15);
+					}
+					if (instr.index < 0) {
+						movDouble(15, 1);
+						sseReg(0xf2, 0x5e, 15, a); // divsd
+						sseReg(0xf2, 0x10, a, 15);
+					}
+					store(sp - 1, a);
+					--sp;
+				break;
+				}
+				case EXPR_BYTECODE_SQRT: {
+					// sqrt(x) + 0 e, para x = -inf, +inf (como pow)
+					int a = operand(sp - 1, 14);
+					byte(0x66); // movq rax, a
+					byte(0x48 | ((a >> 3) << 2));
+					byte(0x0f);
+					byte(0x7e);
+					byte(0xc0 | ((a & 7) << 3));
+					sseReg(0xf2, 0x51, a, a); // sqrtsd
+					sseReg(0x66, 0x57, 15, 15); // xorpd
+					sseReg(0xf2, 0x58, a, 15);
+					static const unsigned char test[] = {
+						0x48, 0xb9, 0, 0, 0, 0, 0, 0, 0xf0, 0xff, // mov rcx, -inf
+						0x48, 0x39, 0xc8, // cmp rax, rcx
+						0x75 // jne
+					};
+					code.insert(code.end(), test, test + sizeof(test));
+					size_t jump = code.size();
+					byte(0);
+					movDouble(a, HUGE_VAL);
+					code[jump] = code.size() - (jump + 1);
+					store(sp - 1, a);
+					--sp;
+				break;
+				}
+				case EXPR_BYTECODE_ADDC:
+				case EXPR_BYTECODE_SUBC:
+				case EXPR_BYTECODE_MULC:
+				case EXPR_BYTECODE_DIVC:
+				case EXPR_BYTECODE_ADDA:
+				case EXPR_BYTECODE_SUBA:
+				case EXPR_BYTECODE_MULA:
+				case EXPR_BYTECODE_DIVA: {
+					static const unsigned char ops[] = {0x58, 0x5c, 0x59, 0x5e};
+					bool arg = instr.op >= EXPR_BYTECODE_ADDA;
+					int a = operand(sp - 1, 14);
+					if (arg) {
+						loadArg(15, instr.index, batch);
+					} else {
+						movDouble(15, instr.value);
+					}
+					sseReg(0xf2, ops[(instr.op - EXPR_BYTECODE_ADDC) % 4], a, 15);
+					store(sp - 1, a);
+					--sp;
+				break;
+				}
+				case EXPR_BYTECODE_LT:
+				case EXPR_BYTECODE_LE:
+				case EXPR_BYTECODE_GT:
+				case EXPR_BYTECODE_GE:
+				case EXPR_BYTECODE_EQ:
+				case EXPR_BYTECODE_NE: {
+					// cmpsd dá a máscara da comparação, e a máscara AND 1.0 dá 1 ou 0. O SSE não
+					// tem > e >= ordenados: são < e <= com os operandos trocados, em xmm15
+					static const unsigned char preds[] = {1, 2, 1, 2, 0, 4};
+					int k = instr.op - EXPR_BYTECODE_LT;
+					int a = operand(sp - 2, 14);
+					int b = operand(sp - 1, 15);
+					int mask = a;
+					if (instr.op == EXPR_BYTECODE_GT || instr.op == EXPR_BYTECODE_GE) {
+						if (b != 15) sseReg(0xf2, 0x10, 15, b);
+						sseReg(0xf2, 0xc2, 15, a); // cmpsd
+						mask = 15;
+					} else {
+						sseReg(0xf2, 0xc2, a, b);
+					}
+					byte(preds[k]);
+					movDouble(mask == a ? 15 : a, 1);
+					sseReg(0x66, 0x54, a, mask == a ? 15 : mask); // andpd
+					store(sp - 2, a);
+					sp -= 2;
+				break;
+				}
+				case EXPR_BYTECODE_MIN:
+				case EXPR_BYTECODE_MAX: {
+					// minsd e maxsd têm a semântica das instruções (com NaN, o segundo operando)
+					int a = operand(sp - 2, 14);
+					sseReg(0xf2, instr.op == EXPR_BYTECODE_MIN ? 0x5d : 0x5f, a, operand(sp - 1, 15));
+					store(sp - 2, a);
+					sp -= 2;
+				break;
+				}
+				case EXPR_BYTECODE_SELECT: {
+					// m = (c != 0); resultado (m AND a) OR (m ANDN b). O ramo a mascarado volta para a
+					// sua posição da pilha para liberar xmm15
+					int c = operand(sp - 3, 14);
+					sseReg(0x66, 0x57, 15, 15); // xorpd
+					sseReg(0xf2, 0xc2, c, 15); // cmpneqsd
+					byte(4);
+					int a = operand(sp - 2, 15);
+					sseReg(0x66, 0x54, a, c); // andpd
+					store(sp - 2, a);
+					sseReg(0x66, 0x55, c, operand(sp - 1, 15)); // andnpd
+					sseReg(0x66, 0x56, c, operand(sp - 2, 15)); // orpd
+					store(sp - 3, c);
+					sp -= 3;
+				break;
+				}
+				case EXPR_BYTECODE_STORE: {
+					int a = operand(sp - 1, 15);
+					sseMem(0xf2, 0x11, a, RSP, tmp + 8*instr.index);
+					--sp;
+				break;
+				}
+				case EXPR_BYTECODE_LOAD: {
+					int xmm = sp < NREGS ? sp : 15;
+					sseMem(0xf2, 0x10, xmm, RSP, tmp + 8*instr.index);
+					store(sp, xmm);
+				break;
+				}
+				default:
+				return false;
+			}
+			++sp;
+		}
+	}
+	void* install() {
+#ifdef EXPR_JIT
+		pageSize = code.size();
+		void* ptr = mmap(nullptr, pageSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+			-1, 0);
+		if (ptr == MAP_FAILED) return nullptr;
+		memcpy(ptr, code.data(), code.size());
+		if (mprotect(ptr, pageSize, PROT_READ | PROT_EXEC) != 0) {
+			munmap(ptr, pageSize);
+			return nullptr;
+		}
+		return ptr;
+#else
+		return nullptr;
+#endif
+	}
+	void compile(const ExprBytecode& bytecode) {
+		// Frame com uma posição de 8 bytes por nível da pilha e por temporário, múltiplo de 16
+		int frame = (8*(bytecode.stackSize() + bytecode.tempCount()) + 15) & ~15;
+		// double f(const double args[])
+		byte(0x53); // push rbx
+		byte(0x48); // sub rsp, frame
+		byte(0x81);
+		byte(0xec);
+		int32(frame);
+		byte(0x48); // mov rbx, rdi
+		byte(0x89);
+		byte(0xfb);
+		if (!body(bytecode, false)) return;
+		byte(0x48); // add rsp, frame
+		byte(0x81);
+		byte(0xc4);
+		int32(frame);
+		byte(0x5b); // pop rbx
+		byte(0xc3); // ret
+		size_t batchStart = code.size();
+		// void f(const double* const cols[], double res[], long n)
+		static const unsigned char prologue[] = {
+			0x53, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56, 0x41, 0x57, // push rbx, r12-r15
+			0x48, 0x89, 0xfb, // mov rbx, rdi
+			0x49, 0x89, 0xf4, // mov r12, rsi
+			0x49, 0x89, 0xd5, // mov r13, rdx
+			0x45, 0x31, 0xf6 // xor r14d, r14d
+		};
+		code.insert(code.end(), prologue, prologue + sizeof(prologue));
+		byte(0x48); // sub rsp, frame
+		byte(0x81);
+		byte(0xec);
+		int32(frame);
+		size_t loop = code.size();
+		static const unsigned char test[] = {0x4d, 0x39, 0xee, 0x0f, 0x8d}; // cmp r14, r13; jge
+		code.insert(code.end(), test, test + sizeof(test));
+		size_t exitJump = code.size();
+		int32(0);
+		if (!body(bytecode, true)) return;
+		static const unsigned char next[] = {
+			0xf2, 0x43, 0x0f, 0x11, 0x04, 0xf4, // movsd [r12 + r14*8], xmm0
+			0x49, 0xff, 0xc6, // inc r14
+			0xe9 // jmp loop
+		};
+		code.insert(code.end(), next, next + sizeof(next));
+		int32((int) loop - (int) (code.size() + 4));
+		int exitPos = (int) code.size();
+		for (int i=0; i<4; ++i) code[exitJump + i] = ((exitPos - (int) (exitJump + 4)) >> (8*i)) & 0xff;
+		byte(0x48); // add rsp, frame
+		byte(0x81);
+		byte(0xc4);
+		int32(frame);
+		static const unsigned char epilogue[] = {
+			0x41, 0x5f, 0x41, 0x5e, 0x41, 0x5d, 0x41, 0x5c, 0x5b, // pop r15-r12, rbx
+			0xc3 // ret
+		};
+		code.insert(code.end(), epilogue, epilogue + sizeof(epilogue));
+		page = install();
+		if (!page) return;
+		fn = (TFunction) page;
+		batchFn = (TBatchFunction) ((unsigned char*) page + batchStart);
+	}
+public:
+	// Os parâmetros são lidos de expr, que deve existir enquanto a função for usada; setParam em
+	// expr vale para as chamadas seguintes
+	ExprJit(const Expr& expr) {
+		page = nullptr;
+		pageSize = 0;
+		fn = nullptr;
+		batchFn = nullptr;
+#ifdef EXPR_JIT
+		if (expr.valid()) compile(expr.getBytecode());
+#endif
+		code.clear();
+		code.shrink_to_fit();
+	}
+	ExprJit(const ExprJit&) = delete;
+	ExprJit& operator=(const ExprJit&) = delete;
+	ExprJit(ExprJit&& other) {
+		page = other.page;
+		pageSize = other.pageSize;
+		fn = other.fn;
+		batchFn = other.batchFn;
+		other.page = nullptr;
+		other.fn = nullptr;
+		other.batchFn = nullptr;
+	}
+	// Falso se a plataforma não for suportada ou o bytecode tiver instruções desconhecidas
+	bool valid() const {
+		return fn != nullptr;
+	}
+	TFunction function() const {
+		return fn;
+	}
+	TBatchFunction batch() const {
+		return batchFn;
+	}
+	double calc(const double args[]) const {
+		return fn(args);
+	}
+	void calc(const double* const cols[], double res[], long n) const {
+		batchFn(cols, res, n);
+	}
+	~ExprJit() {
+#ifdef EXPR_JIT
+		if (page) munmap(page, pageSize);
+#endif
+	}
 };
 
 // ---------------------------------------------------------------------------------------------- //
@@ -564,41 +5144,89 @@ class Expr {
 // ---------------------------------------------------------------------------------------------- //
 class ExprParser {
 private:
-	std::string src;
+	// Texto em análise, que pertence a quem chamou parse e só é lido durante a chamada
+	const char* src;
 	int length;
 	int index;
 	int errorIndex;
 	ExprNode* parsedTree;
-	static double call_ln(const double args[]) {
-		return log(args[0]);
-	}
-	static double call_log(const double args[]) {
-		return log10(args[0]);
-	}
-	static double call_exp(const double args[]) {
-		return exp(args[0]);
-	}
-	static double call_sin(const double args[]) {
-		return sin(args[0]);
+	// Dona de todos os nós da árvore, que são descartados juntos a cada parse()
+	ExprArena arena;
+	// Pilha com os argumentos das chamadas em análise, copiados para a arena ao fim de cada uma
+	std::vector <ExprNode*> argStack;
+	// Tabela de símbolos do parse atual, em endereçamento aberto: cada identificador tem um único
+	// ExprSymbol, alocado na arena e compartilhado pelos nós em que ocorre. As definições são
+	// feitas no símbolo, sem percorrer a árvore
+	std::vector <ExprSymbol*> symbols;
+	// Os mesmos símbolos, na ordem em que apareceram
+	std::vector <ExprSymbol*> symbolList;
+	ExprSymbol* intern(const char* str, int len) {
+		if ((symbolList.size() + 1) * 2 > symbols.size()) {
+			std::vector <ExprSymbol*> old(symbols.size() ? symbols.size() * 2 : 64, nullptr);
+			old.swap(symbols);
+			for (ExprSymbol* symbol : symbolList) {
+				symbols[findSymbol(symbol->id, strlen(symbol->id))] = symbol;
+			}
+		}
+		size_t pos = findSymbol(str, len);
+		if (!symbols[pos]) {
+			char* id = (char*) arena.alloc(len + 1);
+			memcpy(id, str, len);
+			id[len] = '\0';
+			symbols[pos] = arena.make<ExprSymbol>(id);
+			symbolList.push_back(symbols[pos]);
+		}
+		return symbols[pos];
 	}
-	static double call_cos(const double args[]) {
-		return cos(args[0]);
+	// Posição do nome na tabela, ou da vaga em que ele deve entrar
+	size_t findSymbol(const char* str, size_t len) const {
+		size_t hash = 2166136261u;
+		for (size_t i=0; i<len; ++i) hash = (hash ^ (unsigned char) str[i]) * 16777619u;
+		size_t mask = symbols.size() - 1;
+		for (size_t pos=hash&mask; ; pos=(pos+1)&mask) {
+			const ExprSymbol* symbol = symbols[pos];
+			if (!symbol || (!strncmp(symbol->id, str, len) && symbol->id[len] == '\0')) return pos;
+		}
 	}
-	static double call_tan(const double args[]) {
-		return tan(args[0]);
+	// Símbolo do identificador, ou nullptr se ele não ocorre na expressão
+	ExprSymbol* symbol(const std::string &id) const {
+		if (!parsedTree || symbols.empty()) return nullptr;
+		return symbols[findSymbol(id.data(), id.size())];
 	}
-	static double call_asin(const double args[]) {
-		return asin(args[0]);
+	static bool byId(const ExprSymbol* a, const ExprSymbol* b) {
+		return strcmp(a->id, b->id) < 0;
 	}
-	static double call_acos(const double args[]) {
-		return acos(args[0]);
+	// Variáveis ainda livres, em ordem alfabética
+	std::vector <ExprSymbol*> nullSymbols() const {
+		std::vector <ExprSymbol*> list;
+		if (!parsedTree) return list;
+		for (ExprSymbol* symbol : symbolList) {
+			if (symbol->isVar && symbol->type == '\0') list.push_back(symbol);
+		}
+		std::sort(list.begin(), list.end(), byId);
+		return list;
 	}
-	static double call_atan(const double args[]) {
-		return atan(args[0]);
+	// Quantidade de argumentos já definidos: o maior índice mais um
+	int countArgs() const {
+		int n = 0;
+		for (const ExprSymbol* symbol : symbolList) {
+			if (symbol->isVar && symbol->type == 'a') n = std::max(n, symbol->index + 1);
+		}
+		return n;
 	}
 	void catchError() {
 		if (errorIndex == -1) errorIndex = index;
 	}
+	// Atribui as variáveis livres, em ordem alfabética, às posições seguintes ao maior argumento
+	// já definido; devolve a quantidade de argumentos
+	int setNullArgs() {
+		int n = countArgs();
+		for (ExprSymbol* symbol : nullSymbols()) {
+			symbol->type = 'a';
+			symbol->index = n++;
+		}
+		return n;
+	}
 	bool hasError() {
 		return errorIndex != -1;
 	}
@@ -612,6 +5240,10 @@ private:
 		if (isOver()) return '\0';
 		return src[index];
 	}
+	char peekChar(int offset) {
+		if (hasError() || index + offset >= length) return '\0';
+		return src[index + offset];
+	}
 	char consumeChar() {
 		if (isOver()) return '\0';
 		return src[index++];
@@ -646,82 +5278,128 @@ private:
 	void consumeSpaces() {
 		while (isSpace(nextChar())) consumeChar();
 	}
-	std::string consumeId() {
-		std::string id;
-		while (isIdBody(nextChar())) id += consumeChar();
+	ExprSymbol* consumeId() {
+		int begin = index;
+		while (isIdBody(nextChar())) ++index;
+		ExprSymbol* id = intern(src + begin, index - begin);
 		consumeSpaces();
 		return id;
 	}
+	// Soma o dígito à mantissa enquanto ela tiver até 19 dígitos significativos; devolve falso se
+	// o dígito não couber
+	static bool addDigit(unsigned long long &mantissa, int &digits, char chr) {
+		if (digits >= 19) return false;
+		mantissa = mantissa * 10 + (chr - '0');
+		if (mantissa) ++digits;
+		return true;
+	}
+	// Número com parte decimal e expoente (e, E, com sinal) opcionais. Uma mantissa de até 2^53
+	// com potência de 10 de até 22 são exatas em double, e então uma única multiplicação ou
+	// divisão dá o resultado corretamente arredondado; os demais casos ficam com strtod
 	double consumeValue() {
-		std::string str;
+		static const double pow10[] = {
+			1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15,
+			1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+		};
+		int begin = index;
+		unsigned long long mantissa = 0;
+		int digits = 0;
+		int exp10 = 0;
+		bool exact = true;
 		while (isDigit(nextChar())) {
-			str += consumeChar();
+			if (!addDigit(mantissa, digits, src[index])) {
+				exact = false;
+				++exp10;
+			}
+			++index;
 		}
-		if (nextChar()!='.') {
-			consumeSpaces();
-			return std::stod(str);
+		if (nextChar() == '.') {
+			++index;
+			if (!isDigit(nextChar())) {
+				catchError();
+				return 0;
+			}
+			while (isDigit(nextChar())) {
+				if (addDigit(mantissa, digits, src[index])) {
+					--exp10;
+				} else if (src[index] != '0') {
+					exact = false;
+				}
+				++index;
+			}
 		}
-		str += consumeChar();
-		if (!isDigit(nextChar())) {
-			catchError();
-			return 0;
+		char sign = peekChar(1);
+		if ((nextChar() | 32) == 'e' && (isDigit(sign) ||
+			((sign == '+' || sign == '-') && isDigit(peekChar(2))))) {
+			index += isDigit(sign) ? 1 : 2;
+			int exp = 0;
+			while (isDigit(nextChar())) {
+				if (exp < 100000) exp = exp * 10 + (src[index] - '0');
+				++index;
+			}
+			exp10 += sign == '-' ? - exp : exp;
 		}
-		while (isDigit(nextChar())) str += consumeChar();
+		int end = index;
 		consumeSpaces();
-		return std::stod(str);
+		if (exact && mantissa <= (1ull << 53) && exp10 >= -22 && exp10 <= 22) {
+			return exp10 < 0 ? mantissa / pow10[- exp10] : mantissa * pow10[exp10];
+		}
+		if (exact && mantissa == 0) return 0;
+		char buf[64];
+		std::string str;
+		char* text = buf;
+		if (end - begin >= (int) sizeof(buf)) {
+			str.assign(src + begin, end - begin);
+			text = &str[0];
+		} else {
+			memcpy(buf, src + begin, end - begin);
+			buf[end - begin] = '\0';
+		}
+		return strtod(text, nullptr);
 	}
 	ExprNode* parseConst() {
 		double value = consumeValue();
 		if (hasError()) return nullptr;
-		return new ExprNodeConst(value);
+		return arena.make<ExprNodeConst>(value);
 	}
-	ExprNode* parseCall(std::string id) {
-		if (consumeToken(')')) return new ExprNodeCall(id);
-		ExprNode* arg = parseExpr();
-		if (!arg) {
-			catchError();
-			return nullptr;
-		}
-		ExprNodeCall* call = new ExprNodeCall(id);
-		call->addArg(arg);
-		while (consumeToken(',')) {
+	ExprNode* parseCall(ExprSymbol* name) {
+		if (consumeToken(')')) return arena.make<ExprNodeCall>(name, nullptr, 0);
+		size_t base = argStack.size();
+		do {
 			ExprNode* arg = parseExpr();
 			if (!arg) {
 				catchError();
-				delete call;
+				argStack.resize(base);
 				return nullptr;
 			}
-		}
+			argStack.push_back(arg);
+		} while (consumeToken(','));
 		if (!consumeToken(')')) {
 			catchError();
-			delete call;
+			argStack.resize(base);
 			return nullptr;
 		}
-		return call;
-	}
-	ExprNode* parseAbs() {
-		ExprNode* tree = parseExpr();
-		if (consumeToken('|')) return tree;
-		catchError();
-		delete tree;
-		return nullptr;
+		int n = argStack.size() - base;
+		ExprNode** args = (ExprNode**) arena.alloc(n * sizeof(ExprNode*));
+		for (int i=0; i<n; ++i) args[i] = argStack[base + i];
+		argStack.resize(base);
+		return arena.make<ExprNodeCall>(name, args, n);
 	}
 	ExprNode* parseOpr1() {
 		if (isDigit(nextChar())) {
 			return parseConst();
 		}
 		if (isIdHead(nextChar())) {
-			std::string id = consumeId();
+			ExprSymbol* id = consumeId();
 			if (consumeToken('(')) {
 				return parseCall(id);
 			}
-			return new ExprNodeVar(id);
+			return arena.make<ExprNodeVar>(id);
 		}
 		if (consumeToken('(')) {
 			ExprNode* tree = parseExpr();
 			if (!tree) return nullptr;
 			if (!consumeToken(')')) {
-				delete tree;
 				catchError();
 				return nullptr;
 			}
@@ -731,11 +5409,10 @@ private:
 			ExprNode* tree = parseExpr();
 			if (!tree) return nullptr;
 			if (!consumeToken('|')) {
-				delete tree;
 				catchError();
 				return nullptr;
 			}
-			return new ExprNodeAbs(tree);
+			return arena.make<ExprNodeAbs>(tree);
 		}
 		return nullptr;
 	}
@@ -751,13 +5428,12 @@ private:
 			ExprNode* right = parseOpr1();
 			if (!right) {
 				catchError();
-				delete tree;
 				return nullptr;
 			}
-			if (neg) right = new ExprNodeNeg(right);
-			tree = new ExprNodeOpr('^', tree, right);
+			if (neg) right = arena.make<ExprNodeNeg>(right);
+			tree = arena.make<ExprNodeOpr>('^', tree, right);
 		}
-		if (neg) tree = new ExprNodeNeg(tree);
+		if (neg) tree = arena.make<ExprNodeNeg>(tree);
 		return tree;
 	}
 	ExprNode* parseOpr3() {
@@ -771,10 +5447,9 @@ private:
 			ExprNode* right = parseOpr2();
 			if (!right) {
 				catchError();
-				delete tree;
 				return nullptr;
 			}
-			tree = new ExprNodeOpr(opr, tree, right);
+			tree = arena.make<ExprNodeOpr>(opr, tree, right);
 		}
 		return tree;
 	}
@@ -789,117 +5464,1145 @@ private:
 			ExprNode* right = parseOpr3();
 			if (!right) {
 				catchError();
-				delete tree;
 				return nullptr;
 			}
-			tree = new ExprNodeOpr(opr, tree, right);
+			tree = arena.make<ExprNodeOpr>(opr, tree, right);
+		}
+		return tree;
+	}
+	// Operador de comparação em index (<, <=, >, >=, == ou !=), consumido; 0 se não houver
+	unsigned char consumeComparison() {
+		char chr = nextChar();
+		bool equal = peekChar(1) == '=';
+		unsigned char op = 0;
+		if (chr == '<') op = equal ? EXPR_BYTECODE_LE : EXPR_BYTECODE_LT;
+		else if (chr == '>') op = equal ? EXPR_BYTECODE_GE : EXPR_BYTECODE_GT;
+		else if (chr == '=' && equal) op = EXPR_BYTECODE_EQ;
+		else if (chr == '!' && equal) op = EXPR_BYTECODE_NE;
+		if (!op) return 0;
+		index += equal ? 2 : 1;
+		consumeSpaces();
+		return op;
+	}
+	ExprNode* parseOpr5() {
+		ExprNode* tree = parseOpr4();
+		if (!tree) {
+			catchError();
+			return nullptr;
+		}
+		while (unsigned char op = consumeComparison()) {
+			ExprNode* right = parseOpr4();
+			if (!right) {
+				catchError();
+				return nullptr;
+			}
+			tree = arena.make<ExprNodeCmp>(op, tree, right);
 		}
 		return tree;
 	}
+	// c ? a : b, associativo à direita
 	ExprNode* parseExpr() {
-		return parseOpr4();
+		ExprNode* tree = parseOpr5();
+		if (!tree || !consumeToken('?')) return tree;
+		ExprNode* a = parseExpr();
+		if (!a) return nullptr;
+		if (!consumeToken(':')) {
+			catchError();
+			return nullptr;
+		}
+		ExprNode* b = parseExpr();
+		if (!b) return nullptr;
+		return arena.make<ExprNodeSelect>(tree, a, b);
 	}
 public:
 	ExprParser() {
+		src = "";
 		length = 0;
 		index = 0;
 		errorIndex = -1;
 		parsedTree = nullptr;
 	}
-	bool parse(std::string expr) {
+	// O texto não é copiado: os nomes vão para a arena e o resto é descartado
+	bool parse(const char* expr, size_t len) {
 		src = expr;
-		length = expr.length();
+		length = len;
 		index = 0;
 		errorIndex = -1;
+		arena.clear();
+		std::fill(symbols.begin(), symbols.end(), nullptr);
+		symbolList.clear();
 		consumeSpaces();
 		parsedTree = parseExpr();
 		if (!parsedTree) return false;
 		if (!end()) catchError();
 		if (hasError()) {
-			delete parsedTree;
 			parsedTree = nullptr;
 			return false;
 		}
 		return true;
 	}
+	bool parse(const std::string &expr) {
+		return parse(expr.data(), expr.size());
+	}
 	bool parse(const char str[]) {
-		return parse(std::string(str));
+		return parse(str, strlen(str));
+	}
+#if __cplusplus >= 201703L
+	bool parse(std::string_view expr) {
+		return parse(expr.data(), expr.size());
 	}
+#endif
 	bool success() {
 		return !hasError() && parsedTree!=nullptr;
 	}
 	int error() {
 		return errorIndex;
 	}
-	void setArg(std::string id, int index) {
-		if (parsedTree) parsedTree->setArg(id, index);
+	// As definições valem para todas as ocorrências do identificador; nomes que não ocorrem na
+	// expressão são ignorados
+	void setArg(const std::string &id, int index) {
+		ExprSymbol* symbol = this->symbol(id);
+		if (!symbol) return;
+		symbol->type = 'a';
+		symbol->index = index;
+	}
+	void setVar(const std::string &id, double value) {
+		ExprSymbol* symbol = this->symbol(id);
+		if (!symbol) return;
+		symbol->type = 'v';
+		symbol->value = value;
 	}
-	void setVar(std::string id, double value) {
-		if (parsedTree) parsedTree->setVar(id, value);
+	void setVar(const std::string &id, double* ref) {
+		ExprSymbol* symbol = this->symbol(id);
+		if (!symbol) return;
+		symbol->type = 'r';
+		symbol->ref = ref;
 	}
-	void setVar(std::string id, double* ref) {
-		if (parsedTree) parsedTree->setVar(id, ref);
+	// Parâmetro: fica no programa compilado com o valor inicial value, que pode ser trocado depois
+	// com Expr::setParam sem recompilar
+	void setParam(const std::string &id, double value) {
+		ExprSymbol* symbol = this->symbol(id);
+		if (!symbol) return;
+		symbol->type = 'p';
+		symbol->value = value;
 	}
-	void setCall(std::string id, TExprFunction ref) {
-		if (parsedTree) parsedTree->setCall(id, ref);
+	// flags combina EXPR_CALL_PURE e EXPR_CALL_ARITY
+	void setCall(const std::string &id, TExprFunction ref, int flags = 0) {
+		ExprSymbol* symbol = this->symbol(id);
+		if (!symbol) return;
+		symbol->call = ref;
+		symbol->batch = nullptr;
+		symbol->flags = flags;
+	}
+	// Função em lote: a avaliação em lote a chama uma única vez por bloco de linhas
+	void setCall(const std::string &id, TExprBatchFunction ref, int flags = 0) {
+		ExprSymbol* symbol = this->symbol(id);
+		if (!symbol) return;
+		symbol->call = nullptr;
+		symbol->batch = ref;
+		symbol->flags = flags;
 	}
 	void std() {
 		setVar("PI", (double) 3.1415926535897932384626433832795028841972);
 		setVar("E",  (double) 2.7182818284590452353602874713526624977572);
-		setCall("ln",   call_ln);
-		setCall("log",  call_log);
-		setCall("exp",  call_exp);
-		setCall("sin",  call_sin);
-		setCall("cos",  call_cos);
-		setCall("tan",  call_tan);
-		setCall("asin", call_asin);
-		setCall("acos", call_acos);
-		setCall("atan", call_atan);
+		setCall("ln",    ExprCalls::call_ln, EXPR_CALL_PURE | EXPR_CALL_ARITY(1));
+		setCall("log",   ExprCalls::call_log, EXPR_CALL_PURE | EXPR_CALL_ARITY(1));
+		setCall("exp",   ExprCalls::call_exp, EXPR_CALL_PURE | EXPR_CALL_ARITY(1));
+		setCall("sin",   ExprCalls::call_sin, EXPR_CALL_PURE | EXPR_CALL_ARITY(1));
+		setCall("cos",   ExprCalls::call_cos, EXPR_CALL_PURE | EXPR_CALL_ARITY(1));
+		setCall("tan",   ExprCalls::call_tan, EXPR_CALL_PURE | EXPR_CALL_ARITY(1));
+		setCall("asin",  ExprCalls::call_asin, EXPR_CALL_PURE | EXPR_CALL_ARITY(1));
+		setCall("acos",  ExprCalls::call_acos, EXPR_CALL_PURE | EXPR_CALL_ARITY(1));
+		setCall("atan",  ExprCalls::call_atan, EXPR_CALL_PURE | EXPR_CALL_ARITY(1));
+		setCall("min",   ExprCalls::call_min, EXPR_CALL_PURE | EXPR_CALL_ARITY(2));
+		setCall("max",   ExprCalls::call_max, EXPR_CALL_PURE | EXPR_CALL_ARITY(2));
+		setCall("clamp", ExprCalls::call_clamp, EXPR_CALL_PURE | EXPR_CALL_ARITY(3));
+		setCall("if",    ExprCalls::call_if, EXPR_CALL_PURE | EXPR_CALL_ARITY(3));
 	}
 	std::vector <std::string> nullVars() {
-		std::map <std::string, bool> map;
 		std::vector <std::string> array;
-		if (parsedTree) parsedTree->addVarsToMap(map);
-		for (auto it=map.begin(), end=map.end(); it!=end; ++it) {
-			if (!it->second) array.push_back(it->first);
-		}
+		for (const ExprSymbol* symbol : nullSymbols()) array.push_back(symbol->id);
 		return array;
 	}
+	// Funções chamadas sem definição ou com uma quantidade de argumentos que ela não aceita
 	std::vector <std::string> nullCalls() {
-		std::map <std::string, bool> map;
-		std::vector <std::string> array;
-		if (parsedTree) parsedTree->addCallsToMap(map);
-		for (auto it=map.begin(), end=map.end(); it!=end; ++it) {
-			if (!it->second) array.push_back(it->first);
+		std::vector <ExprSymbol*> list;
+		if (parsedTree) {
+			for (ExprSymbol* symbol : symbolList) {
+				if (symbol->isCall && !(symbol->accepts(symbol->minArgs) &&
+					symbol->accepts(symbol->maxArgs))) {
+					list.push_back(symbol);
+				}
+			}
 		}
+		std::sort(list.begin(), list.end(), byId);
+		std::vector <std::string> array;
+		for (const ExprSymbol* symbol : list) array.push_back(symbol->id);
 		return array;
 	}
 	int countNullVars() {
-		std::map <std::string, bool> map;
-		if (parsedTree) parsedTree->addVarsToMap(map);
 		int n = 0;
-		for (auto it=map.begin(), end=map.end(); it!=end; ++it) {
-			n += !it->second;
+		if (!parsedTree) return 0;
+		for (const ExprSymbol* symbol : symbolList) {
+			n += symbol->isVar && symbol->type == '\0';
 		}
 		return n;
 	}
 	double calc() {
 		return parsedTree ? parsedTree->calc() : 0;
 	}
+	// Simplifica a árvore: avalia sub-árvores constantes (incluindo variáveis definidas por valor
+	// e funções puras com argumentos constantes) e elimina operações neutras. As definições feitas
+	// depois disso não alcançam as variáveis e chamadas já avaliadas
+	void optimize(int flags = 0) {
+		parsedTree = ExprNode::fold(parsedTree, arena, flags);
+	}
+	// Cópia simplificada da árvore, usada na compilação: a árvore do parser continua lendo as
+	// definições atuais, de forma que um novo setVar vale para a próxima compilação e para calc.
+	// A cópia fica em scratch, da chamada que compila, e é descartada com ele depois de ir para o
+	// grafo: compilar várias vezes a mesma expressão não acumula memória no parser
+	ExprNode* optimized(int flags, ExprArena &scratch) {
+		return ExprNode::fold(ExprNode::copy(parsedTree, scratch), scratch, flags);
+	}
 	std::string toString() {
 		if (success()) return parsedTree->toString();
 		return "error!";
 	}
-	Expr toExpr() {
-		std::map<std::string, bool> map;
-		parsedTree->addVarsToMap(map);
-		int n = parsedTree->countArgs();
-		for (auto it=map.begin(), end=map.end(); it!=end; ++it) {
-			if (!it->second) parsedTree->setArg(it->first, n++);
+	// Os argumentos são atribuídos antes da simplificação, de forma que a posição de cada
+	// variável não dependa de flags
+	Expr toExpr(int flags = 0) {
+		if (!parsedTree) return Expr(nullptr);
+		setNullArgs();
+		ExprArena scratch;
+		return Expr(optimized(flags, scratch), flags);
+	}
+	// Compila o valor da expressão e seu gradiente em relação a todos os argumentos: a saída 0 é
+	// o valor e a saída 1 + i é a derivada em relação ao argumento i. Variáveis definidas por
+	// referência são tratadas como constantes. Inválido se alguma função chamada não for padrão
+	// nem tiver derivada em derivs
+	ExprMulti toGrad(const ExprDerivs &derivs = ExprDerivs(), int mode = EXPR_DIFF_REVERSE,
+		int flags = 0) {
+		if (!parsedTree) return ExprMulti(std::vector <ExprNode*> (1, nullptr));
+		int nArgs = setNullArgs();
+		ExprDag dag(flags);
+		ExprArena scratch;
+		int root = optimized(flags, scratch)->addToDag(dag);
+		ExprDiff diff(dag, derivs);
+		std::vector <int> grad = mode == EXPR_DIFF_FORWARD ? diff.forward(root, nArgs) :
+			diff.reverse(root, nArgs);
+		if (!diff.valid()) return ExprMulti(std::vector <ExprNode*> (nArgs + 1, nullptr));
+		std::vector <int> roots(1, root);
+		roots.insert(roots.end(), grad.begin(), grad.end());
+		return ExprMulti(dag, roots);
+	}
+	// Compila as expressões de vários parsers em um único programa, com uma saída por parser. As
+	// variáveis livres recebem a mesma posição em todas as expressões: depois do maior argumento
+	// já definido, em ordem alfabética
+	static ExprMulti toMulti(const std::vector <ExprParser*> &parsers, int flags = 0) {
+		std::vector <std::vector <ExprSymbol*> > unbound(parsers.size());
+		std::map <std::string, int> args;
+		int n = 0;
+		for (size_t i=0; i<parsers.size(); ++i) {
+			if (!parsers[i]->parsedTree) continue;
+			unbound[i] = parsers[i]->nullSymbols();
+			n = std::max(n, parsers[i]->countArgs());
+			for (const ExprSymbol* symbol : unbound[i]) args[symbol->id] = 0;
+		}
+		for (auto it=args.begin(), end=args.end(); it!=end; ++it) it->second = n++;
+		// Uma variável só vira argumento nas expressões em que ainda estiver livre
+		for (size_t i=0; i<parsers.size(); ++i) {
+			for (ExprSymbol* symbol : unbound[i]) {
+				symbol->type = 'a';
+				symbol->index = args[symbol->id];
+			}
+		}
+		ExprArena scratch;
+		std::vector <ExprNode*> trees;
+		for (ExprParser* parser : parsers) {
+			trees.push_back(parser->parsedTree ? parser->optimized(flags, scratch) : nullptr);
+		}
+		return ExprMulti(trees, flags);
+	}
+};
+
+// ---------------------------------------------------------------------------------------------- //
+// Conjunto de definições (setArg, setVar, setCall e std) aplicado a uma expressão depois do      //
+// parsing, com uma chave textual que o identifica                                                //
+// ---------------------------------------------------------------------------------------------- //
+class ExprBindings {
+private:
+	struct Binding {
+		char type; // 's': std(); 'a': setArg; 'v': setVar por valor; 'r': setVar por referência;
+		// 'p': setParam; 'c': setCall; 'b': setCall com função em lote
+		std::string id;
+		int index; // 'a': índice do argumento; 'c' e 'b': flags
+		double value;
+		void* ref; // 'r': endereço da variável; 'c' e 'b': função
+	};
+	std::vector <Binding> list;
+	std::string keyStr;
+	void add(char type, const std::string &id, int index, double value, void* ref) {
+		Binding binding = {type, id, index, value, ref};
+		list.push_back(binding);
+		keyStr += type;
+		keyStr.append((const char*) &index, sizeof(int));
+		keyStr.append((const char*) &value, sizeof(double));
+		keyStr.append((const char*) &ref, sizeof(void*));
+		keyStr += id;
+		keyStr += '\0';
+	}
+public:
+	ExprBindings& std() {
+		add('s', "", 0, 0, nullptr);
+		return *this;
+	}
+	ExprBindings& setArg(std::string id, int index) {
+		add('a', id, index, 0, nullptr);
+		return *this;
+	}
+	ExprBindings& setVar(std::string id, double value) {
+		add('v', id, 0, value, nullptr);
+		return *this;
+	}
+	ExprBindings& setVar(std::string id, double* ref) {
+		add('r', id, 0, 0, ref);
+		return *this;
+	}
+	ExprBindings& setParam(std::string id, double value) {
+		add('p', id, 0, value, nullptr);
+		return *this;
+	}
+	ExprBindings& setCall(std::string id, TExprFunction ref, int flags = 0) {
+		add('c', id, flags, 0, (void*) ref);
+		return *this;
+	}
+	ExprBindings& setCall(std::string id, TExprBatchFunction ref, int flags = 0) {
+		add('b', id, flags, 0, (void*) ref);
+		return *this;
+	}
+	// Aplica as definições, na ordem em que foram feitas
+	void apply(ExprParser &parser) const {
+		for (const Binding &binding : list) {
+			switch (binding.type) {
+				case 's': parser.std(); break;
+				case 'a': parser.setArg(binding.id, binding.index); break;
+				case 'v': parser.setVar(binding.id, binding.value); break;
+				case 'r': parser.setVar(binding.id, (double*) binding.ref); break;
+				case 'p': parser.setParam(binding.id, binding.value); break;
+				case 'c': parser.setCall(binding.id, (TExprFunction) binding.ref, binding.index); break;
+				case 'b':
+					parser.setCall(binding.id, (TExprBatchFunction) binding.ref, binding.index);
+				break;
+			}
+		}
+	}
+	const std::string& key() const {
+		return keyStr;
+	}
+	// Endereço da variável por referência ('r') ou da função ('c' ou 'b') definida com o nome id,
+	// ou nullptr; vale a última definição, como em apply
+	const void* find(char type, const std::string &id) const {
+		for (auto it=list.rbegin(); it!=list.rend(); ++it) {
+			if (it->type == type && it->id == id) return it->ref;
+		}
+		return nullptr;
+	}
+};
+
+// ---------------------------------------------------------------------------------------------- //
+// Cache LRU das expressões compiladas, indexado pelo texto da expressão, pelas definições e      //
+// pelas flags de toExpr. Pode ser consultado por várias threads: as entradas ficam divididas em  //
+// shards, cada um com seu próprio mutex e sua própria lista LRU                                  //
+// ---------------------------------------------------------------------------------------------- //
+class ExprCache {
+public:
+	struct Stats {
+		unsigned long long hits;
+		unsigned long long misses;
+		unsigned long long evictions;
+		size_t size;
+	};
+private:
+	typedef std::pair <std::string, std::shared_ptr <const Expr> > TEntry;
+	struct Shard {
+		std::mutex mutex;
+		std::list <TEntry> lru; // Mais recente no início
+		std::unordered_map <std::string, std::list <TEntry>::iterator> map;
+		size_t capacity;
+		unsigned long long hits;
+		unsigned long long misses;
+		unsigned long long evictions;
+	};
+	std::vector <Shard> shards;
+	static std::string key(const std::string &src, const ExprBindings &bindings, int flags) {
+		std::string str;
+		str.reserve(src.size() + bindings.key().size() + sizeof(int) + 1);
+		str.append((const char*) &flags, sizeof(int));
+		str += src;
+		str += '\0';
+		str += bindings.key();
+		return str;
+	}
+public:
+	// capacity: quantidade máxima de expressões, dividida entre os shards; a sobra da divisão fica
+	// com os primeiros. Com capacity menor que nShards, há um shard por expressão
+	ExprCache(size_t capacity, int nShards = 16):
+		shards(std::max <size_t> (1, std::min <size_t> (nShards > 0 ? nShards : 1, capacity))) {
+		for (size_t i=0; i<shards.size(); ++i) {
+			Shard &shard = shards[i];
+			shard.capacity = capacity / shards.size() + (i < capacity % shards.size());
+			shard.hits = 0;
+			shard.misses = 0;
+			shard.evictions = 0;
+		}
+	}
+	ExprCache(const ExprCache&) = delete;
+	ExprCache& operator=(const ExprCache&) = delete;
+	// Devolve a expressão compilada, fazendo o parsing e a compilação só na primeira vez. A
+	// expressão é compartilhada e continua válida mesmo depois de sair do cache. Expressões
+	// inválidas também ficam no cache
+	std::shared_ptr <const Expr> get(const std::string &src, const ExprBindings &bindings,
+		int flags = 0) {
+		std::string str = key(src, bindings, flags);
+		Shard &shard = shards[std::hash<std::string>()(str) % shards.size()];
+		{
+			std::lock_guard <std::mutex> lock(shard.mutex);
+			auto it = shard.map.find(str);
+			if (it != shard.map.end()) {
+				++ shard.hits;
+				shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+				return it->second->second;
+			}
+			++ shard.misses;
+		}
+		// A compilação é feita fora do lock, sem bloquear as consultas ao mesmo shard
+		ExprParser parser;
+		parser.parse(src);
+		bindings.apply(parser);
+		std::shared_ptr <const Expr> expr = std::make_shared <const Expr> (parser.toExpr(flags));
+		std::lock_guard <std::mutex> lock(shard.mutex);
+		auto it = shard.map.find(str);
+		if (it != shard.map.end()) { // Compilada por outra thread nesse meio-tempo
+			shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+			return it->second->second;
+		}
+		shard.lru.push_front(TEntry(str, expr));
+		shard.map[str] = shard.lru.begin();
+		if (shard.lru.size() > shard.capacity) {
+			shard.map.erase(shard.lru.back().first);
+			shard.lru.pop_back();
+			++ shard.evictions;
+		}
+		return expr;
+	}
+	std::shared_ptr <const Expr> get(const std::string &src, int flags = 0) {
+		return get(src, ExprBindings(), flags);
+	}
+	Stats stats() {
+		Stats res = {0, 0, 0, 0};
+		for (Shard &shard : shards) {
+			std::lock_guard <std::mutex> lock(shard.mutex);
+			res.hits += shard.hits;
+			res.misses += shard.misses;
+			res.evictions += shard.evictions;
+			res.size += shard.lru.size();
+		}
+		return res;
+	}
+	void clear() {
+		for (Shard &shard : shards) {
+			std::lock_guard <std::mutex> lock(shard.mutex);
+			shard.lru.clear();
+			shard.map.clear();
+		}
+	}
+};
+
+// ---------------------------------------------------------------------------------------------- //
+// Biblioteca de expressões compiladas, gravada em um arquivo que pode ser mapeado em memória e   //
+// consultado sem parsing nem compilação. Cada expressão tem um nome e é guardada no formato de   //
+// ExprBytecode::save: as variáveis por referência e as funções do usuário são resolvidas por     //
+// nome, com um ExprBindings, quando a expressão é carregada                                      //
+// ---------------------------------------------------------------------------------------------- //
+// Formato (inteiros e doubles na ordem de bytes da máquina que gravou o arquivo):
+//   "EXPRLIB\0"                     8 bytes
+//   0x01020304, versão              dois inteiros de 32 bits; o primeiro indica a ordem de bytes
+//   expressões, tamanho do arquivo  dois inteiros de 64 bits
+//   índice                          por expressão, em ordem de nome: posição do nome, posição e
+//                                   tamanho dos dados, três inteiros de 64 bits
+//   nomes e dados                   nomes terminados em '\0'; os dados começam com 'e' (Expr) ou
+//                                   'm' (ExprMulti), seguido do bytecode serializado
+// A abertura só verifica o cabeçalho: cada expressão é validada quando carregada
+#if defined(__unix__) || defined(__APPLE__)
+#define EXPR_LIBRARY_MMAP
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+// Versão 2: instruções combinadas (MULADD, POWI, SQRT, ADDC...); versão 3: comparações, MIN, MAX e
+// SELECT; versão 4: funções em lote (BCALL). Arquivos das versões anteriores continuam legíveis
+#define EXPR_LIBRARY_VERSION 4
+#define EXPR_LIBRARY_HEADER 32
+#define EXPR_LIBRARY_ENTRY 24
+
+class ExprLibraryWriter {
+private:
+	std::map <std::string, std::vector <unsigned char> > entries;
+	bool add(const std::string &name, char kind, const ExprBytecode &bytecode) {
+		std::vector <unsigned char> data(1, kind);
+		if (name.find('\0') != std::string::npos || !bytecode.save(data)) return false;
+		entries[name].swap(data);
+		return true;
+	}
+	static void put(std::vector <unsigned char> &out, size_t pos, const void* value, size_t size) {
+		memcpy(out.data() + pos, value, size);
+	}
+public:
+	// Acrescenta ou substitui a expressão com esse nome. Falso se ela for inválida ou tiver uma
+	// variável por referência ou função do usuário sem nome
+	bool add(const std::string &name, const Expr &expr) {
+		return expr.valid() && add(name, 'e', expr.getBytecode());
+	}
+	bool add(const std::string &name, const ExprMulti &multi) {
+		return multi.valid() && add(name, 'm', multi.getBytecode());
+	}
+	size_t size() const {
+		return entries.size();
+	}
+	void save(std::vector <unsigned char> &out) const {
+		uint64_t count = entries.size();
+		out.assign(EXPR_LIBRARY_HEADER + count * EXPR_LIBRARY_ENTRY, 0);
+		memcpy(out.data(), "EXPRLIB", 8);
+		uint32_t order = 0x01020304, version = EXPR_LIBRARY_VERSION;
+		put(out, 8, &order, 4);
+		put(out, 12, &version, 4);
+		put(out, 16, &count, 8);
+		size_t pos = EXPR_LIBRARY_HEADER;
+		for (auto &entry : entries) {
+			uint64_t offsets[3] = {out.size(), out.size() + entry.first.size() + 1,
+				entry.second.size()};
+			put(out, pos, offsets, sizeof(offsets));
+			pos += EXPR_LIBRARY_ENTRY;
+			out.insert(out.end(), entry.first.begin(), entry.first.end());
+			out.push_back(0);
+			out.insert(out.end(), entry.second.begin(), entry.second.end());
+		}
+		uint64_t size = out.size();
+		put(out, 24, &size, 8);
+	}
+	bool save(const char* path) const {
+		std::vector <unsigned char> out;
+		save(out);
+		FILE* file = fopen(path, "wb");
+		if (!file) return false;
+		bool ok = fwrite(out.data(), 1, out.size(), file) == out.size();
+		return fclose(file) == 0 && ok;
+	}
+};
+
+class ExprLibrary {
+private:
+	const unsigned char* data;
+	size_t length;
+	uint64_t count;
+	bool mapped;
+	std::vector <unsigned char> buffer; // Conteúdo do arquivo, onde não houver mmap
+	uint64_t read(size_t pos) const {
+		uint64_t value;
+		memcpy(&value, data + pos, sizeof(value));
+		return value;
+	}
+	const char* entryName(size_t index) const {
+		uint64_t pos = read(EXPR_LIBRARY_HEADER + index * EXPR_LIBRARY_ENTRY);
+		if (pos >= length || !memchr(data + pos, 0, length - pos)) return "";
+		return (const char*) data + pos;
+	}
+	// Carrega o bytecode da expressão index, que precisa ser do tipo kind
+	bool load(long index, char kind, const ExprBindings &bindings, ExprBytecode &bytecode) const {
+		if (index < 0 || (uint64_t) index >= count) return false;
+		size_t entry = EXPR_LIBRARY_HEADER + index * EXPR_LIBRARY_ENTRY;
+		uint64_t pos = read(entry + 8), size = read(entry + 16);
+		if (pos >= length || size > length - pos || size == 0 || data[pos] != kind) return false;
+		bool ok = bytecode.load(data + pos + 1, size - 1, [&](char type, const std::string &id) {
+			return bindings.find(type, id);
+		});
+		return ok && (kind == 'm') == (bytecode.outCount() > 0);
+	}
+public:
+	ExprLibrary() {
+		data = nullptr;
+		length = 0;
+		count = 0;
+		mapped = false;
+	}
+	ExprLibrary(const ExprLibrary&) = delete;
+	ExprLibrary& operator=(const ExprLibrary&) = delete;
+	~ExprLibrary() {
+		close();
+	}
+	void close() {
+#ifdef EXPR_LIBRARY_MMAP
+		if (mapped) munmap((void*) data, length);
+#endif
+		std::vector <unsigned char> ().swap(buffer);
+		data = nullptr;
+		length = 0;
+		count = 0;
+		mapped = false;
+	}
+	// Usa a biblioteca em data, sem cópia: a memória precisa continuar válida enquanto ela for
+	// usada. Falso se o cabeçalho for inválido
+	bool open(const void* data, size_t size) {
+		close();
+		const unsigned char* ptr = (const unsigned char*) data;
+		uint32_t order, version;
+		uint64_t values[2];
+		if (size < EXPR_LIBRARY_HEADER || memcmp(ptr, "EXPRLIB", 8) != 0) return false;
+		memcpy(&order, ptr + 8, 4);
+		memcpy(&version, ptr + 12, 4);
+		memcpy(values, ptr + 16, sizeof(values));
+		if (order != 0x01020304 || version < 1 || version > EXPR_LIBRARY_VERSION ||
+			values[1] != size || values[0] > (size - EXPR_LIBRARY_HEADER) / EXPR_LIBRARY_ENTRY) {
+			return false;
+		}
+		this->data = ptr;
+		length = size;
+		count = values[0];
+		return true;
+	}
+	// Mapeia o arquivo em memória (ou o lê inteiro, onde não houver mmap): as páginas só são lidas
+	// quando usadas, de forma que abrir uma biblioteca grande é imediato
+	bool open(const char* path) {
+		close();
+#ifdef EXPR_LIBRARY_MMAP
+		int fd = ::open(path, O_RDONLY);
+		if (fd < 0) return false;
+		struct stat st;
+		void* ptr = MAP_FAILED;
+		if (fstat(fd, &st) == 0 && st.st_size > 0) {
+			ptr = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		}
+		::close(fd);
+		if (ptr == MAP_FAILED) return false;
+		if (!open(ptr, st.st_size)) {
+			munmap(ptr, st.st_size);
+			return false;
+		}
+		mapped = true;
+		return true;
+#else
+		FILE* file = fopen(path, "rb");
+		if (!file) return false;
+		std::vector <unsigned char> content;
+		unsigned char chunk[65536];
+		size_t n;
+		while ((n = fread(chunk, 1, sizeof(chunk), file)) > 0) {
+			content.insert(content.end(), chunk, chunk + n);
+		}
+		fclose(file);
+		if (!open(content.data(), content.size())) return false;
+		buffer.swap(content);
+		return true;
+#endif
+	}
+	bool isOpen() const {
+		return data != nullptr;
+	}
+	size_t size() const {
+		return count;
+	}
+	std::string name(size_t index) const {
+		return entryName(index);
+	}
+	// Posição da expressão com esse nome (busca binária no índice), ou -1
+	long find(const std::string &name) const {
+		size_t lo = 0, hi = count;
+		while (lo < hi) {
+			size_t mid = lo + (hi - lo) / 2;
+			int cmp = strcmp(entryName(mid), name.c_str());
+			if (cmp == 0) return mid;
+			if (cmp < 0) {
+				lo = mid + 1;
+			} else {
+				hi = mid;
+			}
+		}
+		return -1;
+	}
+	// Expressão com esse nome, com as variáveis por referência e funções do usuário tomadas de
+	// bindings; inválida se não existir, não for uma Expr ou tiver um símbolo não definido
+	Expr get(const std::string &name, const ExprBindings &bindings = ExprBindings()) const {
+		return get(find(name), bindings);
+	}
+	Expr get(long index, const ExprBindings &bindings = ExprBindings()) const {
+		ExprBytecode bytecode;
+		if (!load(index, 'e', bindings, bytecode)) return Expr(nullptr);
+		return Expr(bytecode);
+	}
+	// Programa com esse nome, como em get; inválido (com uma saída) se não puder ser carregado
+	ExprMulti getMulti(const std::string &name,
+		const ExprBindings &bindings = ExprBindings()) const {
+		ExprBytecode bytecode;
+		if (!load(find(name), 'm', bindings, bytecode)) {
+			return ExprMulti(std::vector <ExprNode*> (1, nullptr));
+		}
+		return ExprMulti(bytecode);
+	}
+};
+
+// ---------------------------------------------------------------------------------------------- //
+// Front end em tempo de compilação: a expressão, com a mesma gramática de ExprParser, é lida     //
+// por funções constexpr e vira um tipo, cujo cálculo é código comum que o compilador otimiza e   //
+// vetoriza. Como depois de ExprParser::std, PI e E são constantes e só há as funções padrão (as  //
+// de um argumento: min, max, clamp e if ficam de fora); as variáveis são os argumentos, em ordem //
+// alfabética                                                                                     //
+// ---------------------------------------------------------------------------------------------- //
+// O texto precisa ser um array constexpr com linkage (por exemplo, em escopo de namespace):
+//     constexpr char formula[] = "a*x^3+b*x^2+c*x+d";
+//     double y = ExprStatic<formula>::calc(args);
+// Erros de sintaxe são erros de compilação. A profundidade de recursão constexpr do compilador
+// limita o texto a algumas centenas de caracteres
+
+// Mantissa de um número: até 19 dígitos significativos e o expoente que compensa os demais
+struct ExprStaticMantissa {
+	unsigned long long value;
+	int digits;
+	int exp10;
+	constexpr ExprStaticMantissa(unsigned long long value, int digits, int exp10):
+		value(value), digits(digits), exp10(exp10) {}
+};
+
+// Funções de leitura do texto, todas constexpr (e no formato de C++11: um único return)
+class ExprStaticScan {
+public:
+	static constexpr bool isSpace(char chr) {
+		return chr == ' ' || chr == '\t' || chr == '\n';
+	}
+	static constexpr bool isDigit(char chr) {
+		return chr >= '0' && chr <= '9';
+	}
+	static constexpr bool isIdHead(char chr) {
+		return chr == '_' || ((chr | 32) >= 'a' && (chr | 32) <= 'z');
+	}
+	static constexpr bool isIdBody(char chr) {
+		return isIdHead(chr) || isDigit(chr);
+	}
+	static constexpr int skip(const char* s, int p) {
+		return isSpace(s[p]) ? skip(s, p + 1) : p;
+	}
+	static constexpr int length(const char* s, int p) {
+		return s[p] ? length(s, p + 1) : p;
+	}
+	static constexpr int digitsEnd(const char* s, int p) {
+		return isDigit(s[p]) ? digitsEnd(s, p + 1) : p;
+	}
+	static constexpr int idEnd(const char* s, int p) {
+		return isIdBody(s[p]) ? idEnd(s, p + 1) : p;
+	}
+	// Fim do expoente (e, E, com sinal opcional) que começa em p, ou p se não houver
+	static constexpr int expEnd(const char* s, int p) {
+		return (s[p] | 32) == 'e' && (isDigit(s[p + 1]) ||
+			((s[p + 1] == '+' || s[p + 1] == '-') && isDigit(s[p + 2]))) ?
+			digitsEnd(s, p + (isDigit(s[p + 1]) ? 1 : 2)) : p;
+	}
+	static constexpr int fracEnd(const char* s, int p) {
+		return s[p] != '.' ? expEnd(s, p) : isDigit(s[p + 1]) ? expEnd(s, digitsEnd(s, p + 1)) :
+			-1;
+	}
+	// Fim do número que começa em p, ou -1 se ele for inválido
+	static constexpr int numEnd(const char* s, int p) {
+		return fracEnd(s, digitsEnd(s, p));
+	}
+	static constexpr ExprStaticMantissa addDigit(ExprStaticMantissa m, char chr, bool frac) {
+		return m.digits < 19 ? ExprStaticMantissa(m.value * 10 + (chr - '0'),
+			m.digits + (m.value * 10 + (chr - '0') != 0), m.exp10 - frac) :
+			ExprStaticMantissa(m.value, m.digits, m.exp10 + !frac);
+	}
+	static constexpr ExprStaticMantissa mantissa(const char* s, int p, ExprStaticMantissa m,
+		bool frac) {
+		return isDigit(s[p]) ? mantissa(s, p + 1, addDigit(m, s[p], frac), frac) :
+			s[p] == '.' ? mantissa(s, p + 1, m, true) : m;
+	}
+	static constexpr int expValue(const char* s, int p, int value) {
+		return isDigit(s[p]) ? expValue(s, p + 1, value < 100000 ? value * 10 + (s[p] - '0') :
+			value) : value;
+	}
+	// Expoente escrito no texto, a partir do fim da mantissa
+	static constexpr int exponent(const char* s, int p) {
+		return (s[p] | 32) != 'e' ? 0 : s[p + 1] == '-' ? - expValue(s, p + 2, 0) :
+			expValue(s, p + (s[p + 1] == '+' ? 2 : 1), 0);
+	}
+	static constexpr double pow10(int n) {
+		return n == 0 ? 1 : n > 22 ? 1e22 * pow10(n - 22) : 10 * pow10(n - 1);
+	}
+	// m * 10^exp10. Abaixo de 10^-308 a potência não cabe em um double e a divisão é feita em
+	// etapas, para que os subnormais não virem 0; acima de DBL_MAX o resultado é infinito, como em
+	// strtod, sem a multiplicação que estoura (e que não seria uma expressão constante)
+	static constexpr double scale(unsigned long long m, int exp10) {
+		return m == 0 || exp10 < -350 ? 0 : exp10 < -308 ? scale(m, exp10 + 22) / 1e22 :
+			exp10 < 0 ? m / pow10(- exp10) : exp10 > 308 || m > DBL_MAX / pow10(exp10) ?
+			INFINITY : m * pow10(exp10);
+	}
+	static constexpr int mantissaEnd(const char* s, int p) {
+		return isDigit(s[p]) || s[p] == '.' ? mantissaEnd(s, p + 1) : p;
+	}
+	// Valor do número que começa em p: igual ao de ExprParser quando a mantissa cabe em 2^53 e o
+	// expoente tem até 22, e com poucos ulps de diferença nos demais casos (inclusive subnormais)
+	static constexpr double number(const char* s, int p) {
+		return scale(mantissa(s, p, ExprStaticMantissa(0, 0, 0), false).value,
+			mantissa(s, p, ExprStaticMantissa(0, 0, 0), false).exp10 +
+			exponent(s, mantissaEnd(s, p)));
+	}
+	// Compara o identificador em p com a string literal lit
+	static constexpr bool equals(const char* s, int p, const char* lit) {
+		return !isIdBody(s[p]) ? !*lit : s[p] == *lit && equals(s, p + 1, lit + 1);
+	}
+	static constexpr bool same(const char* s, int p, int q) {
+		return !isIdBody(s[p]) ? !isIdBody(s[q]) : s[p] == s[q] && same(s, p + 1, q + 1);
+	}
+	// Ordem de strcmp entre os identificadores em p e q
+	static constexpr bool less(const char* s, int p, int q) {
+		return !isIdBody(s[q]) ? false : !isIdBody(s[p]) ? true :
+			s[p] != s[q] ? (unsigned char) s[p] < (unsigned char) s[q] : less(s, p + 1, q + 1);
+	}
+	// Índice da função padrão com o nome em p, ou -1
+	static constexpr int function(const char* s, int p) {
+		return equals(s, p, "ln") ? 0 : equals(s, p, "log") ? 1 : equals(s, p, "exp") ? 2 :
+			equals(s, p, "sin") ? 3 : equals(s, p, "cos") ? 4 : equals(s, p, "tan") ? 5 :
+			equals(s, p, "asin") ? 6 : equals(s, p, "acos") ? 7 : equals(s, p, "atan") ? 8 : -1;
+	}
+	// Índice da constante padrão com o nome em p (0: PI, 1: E), ou -1
+	static constexpr int constant(const char* s, int p) {
+		return equals(s, p, "PI") ? 0 : equals(s, p, "E") ? 1 : -1;
+	}
+	// Verdadeiro se em p começa uma variável: um identificador fora de um número, que não é
+	// chamado nem é uma constante padrão
+	static constexpr bool isVar(const char* s, int p) {
+		return isIdHead(s[p]) && (p == 0 || (!isIdBody(s[p - 1]) && s[p - 1] != '.')) &&
+			s[skip(s, idEnd(s, p))] != '(' && constant(s, p) < 0;
+	}
+	// Posição da primeira variável em [p, fim do texto), ou -1
+	static constexpr int nextVar(const char* s, int p) {
+		return !s[p] ? -1 : isVar(s, p) ? p : nextVar(s, p + 1);
+	}
+	// Tipo do termo que começa em p: 0 número, 1 identificador, 2 parênteses, 3 módulo, -1 erro
+	static constexpr int term(const char* s, int p) {
+		return isDigit(s[p]) ? 0 : isIdHead(s[p]) ? 1 : s[p] == '(' ? 2 : s[p] == '|' ? 3 : -1;
+	}
+	// Comparação em p (0: <, 1: <=, 2: >, 3: >=, 4: ==, 5: !=), ou -1
+	static constexpr int comparison(const char* s, int p) {
+		return s[p] == '<' ? (s[p + 1] == '=' ? 1 : 0) : s[p] == '>' ? (s[p + 1] == '=' ? 3 : 2) :
+			s[p] == '=' ? (s[p + 1] == '=' ? 4 : -1) : s[p] == '!' ? (s[p + 1] == '=' ? 5 : -1) : -1;
+	}
+};
+
+// Primeira ocorrência de cada variável distinta, na ordem do texto
+template <int... Q> struct ExprStaticVarList;
+template <> struct ExprStaticVarList <> {
+	static constexpr int size = 0;
+	static constexpr bool has(const char*, int) {
+		return false;
+	}
+	static constexpr int before(const char*, int) {
+		return 0;
+	}
+};
+template <int Q, int... R> struct ExprStaticVarList <Q, R...> {
+	static constexpr int size = 1 + sizeof...(R);
+	// Verdadeiro se a variável em p está na lista
+	static constexpr bool has(const char* s, int p) {
+		return ExprStaticScan::same(s, Q, p) || ExprStaticVarList <R...>::has(s, p);
+	}
+	// Quantidade de variáveis da lista menores que a variável em p: seu índice de argumento
+	static constexpr int before(const char* s, int p) {
+		return ExprStaticScan::less(s, Q, p) + ExprStaticVarList <R...>::before(s, p);
+	}
+};
+// Lista das variáveis do texto, montada em uma única passada a partir da variável em P (ou do fim,
+// se P é -1). Cada texto instancia a lista uma vez, consultada por todas as suas variáveis
+template <const char* S, int P = ExprStaticScan::nextVar(S, 0), class L = ExprStaticVarList <>,
+	bool End = (P < 0)> struct ExprStaticVars {
+	typedef L Type;
+};
+template <const char* S, int P, int... Q> struct ExprStaticVars <S, P, ExprStaticVarList <Q...>,
+	false>: ExprStaticVars <S, ExprStaticScan::nextVar(S, ExprStaticScan::idEnd(S, P)),
+	typename std::conditional <ExprStaticVarList <Q...>::has(S, P), ExprStaticVarList <Q...>,
+	ExprStaticVarList <Q..., P> >::type> {};
+
+// Nós da árvore. ok é falso se a sub-árvore tem um erro de sintaxe; calc recebe um acesso aos
+// argumentos, args(i)
+template <int I> struct ExprStaticArg {
+	static constexpr bool ok = true;
+	template <class A> static double calc(const A &args) {
+		return args(I);
+	}
+};
+template <const char* S, int P> struct ExprStaticNum {
+	static constexpr bool ok = true;
+	static constexpr double value = ExprStaticScan::number(S, P);
+	template <class A> static double calc(const A &) {
+		return value;
+	}
+};
+template <int K> struct ExprStaticStd {
+	static constexpr bool ok = true;
+	template <class A> static double calc(const A &) {
+		return K == 0 ? 3.1415926535897932384626433832795028841972 :
+			2.7182818284590452353602874713526624977572;
+	}
+};
+template <class T> struct ExprStaticNeg {
+	static constexpr bool ok = T::ok;
+	template <class A> static double calc(const A &args) {
+		return - T::calc(args);
+	}
+};
+template <class T> struct ExprStaticAbs {
+	static constexpr bool ok = T::ok;
+	template <class A> static double calc(const A &args) {
+		double value = T::calc(args);
+		return value >= 0 ? value : - value;
+	}
+};
+template <char C, class L, class R> struct ExprStaticOpr {
+	static constexpr bool ok = L::ok && R::ok;
+	template <class A> static double calc(const A &args) {
+		switch (C) {
+			case '+': return L::calc(args) + R::calc(args);
+			case '-': return L::calc(args) - R::calc(args);
+			case '*': return L::calc(args) * R::calc(args);
+			case '/': return L::calc(args) / R::calc(args);
+		}
+		return pow(L::calc(args), R::calc(args));
+	}
+};
+template <int F, class T> struct ExprStaticCall {
+	static constexpr bool ok = T::ok;
+	template <class A> static double calc(const A &args) {
+		double value = T::calc(args);
+		switch (F) {
+			case 0: return log(value);
+			case 1: return log10(value);
+			case 2: return exp(value);
+			case 3: return sin(value);
+			case 4: return cos(value);
+			case 5: return tan(value);
+			case 6: return asin(value);
+			case 7: return acos(value);
+		}
+		return atan(value);
+	}
+};
+template <int K, class L, class R> struct ExprStaticCmp {
+	static constexpr bool ok = L::ok && R::ok;
+	template <class A> static double calc(const A &args) {
+		double a = L::calc(args), b = R::calc(args);
+		switch (K) {
+			case 0: return a < b;
+			case 1: return a <= b;
+			case 2: return a > b;
+			case 3: return a >= b;
+			case 4: return a == b;
+		}
+		return a != b;
+	}
+};
+// Os dois ramos são calculados, como no bytecode, e a escolha não tem desvio
+template <class C, class L, class R> struct ExprStaticSelect {
+	static constexpr bool ok = C::ok && L::ok && R::ok;
+	template <class A> static double calc(const A &args) {
+		double c = C::calc(args), a = L::calc(args), b = R::calc(args);
+		return c != 0 ? a : b;
+	}
+};
+struct ExprStaticError {
+	static constexpr bool ok = false;
+	template <class A> static double calc(const A &) {
+		return 0;
+	}
+};
+
+// Análise sintática: cada regra expõe o tipo lido (Type) e a posição seguinte (end), já depois
+// dos espaços. Os laços de operadores são regras *Rest, especializadas pelo caractere seguinte
+template <const char* S, int P> struct ExprStaticExpr;
+template <const char* S, int P> struct ExprStaticFailure {
+	typedef ExprStaticError Type;
+	static constexpr int end = P;
+};
+template <const char* S, int P, int K = (P < 0 ? -1 : ExprStaticScan::term(S, P))>
+struct ExprStaticOpr1: ExprStaticFailure <S, P> {};
+template <const char* S, int P> struct ExprStaticOpr1 <S, P, 0> {
+	static constexpr int numEnd = ExprStaticScan::numEnd(S, P);
+	typedef typename std::conditional <numEnd < 0, ExprStaticError, ExprStaticNum <S, P> >::type
+		Type;
+	static constexpr int end = numEnd < 0 ? P : ExprStaticScan::skip(S, numEnd);
+};
+// Identificador: constante padrão, variável ou chamada (de uma função padrão, com um argumento)
+template <const char* S, int P, bool Call> struct ExprStaticId {
+	static constexpr int constant = ExprStaticScan::constant(S, P);
+	typedef typename std::conditional <constant >= 0, ExprStaticStd <constant>,
+		ExprStaticArg <ExprStaticVars <S>::Type::before(S, P)> >::type Type;
+	static constexpr int end = ExprStaticScan::skip(S, ExprStaticScan::idEnd(S, P));
+};
+template <const char* S, int P> struct ExprStaticId <S, P, true> {
+	static constexpr int function = ExprStaticScan::function(S, P);
+	typedef ExprStaticExpr <S, ExprStaticScan::skip(S, ExprStaticScan::skip(S,
+		ExprStaticScan::idEnd(S, P)) + 1)> Arg;
+	static constexpr bool closed = S[Arg::end] == ')';
+	typedef typename std::conditional <function >= 0 && closed, ExprStaticCall <function,
+		typename Arg::Type>, ExprStaticError>::type Type;
+	static constexpr int end = closed ? ExprStaticScan::skip(S, Arg::end + 1) : Arg::end;
+};
+template <const char* S, int P> struct ExprStaticOpr1 <S, P, 1>: ExprStaticId <S, P,
+	S[ExprStaticScan::skip(S, ExprStaticScan::idEnd(S, P))] == '('> {};
+// Parênteses e módulo: a expressão interna precisa terminar com o caractere C
+template <const char* S, int P, char C> struct ExprStaticGroup {
+	typedef ExprStaticExpr <S, ExprStaticScan::skip(S, P + 1)> Inner;
+	static constexpr bool closed = S[Inner::end] == C;
+	typedef typename std::conditional <!closed, ExprStaticError, typename std::conditional <C ==
+		'|', ExprStaticAbs <typename Inner::Type>, typename Inner::Type>::type>::type Type;
+	static constexpr int end = closed ? ExprStaticScan::skip(S, Inner::end + 1) : Inner::end;
+};
+template <const char* S, int P> struct ExprStaticOpr1 <S, P, 2>: ExprStaticGroup <S, P, ')'> {};
+template <const char* S, int P> struct ExprStaticOpr1 <S, P, 3>: ExprStaticGroup <S, P, '|'> {};
+// Termo com o sinal opcional, como em ExprParser::parseOpr2
+template <const char* S, int P> struct ExprStaticSigned {
+	static constexpr bool neg = S[P] == '-';
+	typedef ExprStaticOpr1 <S, neg ? ExprStaticScan::skip(S, P + 1) : P> Term;
+	typedef typename std::conditional <neg, ExprStaticNeg <typename Term::Type>,
+		typename Term::Type>::type Type;
+	static constexpr int end = Term::end;
+};
+template <const char* S, int P, class L, char C = S[P]> struct ExprStaticPowRest {
+	typedef L Type;
+	static constexpr int end = P;
+};
+template <const char* S, int P, class L> struct ExprStaticPowRest <S, P, L, '^'> {
+	typedef ExprStaticSigned <S, ExprStaticScan::skip(S, P + 1)> R;
+	typedef ExprStaticPowRest <S, R::end, ExprStaticOpr <'^', L, typename R::Type> > Next;
+	typedef typename Next::Type Type;
+	static constexpr int end = Next::end;
+};
+// O sinal inicial se aplica ao resultado das potências: -x^2 = -(x^2)
+template <const char* S, int P> struct ExprStaticOpr2 {
+	static constexpr bool neg = S[P] == '-';
+	typedef ExprStaticOpr1 <S, neg ? ExprStaticScan::skip(S, P + 1) : P> First;
+	typedef ExprStaticPowRest <S, First::end, typename First::Type> Rest;
+	typedef typename std::conditional <neg, ExprStaticNeg <typename Rest::Type>,
+		typename Rest::Type>::type Type;
+	static constexpr int end = Rest::end;
+};
+template <const char* S, int P, class L, char C = S[P]> struct ExprStaticMulRest {
+	typedef L Type;
+	static constexpr int end = P;
+};
+template <const char* S, int P, class L, char C> struct ExprStaticMulNext {
+	typedef ExprStaticOpr2 <S, ExprStaticScan::skip(S, P + 1)> R;
+	typedef ExprStaticMulRest <S, R::end, ExprStaticOpr <C, L, typename R::Type> > Next;
+	typedef typename Next::Type Type;
+	static constexpr int end = Next::end;
+};
+template <const char* S, int P, class L> struct ExprStaticMulRest <S, P, L, '*'>:
+	ExprStaticMulNext <S, P, L, '*'> {};
+template <const char* S, int P, class L> struct ExprStaticMulRest <S, P, L, '/'>:
+	ExprStaticMulNext <S, P, L, '/'> {};
+template <const char* S, int P> struct ExprStaticOpr3 {
+	typedef ExprStaticOpr2 <S, P> First;
+	typedef ExprStaticMulRest <S, First::end, typename First::Type> Rest;
+	typedef typename Rest::Type Type;
+	static constexpr int end = Rest::end;
+};
+template <const char* S, int P, class L, char C = S[P]> struct ExprStaticAddRest {
+	typedef L Type;
+	static constexpr int end = P;
+};
+template <const char* S, int P, class L, char C> struct ExprStaticAddNext {
+	typedef ExprStaticOpr3 <S, ExprStaticScan::skip(S, P + 1)> R;
+	typedef ExprStaticAddRest <S, R::end, ExprStaticOpr <C, L, typename R::Type> > Next;
+	typedef typename Next::Type Type;
+	static constexpr int end = Next::end;
+};
+template <const char* S, int P, class L> struct ExprStaticAddRest <S, P, L, '+'>:
+	ExprStaticAddNext <S, P, L, '+'> {};
+template <const char* S, int P, class L> struct ExprStaticAddRest <S, P, L, '-'>:
+	ExprStaticAddNext <S, P, L, '-'> {};
+template <const char* S, int P> struct ExprStaticOpr4 {
+	typedef ExprStaticOpr3 <S, P> First;
+	typedef ExprStaticAddRest <S, First::end, typename First::Type> Rest;
+	typedef typename Rest::Type Type;
+	static constexpr int end = Rest::end;
+};
+template <const char* S, int P, class L, int K = ExprStaticScan::comparison(S, P)>
+struct ExprStaticCmpRest {
+	typedef ExprStaticOpr4 <S, ExprStaticScan::skip(S, P + (K == 0 || K == 2 ? 1 : 2))> R;
+	typedef ExprStaticCmpRest <S, R::end, ExprStaticCmp <K, L, typename R::Type> > Next;
+	typedef typename Next::Type Type;
+	static constexpr int end = Next::end;
+};
+template <const char* S, int P, class L> struct ExprStaticCmpRest <S, P, L, -1> {
+	typedef L Type;
+	static constexpr int end = P;
+};
+template <const char* S, int P> struct ExprStaticOpr5 {
+	typedef ExprStaticOpr4 <S, P> First;
+	typedef ExprStaticCmpRest <S, First::end, typename First::Type> Rest;
+	typedef typename Rest::Type Type;
+	static constexpr int end = Rest::end;
+};
+// c ? a : b, associativo à direita como em ExprParser::parseExpr
+template <const char* S, int P, class C, char Q = S[P]> struct ExprStaticCondRest {
+	typedef C Type;
+	static constexpr int end = P;
+};
+template <const char* S, int P, class C> struct ExprStaticCondRest <S, P, C, '?'> {
+	typedef ExprStaticExpr <S, ExprStaticScan::skip(S, P + 1)> L;
+	static constexpr bool colon = S[L::end] == ':';
+	typedef ExprStaticExpr <S, colon ? ExprStaticScan::skip(S, L::end + 1) : L::end> R;
+	typedef typename std::conditional <colon, ExprStaticSelect <C, typename L::Type,
+		typename R::Type>, ExprStaticError>::type Type;
+	static constexpr int end = colon ? R::end : L::end;
+};
+template <const char* S, int P> struct ExprStaticExpr {
+	typedef ExprStaticOpr5 <S, P> First;
+	typedef ExprStaticCondRest <S, First::end, typename First::Type> Rest;
+	typedef typename Rest::Type Type;
+	static constexpr int end = Rest::end;
+};
+
+template <const char* S> class ExprStatic {
+private:
+	typedef ExprStaticExpr <S, ExprStaticScan::skip(S, 0)> Parsed;
+	static_assert(Parsed::Type::ok && Parsed::end == ExprStaticScan::length(S, 0),
+		"ExprStatic: erro de sintaxe na expressão");
+	struct Row {
+		const double* args;
+		double operator()(int i) const {
+			return args[i];
 		}
-		return Expr(parsedTree);
+	};
+	struct Column {
+		const double* const* cols;
+		long row;
+		double operator()(int i) const {
+			return cols[i][row];
+		}
+	};
+public:
+	typedef typename Parsed::Type Tree;
+	// Quantidade de argumentos: as variáveis distintas, numeradas em ordem alfabética
+	static constexpr int nArgs = ExprStaticVars <S>::Type::size;
+	static double calc(const double args[]) {
+		Row row = {args};
+		return Tree::calc(row);
 	}
-	~ExprParser() {
-		if (parsedTree) delete parsedTree;
+	// Avaliação em lote, como Expr::calc: cols[i] aponta para a coluna do i-ésimo argumento
+	static void calc(const double* const cols[], double res[], long n) {
+		for (long i=0; i<n; ++i) {
+			Column column = {cols, i};
+			res[i] = Tree::calc(column);
+		}
 	}
 };
+#endif
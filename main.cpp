@@ -1,20 +1,294 @@
 #include "expression.h"
-#include <string>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 using namespace std;
 
-int main() {
+// Calcula uma expressão para cada linha de um arquivo de dados, associando cada variável livre à
+// coluna de mesmo nome, e escreve um resultado por linha. A entrada é mapeada em memória e
+// percorrida em blocos, de forma que o arquivo nunca é carregado inteiro.
+// Compilação: g++ -std=c++11 -O2 -pthread main.cpp -o main
+//
+// Uso: main [-t threads] [-b] <expressão> <entrada> [saída]
+//   -t  threads usadas no cálculo de cada bloco (0 = uma por núcleo; padrão 1)
+//   -b  escreve os resultados como doubles binários em vez de texto
+//   --  fim das opções, para expressões que começam com '-'
+//   saída omitida ou "-" escreve em stdout
+//
+// A entrada é um CSV, com os nomes das colunas na primeira linha, ou um arquivo colunar binário:
+//   "EXPRCOLS"                 8 bytes
+//   colunas, linhas            dois inteiros de 64 bits
+//   nomes das colunas          cada um terminado em '\0', completados com '\0' até múltiplo de 8
+//   dados                      cada coluna em sequência, com linhas doubles
+// No formato binário as colunas são usadas direto do mapeamento, sem cópia
 
-	std::string str;
-	ExprParser parser;
+// Linhas calculadas por bloco
+#define MAIN_CHUNK 65536
 
-	cout << "Expressao: ";
-	getline(cin, str);
+struct MappedFile {
+	const char* data;
+	size_t size;
+	MappedFile() {
+		data = nullptr;
+		size = 0;
+	}
+	bool open(const char* path) {
+		int fd = ::open(path, O_RDONLY);
+		if (fd < 0) return false;
+		struct stat st;
+		if (fstat(fd, &st) != 0) {
+			close(fd);
+			return false;
+		}
+		size = st.st_size;
+		if (size > 0) {
+			void* ptr = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (ptr == MAP_FAILED) {
+				close(fd);
+				return false;
+			}
+			madvise(ptr, size, MADV_SEQUENTIAL);
+			data = (const char*) ptr;
+		}
+		close(fd);
+		return true;
+	}
+	~MappedFile() {
+		if (data) munmap((void*) data, size);
+	}
+};
 
-	parser.parse(str);
-	parser.std();
+// Destino dos resultados, em texto (um por linha, com precisão suficiente para reler o double
+// exato) ou binário
+class Output {
+private:
+	FILE* file;
+	bool binary;
+	vector<char> text;
+public:
+	Output(FILE* file, bool binary): file(file), binary(binary) {
+		if (!binary) text.resize(MAIN_CHUNK * 32);
+	}
+	bool write(const double res[], long n) {
+		if (binary) return fwrite(res, sizeof(double), n, file) == (size_t) n;
+		char* ptr = text.data();
+		for (long i=0; i<n; ++i) {
+			ptr += snprintf(ptr, 32, "%.17g\n", res[i]);
+		}
+		return fwrite(text.data(), 1, ptr - text.data(), file) == (size_t) (ptr - text.data());
+	}
+};
+
+class Evaluator {
+private:
+	const Expr &expr;
+	ExprThreadPool* pool;
+	vector<double> res;
+public:
+	Evaluator(const Expr &expr, ExprThreadPool* pool): expr(expr), pool(pool), res(MAIN_CHUNK) {}
+	// cols[i] aponta para as n linhas do bloco do i-ésimo argumento
+	bool run(const double* const cols[], long n, Output &out) {
+		if (pool) {
+			expr.calc(cols, res.data(), n, *pool);
+		} else {
+			expr.calc(cols, res.data(), (int) n);
+		}
+		return out.write(res.data(), n);
+	}
+};
+
+// Posição de cada argumento entre as colunas; -1 se alguma variável não tiver coluna
+static bool mapColumns(const vector<string> &vars, const vector<string> &names, vector<int> &map) {
+	map.assign(vars.size(), -1);
+	for (size_t i=0; i<vars.size(); ++i) {
+		for (size_t j=0; j<names.size(); ++j) {
+			if (names[j] == vars[i]) map[i] = j;
+		}
+		if (map[i] == -1) {
+			cerr << "Coluna nao encontrada: " << vars[i] << "\n";
+			return false;
+		}
+	}
+	return true;
+}
+
+static bool runBinary(const MappedFile &file, const vector<string> &vars, Evaluator &eval,
+	Output &out) {
+	uint64_t header[2];
+	if (file.size < 24 || memcmp(file.data, "EXPRCOLS", 8) != 0) {
+		cerr << "Arquivo colunar invalido\n";
+		return false;
+	}
+	memcpy(header, file.data + 8, sizeof(header));
+	uint64_t nCols = header[0], nRows = header[1];
+	vector<string> names;
+	size_t pos = 24;
+	for (uint64_t i=0; i<nCols; ++i) {
+		const char* end = (const char*) memchr(file.data + pos, 0, file.size - pos);
+		if (!end) {
+			cerr << "Arquivo colunar invalido\n";
+			return false;
+		}
+		names.push_back(string(file.data + pos, end));
+		pos = end - file.data + 1;
+	}
+	pos = (pos + 7) / 8 * 8;
+	if (nRows > 0 && (pos > file.size || (file.size - pos) / sizeof(double) / nRows < nCols)) {
+		cerr << "Arquivo colunar truncado\n";
+		return false;
+	}
+	vector<int> map;
+	if (!mapColumns(vars, names, map)) return false;
+	const double* data = (const double*) (file.data + pos);
+	vector<const double*> cols(vars.size());
+	for (uint64_t begin=0; begin<nRows; begin+=MAIN_CHUNK) {
+		long n = min<uint64_t>(MAIN_CHUNK, nRows - begin);
+		for (size_t i=0; i<cols.size(); ++i) cols[i] = data + map[i] * nRows + begin;
+		if (!eval.run(cols.data(), n, out)) return false;
+	}
+	return true;
+}
+
+// Separa os campos de uma linha do CSV entre ptr e end; devolve o início da linha seguinte
+static const char* splitLine(const char* ptr, const char* end, vector<pair<const char*,
+	const char*> > &fields) {
+	fields.clear();
+	const char* start = ptr;
+	for (;; ++ptr) {
+		if (ptr == end || *ptr == '\n' || *ptr == ',') {
+			const char* last = ptr;
+			if (last > start && last[-1] == '\r') --last;
+			fields.push_back(make_pair(start, last));
+			if (ptr == end) return end;
+			if (*ptr == '\n') return ptr + 1;
+			start = ptr + 1;
+		}
+	}
+}
+
+static string trim(const char* begin, const char* end) {
+	while (begin < end && (*begin == ' ' || *begin == '"')) ++begin;
+	while (end > begin && (end[-1] == ' ' || end[-1] == '"')) --end;
+	return string(begin, end);
+}
+
+// Campo vazio ou não numérico resulta em NaN
+static double parseNumber(const char* begin, const char* end) {
+	char buf[64];
+	size_t len = end - begin;
+	if (len == 0 || len >= sizeof(buf)) return NAN;
+	memcpy(buf, begin, len);
+	buf[len] = 0;
+	char* last;
+	double value = strtod(buf, &last);
+	while (*last == ' ') ++last;
+	return *last ? NAN : value;
+}
+
+static bool runCsv(const MappedFile &file, const vector<string> &vars, Evaluator &eval,
+	Output &out) {
+	const char* ptr = file.data;
+	const char* end = file.data + file.size;
+	vector<pair<const char*, const char*> > fields;
+	vector<string> names;
+	ptr = splitLine(ptr, end, fields);
+	for (auto &field : fields) names.push_back(trim(field.first, field.second));
+	vector<int> map;
+	if (!mapColumns(vars, names, map)) return false;
+	vector<vector<double> > buf(vars.size(), vector<double>(MAIN_CHUNK));
+	vector<const double*> cols(vars.size());
+	for (size_t i=0; i<cols.size(); ++i) cols[i] = buf[i].data();
+	while (ptr < end) {
+		long n = 0;
+		while (ptr < end && n < MAIN_CHUNK) {
+			ptr = splitLine(ptr, end, fields);
+			// Linhas em branco são ignoradas
+			if (fields.size() == 1 && fields[0].first == fields[0].second) continue;
+			for (size_t i=0; i<map.size(); ++i) {
+				buf[i][n] = (size_t) map[i] < fields.size() ?
+					parseNumber(fields[map[i]].first, fields[map[i]].second) : NAN;
+			}
+			++n;
+		}
+		if (n > 0 && !eval.run(cols.data(), n, out)) return false;
+	}
+	return true;
+}
+
+static int usage() {
+	cerr << "Uso: main [-t threads] [-b] <expressao> <entrada> [saida]\n";
+	return 1;
+}
+
+int main(int argc, char* argv[]) {
+
+	int nThreads = 1;
+	bool binary = false;
+	int i = 1;
+	for (; i < argc && argv[i][0] == '-' && argv[i][1]; ++i) {
+		if (!strcmp(argv[i], "--")) {
+			++i;
+			break;
+		} else if (!strcmp(argv[i], "-b")) {
+			binary = true;
+		} else if (!strcmp(argv[i], "-t") && i + 1 < argc) {
+			nThreads = atoi(argv[++i]);
+		} else {
+			return usage();
+		}
+	}
+	if (argc - i < 2 || argc - i > 3) return usage();
+	const char* src = argv[i];
+	const char* input = argv[i + 1];
+	const char* output = argc - i == 3 ? argv[i + 2] : "-";
 
+	ExprParser parser;
+	if (!parser.parse(src)) {
+		cerr << "Erro na expressao, posicao " << parser.error() << "\n";
+		return 1;
+	}
+	parser.std();
+	vector<string> calls = parser.nullCalls();
+	if (!calls.empty()) {
+		cerr << "Funcao desconhecida: " << calls[0] << "\n";
+		return 1;
+	}
+	// toExpr atribui as variáveis livres aos argumentos em ordem alfabética, a mesma de nullVars
+	vector<string> vars = parser.nullVars();
 	Expr expr = parser.toExpr();
-	cout << expr.calc(5) << "\n";
+
+	MappedFile file;
+	if (!file.open(input)) {
+		cerr << "Nao foi possivel abrir " << input << "\n";
+		return 1;
+	}
+	FILE* outFile = strcmp(output, "-") ? fopen(output, binary ? "wb" : "w") : stdout;
+	if (!outFile) {
+		cerr << "Nao foi possivel criar " << output << "\n";
+		return 1;
+	}
+	ExprThreadPool* pool = nThreads != 1 ? new ExprThreadPool(nThreads) : nullptr;
+	Evaluator eval(expr, pool);
+	Output out(outFile, binary);
+	bool isBinary = file.size >= 8 && memcmp(file.data, "EXPRCOLS", 8) == 0;
+	bool ok = isBinary ? runBinary(file, vars, eval, out) : runCsv(file, vars, eval, out);
+	if (outFile != stdout) {
+		ok = fclose(outFile) == 0 && ok;
+	} else {
+		ok = fflush(stdout) == 0 && ok;
+	}
+	delete pool;
+	if (!ok) {
+		cerr << "Erro ao processar " << input << "\n";
+		return 1;
+	}
 
 }